@@ -0,0 +1,268 @@
+#pragma once
+
+#include "../src/Aead.hpp"
+#include "../src/Compressor.hpp"
+#include "../src/CryptoContext.hpp"
+#include "../src/DiffieHellman.hpp"
+#include "../src/Packet.hpp"
+#include "../src/Protocol.hpp"
+
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include <arpa/inet.h>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+
+namespace Retchat {
+
+    constexpr size_t COMPRESS_MIN_SIZE = 64;  // same as the server's default
+
+    // minimal blocking protocol client for the benchmarks
+    class BenchClient {
+    public:
+        ~BenchClient() { if (fd >= 0) ::close(fd); }
+
+        bool connect(const std::string& host, int port) {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd < 0) return false;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            struct sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+            return ::connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+        }
+
+        // x25519 answers the server's DH key with an X25519 one and negotiates version 2, asking
+        // for the FEAT_* bits in wanted: at most one cipher, room keys, batch frames and so on
+        bool handshake(bool x25519 = false, uint32_t wanted = 0) {
+            uint32_t netLen;
+            if (!recvAll(&netLen, 4)) return false;
+            std::vector<uint8_t> serverPub(ntohl(netLen));
+            if (!recvAll(serverPub.data(), serverPub.size())) return false;
+
+            uint8_t xPriv[X25519_KEY_SIZE];
+            if (x25519) {
+                uint8_t msg[4 + X25519_KEY_SIZE];
+                if (!X25519::generateKeyPair(xPriv, msg + 4)) return false;
+                netLen = htonl(KEY_X25519_FLAG | X25519_KEY_SIZE);
+                memcpy(msg, &netLen, 4);
+                if (!sendAll(msg, sizeof(msg))) return false;
+            } else {
+                BIGNUM* priv = BN_new(); BIGNUM* pub = BN_new();
+                BIGNUM* peer = BN_bin2bn(serverPub.data(), serverPub.size(), nullptr);
+                BIGNUM* shared = BN_new();
+                DH::generatePrivateKey(priv);
+                DH::computePublicKey(priv, pub);
+                std::vector<uint8_t> msg(4 + BN_num_bytes(pub));
+                netLen = htonl(msg.size() - 4);
+                memcpy(msg.data(), &netLen, 4);
+                BN_bn2bin(pub, msg.data() + 4);
+                DH::computeSharedSecret(peer, priv, shared);
+                DH::deriveEncKey(shared, encKey);
+                crypto.init(encKey);
+                BN_free(priv); BN_free(pub); BN_free(peer); BN_free(shared);
+                if (!sendAll(msg.data(), msg.size())) return false;
+            }
+
+            if (x25519) {
+                // the server's X25519 key comes raw, right before the version exchange
+                uint8_t peer[4 + X25519_KEY_SIZE];
+                if (!recvAll(peer, sizeof(peer))) return false;
+                memcpy(&netLen, peer, 4);
+                if (ntohl(netLen) != (KEY_X25519_FLAG | X25519_KEY_SIZE)) return false;
+                if (!X25519::deriveEncKey(xPriv, peer + 4, encKey)) return false;
+                crypto.init(encKey);
+            }
+
+            std::vector<uint8_t> plain;
+            if (!readFrame(plain) || plain.empty() || plain[0] != PKT_HANDSHAKE) return false;
+            if (!x25519) return sendFrame(plain);  // echo the version back
+
+            HandshakePacket offer;
+            if (!offer.deserialize(plain.data() + 1, plain.size() - 1)) return false;
+            HandshakePacket reply;
+            reply.version = offer.version;
+            reply.features = offer.features & wanted;
+            if (!sendPacket(reply)) return false;
+            compressing = reply.features & FEAT_COMPRESS;
+            if (reply.features & FEAT_CIPHERS) {
+                cipher = reply.features & FEAT_CIPHERS;
+                if (!aead.init(cipher, encKey, false)) return false;
+                sendCounter = recvCounter = 0;
+            }
+            return true;
+        }
+
+        template <typename P>
+        bool sendPacket(const P& pkt) {
+            std::vector<uint8_t> payload;
+            payload.push_back(P::TYPE);
+            pkt.serialize(payload);
+            return sendFrame(payload);
+        }
+
+        bool sendFrame(std::vector<uint8_t> payload) {
+            if (compressing && payload.size() >= COMPRESS_MIN_SIZE) {
+                std::vector<uint8_t> deflated{ PKT_COMPRESSED };
+                if (!compressor.compress(payload.data(), payload.size(), deflated)) return false;
+                payload.swap(deflated);
+            }
+            if (aead.isActive()) {
+                std::vector<uint8_t> frame(AEAD_HEADER_SIZE + payload.size());
+                uint32_t netLen = htonl(payload.size());
+                memcpy(frame.data() + AEAD_TAG_SIZE, &netLen, 4);
+                memcpy(frame.data() + AEAD_HEADER_SIZE, payload.data(), payload.size());
+                if (!aead.seal(sendCounter++, frame.data() + AEAD_TAG_SIZE, 4, frame.data() + AEAD_HEADER_SIZE,
+                               payload.size(), frame.data())) return false;
+                return sendAll(frame.data(), frame.size());
+            }
+            crypto.xorCrypt(payload.data(), payload.size(), sendCounter++);
+            std::vector<uint8_t> frame(36 + payload.size());
+            crypto.mac(payload.data(), payload.size(), frame.data());
+            uint32_t netLen = htonl(payload.size());
+            memcpy(frame.data() + 32, &netLen, 4);
+            memcpy(frame.data() + 36, payload.data(), payload.size());
+            return sendAll(frame.data(), frame.size());
+        }
+
+        bool readFrame(std::vector<uint8_t>& plain) {
+            if (aead.isActive()) {
+                uint8_t header[AEAD_HEADER_SIZE];
+                if (!recvAll(header, sizeof(header))) return false;
+                uint32_t netLen;
+                memcpy(&netLen, header + AEAD_TAG_SIZE, 4);
+                netLen = ntohl(netLen);
+                if (netLen & ROOM_FRAME_FLAG) return readRoomFrame(header, netLen & ~ROOM_FRAME_FLAG, plain);
+                plain.resize(netLen);
+                if (!recvAll(plain.data(), plain.size())) return false;
+                if (!aead.open(recvCounter++, header + AEAD_TAG_SIZE, 4, plain.data(), plain.size(), header)) return false;
+                if (!inflate(plain)) return false;
+                if (!plain.empty() && plain[0] == PKT_ROOM_KEY) return takeRoomKey(plain);
+                return true;
+            }
+            uint8_t header[36];
+            if (!recvAll(header, sizeof(header))) return false;
+            uint32_t netLen;
+            memcpy(&netLen, header + 32, 4);
+            plain.resize(ntohl(netLen));
+            if (!recvAll(plain.data(), plain.size())) return false;
+            uint8_t expected[32];
+            crypto.mac(plain.data(), plain.size(), expected);
+            if (CRYPTO_memcmp(header, expected, 32) != 0) return false;
+            crypto.xorCrypt(plain.data(), plain.size(), recvCounter++);
+            return inflate(plain);
+        }
+
+        // one packet at a time, unpacking batch frames
+        bool readPacket(std::vector<uint8_t>& plain) {
+            if (batchOff < batch.size()) return nextBatched(plain);
+            if (!readFrame(plain)) return false;
+            if (plain.empty() || plain[0] != PKT_BATCH) return true;
+            batch.swap(plain);
+            batchOff = 1;
+            return nextBatched(plain);
+        }
+
+        int getFd() const { return fd; }
+        uint64_t getBytesReceived() const { return bytesReceived; }
+
+    private:
+        bool inflate(std::vector<uint8_t>& plain) {
+            if (plain.empty() || plain[0] != PKT_COMPRESSED) return true;
+            inflated.clear();
+            if (!compressor.decompress(plain.data() + 1, plain.size() - 1, inflated, 2 * 1024 * 1024)) return false;
+            plain.swap(inflated);
+            return true;
+        }
+
+        bool nextBatched(std::vector<uint8_t>& plain) {
+            if (batch.size() - batchOff < 2) return false;
+            size_t len = ((size_t) batch[batchOff] << 8) | batch[batchOff + 1];
+            batchOff += 2;
+            if (len == 0 || batch.size() - batchOff < len) return false;
+            plain.assign(batch.begin() + batchOff, batch.begin() + batchOff + len);
+            batchOff += len;
+            if (plain[0] == PKT_ROOM_KEY) return takeRoomKey(plain);
+            return true;
+        }
+
+        struct RoomKey {
+            Aead aead;
+            uint64_t nextCounter = 0;
+        };
+
+        bool takeRoomKey(const std::vector<uint8_t>& plain) {
+            RoomKeyPacket pkt;
+            if (!pkt.deserialize(plain.data() + 1, plain.size() - 1)) return false;
+            auto& rk = roomKeys[pkt.keyId];
+            rk.reset(new RoomKey());
+            return rk->aead.initRoom(cipher, pkt.key);
+        }
+
+        bool readRoomFrame(const uint8_t header[AEAD_HEADER_SIZE], uint32_t len, std::vector<uint8_t>& plain) {
+            uint8_t ad[ROOM_FRAME_HEADER_SIZE - AEAD_TAG_SIZE];
+            memcpy(ad, header + AEAD_TAG_SIZE, 4);
+            if (!recvAll(ad + 4, sizeof(ad) - 4)) return false;
+            uint32_t netId;
+            memcpy(&netId, ad + 4, 4);
+            uint64_t counter = 0;
+            for (int i = 0; i < 8; i++) counter = (counter << 8) | ad[8 + i];
+            plain.resize(len);
+            if (!recvAll(plain.data(), plain.size())) return false;
+
+            // the key always comes first, and a key's counters only go up
+            auto it = roomKeys.find(ntohl(netId));
+            if (it == roomKeys.end() || counter < it->second->nextCounter) return false;
+            it->second->nextCounter = counter + 1;
+            return it->second->aead.open(counter, ad, sizeof(ad), plain.data(), plain.size(), header);
+        }
+
+        bool sendAll(const void* data, size_t len) {
+            const uint8_t* p = static_cast<const uint8_t*>(data);
+            while (len > 0) {
+                ssize_t w = send(fd, p, len, MSG_NOSIGNAL);
+                if (w <= 0) return false;
+                p += w; len -= w;
+            }
+            return true;
+        }
+
+        bool recvAll(void* data, size_t len) {
+            uint8_t* p = static_cast<uint8_t*>(data);
+            while (len > 0) {
+                ssize_t r = recv(fd, p, len, 0);
+                if (r <= 0) return false;
+                p += r; len -= r;
+                bytesReceived += r;
+            }
+            return true;
+        }
+
+        int fd = -1;
+        uint8_t encKey[32];
+        uint64_t sendCounter = 0, recvCounter = 0;
+        CryptoContext crypto;
+        Aead aead;
+        uint32_t cipher = 0;
+        std::map<uint32_t, std::unique_ptr<RoomKey>> roomKeys;
+        std::vector<uint8_t> batch;  // the batch frame readPacket is working through
+        size_t batchOff = 0;
+        bool compressing = false;
+        Compressor compressor;
+        std::vector<uint8_t> inflated;
+        uint64_t bytesReceived = 0;
+    };
+
+}
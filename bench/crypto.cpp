@@ -0,0 +1,207 @@
+// frame sealing throughput on one thread, for a few frame sizes from chat lines up to images:
+// the version 1 HMAC keystream + HMAC tag as it was originally done (fresh HMAC context per
+// block, keystream vector per frame), the same through a pre-keyed CryptoContext, and the
+// version 2 AEAD ciphers. no sockets involved, this is the per-recipient cost of every frame
+// the server sends. it first checks that CryptoContext produces the original bytes exactly,
+// and that batched sealing gives the same frames as sealing them one by one on every SIMD
+// kernel the cpu has
+
+#include "../src/Aead.hpp"
+#include "../src/CryptoContext.hpp"
+#include "../src/DiffieHellman.hpp"
+#include "../src/Protocol.hpp"
+#include "../src/Sha256Lanes.hpp"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace Retchat;
+using Clock = std::chrono::steady_clock;
+
+// the version 1 scheme exactly as it was before CryptoContext, kept as the reference
+static void originalKeystream(uint8_t* keystream, size_t len, const uint8_t* baseKey, uint64_t counter) {
+    uint8_t counterBytes[8];
+    for (int i = 0; i < 8; i++) counterBytes[i] = (counter >> (i * 8)) & 0xFF;
+    uint8_t digest[32];
+    unsigned int digestLen;
+    // one-shot HMAC() sets up a fresh context each call, just like the original code did by hand
+    HMAC(EVP_sha256(), baseKey, 32, counterBytes, 8, digest, &digestLen);
+    size_t copied = 0;
+    while (copied < len) {
+        size_t chunk = std::min(len - copied, size_t(32));
+        memcpy(keystream + copied, digest, chunk);
+        copied += chunk;
+        if (copied < len) HMAC(EVP_sha256(), baseKey, 32, digest, 32, digest, &digestLen);
+    }
+}
+
+static void originalXorCrypt(uint8_t* data, size_t len, const uint8_t* key, uint64_t counter) {
+    std::vector<uint8_t> keystream(len);
+    originalKeystream(keystream.data(), len, key, counter);
+    for (size_t i = 0; i < len; i++) data[i] ^= keystream[i];
+}
+
+static bool checkIdentical(const uint8_t key[32], const CryptoContext& ctx) {
+    // every tail length around the block size, plus a few bigger frames and counters
+    for (size_t len = 0; len <= 4096; len += (len < 100 ? 1 : 997)) {
+        for (uint64_t counter : { 0ULL, 1ULL, 255ULL, 0x0123456789abcdefULL }) {
+            std::vector<uint8_t> a(len), b;
+            for (size_t i = 0; i < len; i++) a[i] = (uint8_t) (i * 31 + counter);
+            b = a;
+            originalXorCrypt(a.data(), len, key, counter);
+            ctx.xorCrypt(b.data(), len, counter);
+            uint8_t macA[32], macB[32];
+            unsigned int macLen;
+            HMAC(EVP_sha256(), key, 32, a.data(), len, macA, &macLen);
+            ctx.mac(b.data(), len, macB);
+            if (a != b || memcmp(macA, macB, 32) != 0) {
+                fprintf(stderr, "mismatch at len=%zu counter=%llu\n", len, (unsigned long long) counter);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// the kernels this cpu can run, 1 is the single-buffer path
+static std::vector<unsigned int> laneCounts() {
+    std::vector<unsigned int> counts = { 1 };
+    if (sha256LaneCount() >= 8) counts.push_back(8);
+    if (sha256LaneCount() >= 16) counts.push_back(16);
+    return counts;
+}
+
+static bool checkBatch() {
+    // mixed keys, counters and lengths, so lanes finish at different times and get refilled
+    const size_t n = 53;
+    std::vector<CryptoContext> ctxs(5);
+    for (size_t k = 0; k < ctxs.size(); k++) {
+        uint8_t key[32];
+        for (int i = 0; i < 32; i++) key[i] = (uint8_t) (i * 13 + k * 101);
+        ctxs[k].init(key);
+    }
+    std::vector<std::vector<uint8_t>> in(n);
+    for (size_t j = 0; j < n; j++) {
+        size_t len = j < 40 ? j * 3 : (j - 39) * 1021;
+        for (size_t i = 0; i < len; i++) in[j].push_back((uint8_t) (i * 7 + j));
+    }
+    for (unsigned int lanes : laneCounts()) {
+        for (size_t count : { n, (size_t) 3, (size_t) 1 }) {
+            std::vector<std::vector<uint8_t>> out(count), tags(count, std::vector<uint8_t>(32));
+            std::vector<CryptoContext::SealJob> jobs;
+            for (size_t j = 0; j < count; j++) {
+                out[j].resize(in[j].size());
+                jobs.push_back({ &ctxs[j % ctxs.size()], j * 0x1000001ULL, in[j].data(), out[j].data(), in[j].size(), tags[j].data() });
+            }
+            CryptoContext::sealBatch(jobs.data(), jobs.size(), lanes);
+            for (size_t j = 0; j < count; j++) {
+                std::vector<uint8_t> expected = in[j];
+                uint8_t tag[32];
+                jobs[j].ctx->xorCrypt(expected.data(), expected.size(), jobs[j].counter);
+                jobs[j].ctx->mac(expected.data(), expected.size(), tag);
+                if (expected != out[j] || memcmp(tag, tags[j].data(), 32) != 0) {
+                    fprintf(stderr, "batch mismatch with %u lanes at frame %zu (len=%zu)\n", lanes, j, in[j].size());
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// keeps going until about `seconds` have passed, returns MB/s
+template <typename Fn>
+static double measure(size_t size, double seconds, Fn&& fn) {
+    size_t bytes = 0;
+    auto t0 = Clock::now();
+    double elapsed = 0;
+    uint64_t counter = 0;
+    while (elapsed < seconds) {
+        for (int i = 0; i < 16; i++) {
+            fn(counter++);
+            bytes += size;
+        }
+        elapsed = std::chrono::duration<double>(Clock::now() - t0).count();
+    }
+    return bytes / elapsed / 1e6;
+}
+
+int main(int argc, char** argv) {
+    double seconds = 0.5;
+    std::vector<size_t> sizes = { 64, 1024, 64 * 1024, 1024 * 1024 };
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--seconds" && i + 1 < argc) seconds = atof(argv[++i]);
+        else if (arg == "--size" && i + 1 < argc) sizes = { (size_t) atol(argv[++i]) };
+        else { fprintf(stderr, "usage: crypto [--seconds s] [--size bytes]\n"); return 1; }
+    }
+
+    uint8_t key[32];
+    for (int i = 0; i < 32; i++) key[i] = i * 7 + 1;
+    CryptoContext ctx;
+    ctx.init(key);
+    if (!checkIdentical(key, ctx)) return 1;
+    printf("CryptoContext output identical to the original scheme\n");
+    if (!checkBatch()) return 1;
+    printf("batched sealing identical on %u-lane kernels and below\n", laneCounts().back());
+
+    Aead aes, chacha;
+    aes.init(FEAT_AES_256_GCM, key, true);
+    chacha.init(FEAT_CHACHA20_POLY1305, key, true);
+
+    printf("%10s %14s %14s %14s %14s\n", "size", "v1 orig MB/s", "v1 ctx MB/s", "aes-gcm MB/s", "chacha MB/s");
+    for (size_t size : sizes) {
+        std::vector<uint8_t> data(size, 'x');
+        uint8_t tag[32];
+        uint8_t header[4] = {};
+
+        double orig = measure(size, seconds, [&](uint64_t counter) {
+            originalXorCrypt(data.data(), size, key, counter);
+            unsigned int len;
+            HMAC(EVP_sha256(), key, 32, data.data(), size, tag, &len);
+        });
+        double v1 = measure(size, seconds, [&](uint64_t counter) {
+            ctx.xorCrypt(data.data(), size, counter);
+            ctx.mac(data.data(), size, tag);
+        });
+        double gcm = measure(size, seconds, [&](uint64_t counter) {
+            aes.seal(counter, header, 4, data.data(), size, tag);
+        });
+        double cc = measure(size, seconds, [&](uint64_t counter) {
+            chacha.seal(counter, header, 4, data.data(), size, tag);
+        });
+        printf("%10zu %14.1f %14.1f %14.1f %14.1f\n", size, orig, v1, gcm, cc);
+    }
+
+    // one flush's worth of frames, as many as a busy client gets between two writes
+    const size_t batch = 16;
+    printf("\nv1 sealing %zu frames per batch (the server picks %u-lane here)\n%10s", batch,
+           CryptoContext::preferredLanes(), "size");
+    for (unsigned int lanes : laneCounts()) printf(" %9u-lane MB/s", lanes);
+    printf("\n");
+    for (size_t size : sizes) {
+        std::vector<std::vector<uint8_t>> frames(batch, std::vector<uint8_t>(size, 'x'));
+        std::vector<uint8_t> tags(batch * 32);
+        std::vector<CryptoContext::SealJob> jobs(batch);
+        printf("%10zu", size);
+        for (unsigned int lanes : laneCounts()) {
+            double mbs = measure(size * batch, seconds, [&](uint64_t counter) {
+                for (size_t j = 0; j < batch; j++) {
+                    jobs[j] = { &ctx, counter * batch + j, frames[j].data(), frames[j].data(), size, &tags[j * 32] };
+                }
+                CryptoContext::sealBatch(jobs.data(), batch, lanes);
+            });
+            printf(" %19.1f", mbs);
+        }
+        printf("\n");
+    }
+    return 0;
+}
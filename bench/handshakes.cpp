@@ -0,0 +1,119 @@
+// handshake throughput. opens connections as fast as a few threads can and completes the
+// key exchange and version exchange on each, reporting handshakes/sec and latency.
+// --mode picks the version 1 DH handshake or the version 2 X25519 one. --local skips the
+// network and times just the server's share of the crypto for both, on a single thread.
+
+#include "BenchClient.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Retchat;
+using Clock = std::chrono::steady_clock;
+
+// what the server does per handshake once its DH key is ready: the shared secret for
+// version 1, a fresh key pair plus the shared secret for version 2
+static void localBench(int iterations) {
+    BIGNUM* serverPriv = BN_new(); BIGNUM* serverPub = BN_new();
+    BIGNUM* clientPriv = BN_new(); BIGNUM* clientPub = BN_new();
+    BIGNUM* shared = BN_new();
+    Retchat::DH::generatePrivateKey(serverPriv);
+    Retchat::DH::computePublicKey(serverPriv, serverPub);
+    Retchat::DH::generatePrivateKey(clientPriv);
+    Retchat::DH::computePublicKey(clientPriv, clientPub);
+    uint8_t key[32];
+
+    auto t0 = Clock::now();
+    for (int i = 0; i < iterations; i++) {
+        Retchat::DH::computeSharedSecret(clientPub, serverPriv, shared);
+        Retchat::DH::deriveEncKey(shared, key);
+    }
+    double dhShared = std::chrono::duration<double>(Clock::now() - t0).count();
+
+    t0 = Clock::now();
+    for (int i = 0; i < iterations; i++) {
+        Retchat::DH::generatePrivateKey(serverPriv);
+        Retchat::DH::computePublicKey(serverPriv, serverPub);
+    }
+    double dhKeygen = std::chrono::duration<double>(Clock::now() - t0).count();
+
+    uint8_t peerPriv[32], peerPub[32], ownPub[32];
+    X25519::generateKeyPair(peerPriv, peerPub);
+    t0 = Clock::now();
+    for (int i = 0; i < iterations; i++) X25519::exchange(peerPub, ownPub, key);
+    double x = std::chrono::duration<double>(Clock::now() - t0).count();
+
+    BN_free(serverPriv); BN_free(serverPub); BN_free(clientPriv); BN_free(clientPub); BN_free(shared);
+
+    printf("server crypto per handshake, %d iterations on one thread:\n", iterations);
+    printf("  v1 dh shared secret:   %8.1f us  (%.0f/s)\n", dhShared / iterations * 1e6, iterations / dhShared);
+    printf("  v1 dh key generation:  %8.1f us  (%.0f/s, precomputed off the handshake path)\n", dhKeygen / iterations * 1e6, iterations / dhKeygen);
+    printf("  v2 x25519 keygen+derive: %6.1f us  (%.0f/s)\n", x / iterations * 1e6, iterations / x);
+}
+
+int main(int argc, char** argv) {
+    std::string host = "127.0.0.1";
+    int port = 6677;
+    int connections = 1000, threads = 4;
+    bool x25519 = false, local = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&]() { return i + 1 < argc ? argv[++i] : (char*) "0"; };
+        if (arg == "--host") host = next();
+        else if (arg == "--port") port = atoi(next());
+        else if (arg == "--connections") connections = atoi(next());
+        else if (arg == "--threads") threads = std::max(1, atoi(next()));
+        else if (arg == "--mode") x25519 = std::string(next()) == "v2";
+        else if (arg == "--local") local = true;
+        else { fprintf(stderr, "usage: handshakes [--host h] [--port p] [--connections n] [--threads t] [--mode v1|v2] [--local]\n"); return 1; }
+    }
+
+    Retchat::DH::init();
+    if (local) {
+        localBench(std::max(1, connections));
+        Retchat::DH::free();
+        return 0;
+    }
+
+    std::atomic<int> nextConn{0};
+    std::atomic<int> failed{0};
+    std::mutex samplesMutex;
+    std::vector<double> samples;
+
+    auto t0 = Clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            std::vector<double> local;
+            while (nextConn++ < connections) {
+                auto start = Clock::now();
+                BenchClient c;
+                if (!c.connect(host, port) || !c.handshake(x25519)) {
+                    failed++;
+                    continue;
+                }
+                local.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+            }
+            std::lock_guard<std::mutex> lock(samplesMutex);
+            samples.insert(samples.end(), local.begin(), local.end());
+        });
+    }
+    for (auto& t : workers) t.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - t0).count();
+
+    std::sort(samples.begin(), samples.end());
+    auto pct = [&](double p) { return samples.empty() ? 0.0 : samples[(size_t) (p * (samples.size() - 1))]; };
+    printf("mode=%s connections=%d threads=%d\n", x25519 ? "v2" : "v1", connections, threads);
+    printf("completed %zu (%d failed) in %.3fs: %.0f handshakes/s\n", samples.size(), failed.load(), elapsed, samples.size() / elapsed);
+    printf("latency us: p50=%.0f p90=%.0f p99=%.0f max=%.0f\n", pct(0.50), pct(0.90), pct(0.99), pct(1.0));
+
+    Retchat::DH::free();
+    return 0;
+}
@@ -0,0 +1,179 @@
+// image relay latency. one client sends images to a room of receivers, one at a time, and
+// reports how long each took to reach them: until the first image bytes were in, and until
+// the whole image was. images go out as a single PKT_IMAGE_MSG, or with --stream as an
+// image stream the server forwards chunk by chunk. with --refs the receivers take image refs
+// and fetch only the images they haven't seen, --distinct sets how many different images
+// the sender cycles through, so reposts can be measured.
+
+#include "BenchClient.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Retchat;
+using Clock = std::chrono::steady_clock;
+
+static uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char** argv) {
+    std::string host = "127.0.0.1";
+    int port = 6677;
+    int receivers = 10, images = 20;
+    size_t size = MAX_IMAGE_DATA_SIZE;
+    bool stream = false;
+    bool refs = false;
+    int distinct = 0;  // 0 = every image is different
+    uint32_t cipher = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&]() { return i + 1 < argc ? argv[++i] : (char*) "0"; };
+        if (arg == "--host") host = next();
+        else if (arg == "--port") port = atoi(next());
+        else if (arg == "--receivers") receivers = atoi(next());
+        else if (arg == "--images") images = atoi(next());
+        else if (arg == "--size") size = std::min<size_t>(strtoull(next(), nullptr, 10), MAX_IMAGE_DATA_SIZE);
+        else if (arg == "--stream") stream = true;
+        else if (arg == "--refs") refs = true;
+        else if (arg == "--distinct") distinct = atoi(next());
+        else if (arg == "--cipher") {
+            std::string name = next();
+            cipher = name == "aes" ? FEAT_AES_256_GCM : name == "chacha" ? FEAT_CHACHA20_POLY1305 : 0;
+        }
+        else { fprintf(stderr, "usage: images [--host h] [--port p] [--receivers n] [--images m] [--size bytes] [--stream] [--refs [--distinct n]] [--cipher aes|chacha]\n"); return 1; }
+    }
+    size = std::max<size_t>(size, 1);
+
+    // streams need version 2, so both modes use it and differ only in how the image is sent
+    Retchat::DH::init();
+    uint32_t wanted = cipher | FEAT_IMAGE_STREAMS | (refs ? FEAT_IMAGE_REFS : 0);
+    std::vector<std::unique_ptr<BenchClient>> conns;
+    for (int i = 0; i <= receivers; i++) {
+        auto c = std::make_unique<BenchClient>();
+        if (!c->connect(host, port) || !c->handshake(true, wanted)) {
+            fprintf(stderr, "client %d failed to connect\n", i);
+            return 1;
+        }
+        conns.push_back(std::move(c));
+    }
+    BenchClient& sender = *conns[0];
+
+    std::atomic<uint64_t> sentAt{0};
+    std::atomic<int> done{0};
+    std::mutex samplesMutex;
+    std::vector<uint64_t> firstSamples, fullSamples;
+
+    std::vector<std::thread> readers;
+    for (int r = 1; r <= receivers; r++) {
+        readers.emplace_back([&, r]() {
+            std::vector<uint8_t> plain;
+            std::vector<uint64_t> first, full;
+            size_t got = 0;
+            bool started = false;
+            std::set<std::vector<uint8_t>> have;  // hashes of the images already here
+            while ((int) full.size() < images && conns[r]->readPacket(plain)) {
+                if (plain.empty()) continue;
+                size_t bytes = 0;
+                if (plain[0] == PKT_IMAGE_MSG) {
+                    bytes = size;
+                } else if (plain[0] == PKT_IMAGE_REF) {
+                    ImageRefView ref;
+                    if (!ref.deserialize(plain.data() + 1, plain.size() - 1)) continue;
+                    if (have.count(std::vector<uint8_t>(ref.hash, ref.hash + 32))) {
+                        bytes = size;
+                    } else {
+                        ImageFetchPacket fetch;
+                        memcpy(fetch.hash, ref.hash, sizeof(fetch.hash));
+                        conns[r]->sendPacket(fetch);
+                        continue;
+                    }
+                } else if (plain[0] == PKT_IMAGE_BLOB) {
+                    ImageBlobView blob;
+                    if (!blob.deserialize(plain.data() + 1, plain.size() - 1) || !blob.data.size) continue;
+                    have.insert(std::vector<uint8_t>(blob.hash, blob.hash + 32));
+                    bytes = blob.data.size;
+                } else if (plain[0] == PKT_IMAGE_CHUNK) {
+                    ImageChunkView chunk;
+                    if (!chunk.deserialize(plain.data() + 1, plain.size() - 1)) continue;
+                    bytes = chunk.data.size;
+                } else {
+                    continue;
+                }
+                uint64_t now = nowNs();
+                if (!started) first.push_back(now - sentAt);
+                started = true;
+                got += bytes;
+                if (got < size) continue;
+                full.push_back(now - sentAt);
+                got = 0;
+                started = false;
+                done++;
+            }
+            std::lock_guard<std::mutex> lock(samplesMutex);
+            firstSamples.insert(firstSamples.end(), first.begin(), first.end());
+            fullSamples.insert(fullSamples.end(), full.begin(), full.end());
+        });
+    }
+
+    // let join notifications settle before measuring
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    std::vector<uint8_t> data(size);
+    for (int m = 0; m < images; m++) {
+        int variant = distinct ? m % distinct : m;
+        for (size_t i = 0; i < size; i++) data[i] = (uint8_t) (i * 131 + 7 + variant);
+        sentAt = nowNs();
+        if (stream) {
+            ImageBeginPacket begin;
+            begin.mimeType = "image/png";
+            begin.fileName = "bench.png";
+            begin.streamId = m + 1;
+            begin.size = size;
+            if (!sender.sendPacket(begin)) break;
+            for (size_t off = 0; off < size; off += IMAGE_CHUNK_SIZE) {
+                ImageChunkPacket chunk;
+                chunk.streamId = m + 1;
+                chunk.offset = off;
+                chunk.data.assign(data.begin() + off, data.begin() + std::min(size, off + IMAGE_CHUNK_SIZE));
+                if (!sender.sendPacket(chunk)) break;
+            }
+        } else {
+            ImagePacket img;
+            img.mimeType = "image/png";
+            img.fileName = "bench.png";
+            img.imageData = data;
+            if (!sender.sendPacket(img)) break;
+        }
+        // one image at a time, so each is timed on its own
+        while (done < (m + 1) * receivers) std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    for (auto& t : readers) t.join();
+
+    auto pct = [](std::vector<uint64_t>& v, double p) {
+        if (v.empty()) return 0.0;
+        std::sort(v.begin(), v.end());
+        return v[(size_t) (p * (v.size() - 1))] / 1e3;
+    };
+    uint64_t wire = 0;
+    for (int r = 1; r <= receivers; r++) wire += conns[r]->getBytesReceived();
+    printf("receivers=%d images=%d size=%zu mode=%s cipher=%s\n", receivers, images, size,
+           stream ? "stream" : refs ? "refs" : "single",
+           cipher == FEAT_AES_256_GCM ? "aes" : cipher == FEAT_CHACHA20_POLY1305 ? "chacha" : "none");
+    printf("received %.1f MB on the wire\n", wire / 1e6);
+    printf("first bytes us: p50=%.0f p90=%.0f max=%.0f\n", pct(firstSamples, 0.5), pct(firstSamples, 0.9), pct(firstSamples, 1.0));
+    printf("whole image us: p50=%.0f p90=%.0f max=%.0f\n", pct(fullSamples, 0.5), pct(fullSamples, 0.9), pct(fullSamples, 1.0));
+
+    Retchat::DH::free();
+    return 0;
+}
@@ -0,0 +1,153 @@
+// chat fan-out load generator. connects a room full of clients, has a few of them
+// send as fast as they can and reports delivered messages/sec and delivery latency.
+// run it against servers built with different options to compare them on the same load.
+
+#include "BenchClient.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Retchat;
+using Clock = std::chrono::steady_clock;
+
+// messages are padded out to --size with these, so they compress about as well as chat does
+static const char* const WORDS[16] = {
+    "the ", "and ", "you ", "that ", "was ", "for ", "are ", "with ",
+    "lol ", "what ", "this ", "have ", "just ", "but ", "not ", "like "
+};
+
+static uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char** argv) {
+    std::string host = "127.0.0.1";
+    int port = 6677;
+    int clients = 50, senders = 4, messages = 1000, size = 64;
+    int rate = 0;  // messages per second per sender, 0 = as fast as possible
+    std::string room;
+    uint32_t cipher = 0;  // 0 = version 1 frames
+    bool roomKeys = false;
+    bool batch = false;
+    bool compress = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&]() { return i + 1 < argc ? argv[++i] : (char*) "0"; };
+        if (arg == "--host") host = next();
+        else if (arg == "--port") port = atoi(next());
+        else if (arg == "--clients") clients = atoi(next());
+        else if (arg == "--senders") senders = atoi(next());
+        else if (arg == "--messages") messages = atoi(next());
+        else if (arg == "--size") size = atoi(next());
+        else if (arg == "--room") room = next();
+        else if (arg == "--rate") rate = atoi(next());
+        else if (arg == "--room-keys") roomKeys = true;
+        else if (arg == "--batch") batch = true;
+        else if (arg == "--compress") compress = true;
+        else if (arg == "--cipher") {
+            std::string name = next();
+            cipher = name == "aes" ? FEAT_AES_256_GCM : name == "chacha" ? FEAT_CHACHA20_POLY1305 : 0;
+        }
+        else { fprintf(stderr, "usage: loadgen [--host h] [--port p] [--clients n] [--senders s] [--messages m] [--size bytes] [--room name] [--rate msgs/s] [--cipher aes|chacha [--room-keys]] [--batch] [--compress]\n"); return 1; }
+    }
+    senders = std::min(senders, clients);
+
+    uint32_t wanted = cipher | (roomKeys ? FEAT_ROOM_KEYS : 0) | (batch ? FEAT_BATCH : 0) | (compress ? FEAT_COMPRESS : 0);
+    Retchat::DH::init();
+    std::vector<std::unique_ptr<BenchClient>> conns;
+    for (int i = 0; i < clients; i++) {
+        auto c = std::make_unique<BenchClient>();
+        if (!c->connect(host, port) || !c->handshake(cipher != 0 || batch || compress, wanted)) {
+            fprintf(stderr, "client %d failed to connect\n", i);
+            return 1;
+        }
+        if (!room.empty()) {
+            JoinRequestPacket join;
+            join.roomName = room;
+            c->sendPacket(join);
+        }
+        conns.push_back(std::move(c));
+    }
+
+    std::atomic<bool> started{false};
+    std::atomic<long> delivered{0};
+    std::mutex samplesMutex;
+    std::vector<uint64_t> samples;
+    long expected = 0;
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < clients; i++) {
+        long want = (long) messages * (i < senders ? senders - 1 : senders);
+        expected += want;
+        readers.emplace_back([&, i, want]() {
+            std::vector<uint64_t> local;
+            std::vector<uint8_t> plain;
+            long got = 0;
+            while (got < want && conns[i]->readPacket(plain)) {
+                if (plain.empty() || plain[0] != PKT_CHAT_MSG || !started) continue;
+                size_t off = 1;
+                std::string sender, text;
+                if (!deserializeString(plain.data(), plain.size(), off, sender)) continue;
+                if (!deserializeString(plain.data(), plain.size(), off, text)) continue;
+                local.push_back(nowNs() - strtoull(text.c_str(), nullptr, 10));
+                got++;
+                delivered++;
+            }
+            std::lock_guard<std::mutex> lock(samplesMutex);
+            samples.insert(samples.end(), local.begin(), local.end());
+        });
+    }
+
+    // let join notifications settle before measuring
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    started = true;
+
+    auto t0 = Clock::now();
+    std::vector<std::thread> writers;
+    for (int s = 0; s < senders; s++) {
+        writers.emplace_back([&, s]() {
+            // c2s chat only carries the text, the server fills in the sender
+            auto next = Clock::now();
+            uint32_t seed = s;
+            for (int m = 0; m < messages; m++) {
+                if (rate > 0) {
+                    // paced, so latency is measured below saturation instead of queueing delay
+                    std::this_thread::sleep_until(next);
+                    next += std::chrono::nanoseconds(1000000000L / rate);
+                }
+                std::string text = std::to_string(nowNs()) + ";";
+                while (text.size() < (size_t) size) text += WORDS[(seed = seed * 1103515245 + 12345) >> 16 & 15];
+                text.resize(std::max<size_t>(text.size(), size));
+                std::vector<uint8_t> payload = { PKT_CHAT_MSG };
+                serializeString(text, payload);
+                if (!conns[s]->sendFrame(std::move(payload))) break;
+            }
+        });
+    }
+    for (auto& t : writers) t.join();
+    for (auto& t : readers) t.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - t0).count();
+
+    std::sort(samples.begin(), samples.end());
+    auto pct = [&](double p) { return samples.empty() ? 0.0 : samples[(size_t) (p * (samples.size() - 1))] / 1e3; };
+    uint64_t wire = 0;
+    for (const auto& c : conns) wire += c->getBytesReceived();
+    printf("clients=%d senders=%d messages=%d size=%d rate=%d cipher=%s%s%s%s\n", clients, senders, messages, size, rate,
+           cipher == FEAT_AES_256_GCM ? "aes" : cipher == FEAT_CHACHA20_POLY1305 ? "chacha" : batch || compress ? "v2" : "v1",
+           cipher && roomKeys ? " room-keys" : "", batch ? " batch" : "", compress ? " compress" : "");
+    printf("delivered %ld/%ld in %.3fs: %.0f msg/s, %.1f MB/s\n", delivered.load(), expected, elapsed, delivered / elapsed,
+           (double) delivered * size / elapsed / 1e6);
+    printf("received %.1f MB on the wire, %.1f bytes per message\n", wire / 1e6, delivered ? (double) wire / delivered : 0.0);
+    printf("latency us: p50=%.0f p90=%.0f p99=%.0f max=%.0f\n", pct(0.50), pct(0.90), pct(0.99), pct(1.0));
+
+    Retchat::DH::free();
+    return 0;
+}
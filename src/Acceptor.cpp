@@ -0,0 +1,71 @@
+#include "Acceptor.hpp"
+
+#include "Logger.hpp"
+#include "Server.hpp"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+namespace Retchat {
+
+    Acceptor::Acceptor(Server* srv, EventLoop* lp, int p) : server(srv), loop(lp), port(p) {}
+
+    Acceptor::~Acceptor() { close(); }
+
+    bool Acceptor::open() {
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) { perror("socket"); return false; }
+        int opt = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) { perror("SO_REUSEPORT"); return false; }
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); return false; }
+        if (::listen(listenFd, SOMAXCONN) < 0) { perror("listen"); return false; }
+        return true;
+    }
+
+    void Acceptor::listen() {
+        if (!loop->add(listenFd, this, EPOLLIN)) {
+            Logger::error("could not register listener with event loop " + std::to_string(loop->getId()));
+        }
+    }
+
+    void Acceptor::close() {
+        if (listenFd == -1) return;
+        loop->remove(listenFd);
+        ::close(listenFd);
+        listenFd = -1;
+    }
+
+    void Acceptor::onEvent(uint32_t) {
+        // edge-triggered: drain the whole accept queue
+        for (;;) {
+            struct sockaddr_in clientAddr;
+            socklen_t addrLen = sizeof(clientAddr);
+            int clientFd = accept4(listenFd, (sockaddr*)&clientAddr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (clientFd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    Logger::warn("accept: " + std::string(strerror(errno)));
+                }
+                return;
+            }
+            // frames are already coalesced per flush, nagle would only add latency on top
+            int one = 1;
+            setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            server->acceptClient(clientFd, clientAddr, loop);
+        }
+    }
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "EventLoop.hpp"
+
+
+namespace Retchat {
+
+    class Server;
+
+    // one SO_REUSEPORT listening socket per event loop. the kernel spreads incoming
+    // connections across all of them, so accepts never serialize on a single thread.
+    class Acceptor : public EventLoop::Handler {
+    public:
+        Acceptor(Server* server, EventLoop* loop, int port);
+        ~Acceptor();
+
+        bool open();
+        void listen();  // must run on the loop thread
+        void close();
+
+        void onEvent(uint32_t events) override;
+
+    private:
+        Server* server;
+        EventLoop* loop;
+        int port;
+        int listenFd = -1;
+    };
+
+}
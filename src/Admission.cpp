@@ -0,0 +1,189 @@
+#include "Admission.hpp"
+
+#include "Logger.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <netinet/in.h>
+#include <vector>
+
+
+// idle entries (nothing connected, bucket full again) are swept once the tables reach this
+// many entries, and then whenever they've doubled since the last sweep
+constexpr size_t MIN_SWEEP_ENTRIES = 4096;
+constexpr size_t TOP_OFFENDERS = 5;
+
+namespace Retchat {
+
+    static std::string formatAddr(uint32_t addr) {
+        char buf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr, buf, sizeof(buf));
+        return buf;
+    }
+
+    static std::string formatLimit(const AdmissionLimit& l) {
+        std::string s = l.rate > 0 ? std::to_string((int) l.rate) + "/s burst " + std::to_string((int) std::max(l.burst, 1.0))
+                                   : std::string("no rate limit");
+        s += ", ";
+        s += l.maxConnections ? "max " + std::to_string(l.maxConnections) + " open" : std::string("no cap");
+        return s;
+    }
+
+    AdmissionControl::AdmissionControl(const AdmissionLimit& perIp, const AdmissionLimit& perSubnet)
+        : ipLimit(perIp), subnetLimit(perSubnet), sweepAt(MIN_SWEEP_ENTRIES) {}
+
+    void AdmissionControl::refill(Bucket& b, const AdmissionLimit& limit, Clock::time_point now) {
+        double burst = std::max(limit.burst, 1.0);
+        double elapsed = std::chrono::duration<double>(now - b.refilled).count();
+        b.tokens = std::min(burst, b.tokens + elapsed * limit.rate);
+        b.refilled = now;
+    }
+
+    bool AdmissionControl::isIdle(const Bucket& b, const AdmissionLimit& limit) {
+        return b.active == 0 && (limit.rate <= 0 || b.tokens >= std::max(limit.burst, 1.0));
+    }
+
+    AdmissionControl::Bucket& AdmissionControl::bucketFor(std::unordered_map<uint32_t, Bucket>& map, uint32_t key,
+                                                          const AdmissionLimit& limit, Clock::time_point now) {
+        auto it = map.find(key);
+        if (it == map.end()) {
+            // a new address starts with a full bucket
+            Bucket& b = map[key];
+            b.tokens = std::max(limit.burst, 1.0);
+            b.refilled = now;
+            return b;
+        }
+        refill(it->second, limit, now);
+        return it->second;
+    }
+
+    AdmissionControl::Verdict AdmissionControl::admit(uint32_t addr) {
+        uint32_t subnet = addr & htonl(0xFFFFFF00);
+        std::string logMsg;
+        Verdict v = Verdict::Admit;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto now = Clock::now();
+            if (ips.size() + subnets.size() >= sweepAt) sweep(now);
+
+            Bucket& ip = bucketFor(ips, addr, ipLimit, now);
+            Bucket& net = bucketFor(subnets, subnet, subnetLimit, now);
+
+            if (ipLimit.maxConnections && ip.active >= ipLimit.maxConnections) v = Verdict::IpCap;
+            else if (subnetLimit.maxConnections && net.active >= subnetLimit.maxConnections) v = Verdict::SubnetCap;
+            else if (ipLimit.rate > 0 && ip.tokens < 1) v = Verdict::IpRate;
+            else if (subnetLimit.rate > 0 && net.tokens < 1) v = Verdict::SubnetRate;
+
+            if (v == Verdict::Admit) {
+                if (ipLimit.rate > 0) ip.tokens -= 1;
+                if (subnetLimit.rate > 0) net.tokens -= 1;
+                ip.active++;
+                net.active++;
+                admitted++;
+                return v;
+            }
+
+            rejected[(int) v]++;
+            bool bySubnet = v == Verdict::SubnetCap || v == Verdict::SubnetRate;
+            Bucket& b = bySubnet ? net : ip;
+            b.rejected++;
+            // a flood would drown the log, so only every power of two
+            if ((b.rejected & (b.rejected - 1)) == 0) {
+                logMsg = "refusing connections from " + (bySubnet ? formatAddr(subnet) + "/24" : formatAddr(addr)) +
+                         " (" + describe(v) + "), " + std::to_string(b.rejected) + " so far";
+            }
+        }
+        if (!logMsg.empty()) Logger::warn(logMsg);
+        return v;
+    }
+
+    void AdmissionControl::release(uint32_t addr) {
+        uint32_t subnet = addr & htonl(0xFFFFFF00);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = ips.find(addr);
+        if (it != ips.end() && it->second.active) it->second.active--;
+        it = subnets.find(subnet);
+        if (it != subnets.end() && it->second.active) it->second.active--;
+    }
+
+    void AdmissionControl::sweep(Clock::time_point now) {
+        for (auto it = ips.begin(); it != ips.end(); ) {
+            refill(it->second, ipLimit, now);
+            if (isIdle(it->second, ipLimit)) it = ips.erase(it);
+            else ++it;
+        }
+        for (auto it = subnets.begin(); it != subnets.end(); ) {
+            refill(it->second, subnetLimit, now);
+            if (isIdle(it->second, subnetLimit)) it = subnets.erase(it);
+            else ++it;
+        }
+        sweepAt = std::max(MIN_SWEEP_ENTRIES, 2 * (ips.size() + subnets.size()));
+    }
+
+    void AdmissionControl::setIpLimit(const AdmissionLimit& limit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ipLimit = limit;
+    }
+
+    void AdmissionControl::setSubnetLimit(const AdmissionLimit& limit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        subnetLimit = limit;
+    }
+
+    const char* AdmissionControl::describe(Verdict v) {
+        switch (v) {
+            case Verdict::Admit:      return "admitted";
+            case Verdict::IpRate:     return "ip rate";
+            case Verdict::IpCap:      return "ip cap";
+            case Verdict::SubnetRate: return "subnet rate";
+            case Verdict::SubnetCap:  return "subnet cap";
+        }
+        return "?";
+    }
+
+    std::string AdmissionControl::getSummary() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string result = "per ip: " + formatLimit(ipLimit) + "\nper /24: " + formatLimit(subnetLimit) +
+                             "\nadmitted " + std::to_string(admitted) + ", refused:";
+        for (Verdict v : { Verdict::IpRate, Verdict::IpCap, Verdict::SubnetRate, Verdict::SubnetCap }) {
+            result += std::string(" ") + describe(v) + "=" + std::to_string(rejected[(int) v]);
+        }
+        result += "\ntracking " + std::to_string(ips.size()) + " ip(s), " + std::to_string(subnets.size()) + " subnet(s)";
+
+        // whoever has been refused the most, addresses and subnets alike
+        std::vector<std::pair<uint64_t, std::string>> top;
+        for (const auto& pair : ips) {
+            if (pair.second.rejected) top.emplace_back(pair.second.rejected, formatAddr(pair.first));
+        }
+        for (const auto& pair : subnets) {
+            if (pair.second.rejected) top.emplace_back(pair.second.rejected, formatAddr(pair.first) + "/24");
+        }
+        size_t n = std::min(top.size(), TOP_OFFENDERS);
+        std::partial_sort(top.begin(), top.begin() + n, top.end(), std::greater<>());
+        for (size_t i = 0; i < n; i++) {
+            result += "\n  " + top[i].second + ": " + std::to_string(top[i].first) + " refused";
+        }
+        return result;
+    }
+
+    std::string AdmissionControl::queryAddress(uint32_t addr) const {
+        uint32_t subnet = addr & htonl(0xFFFFFF00);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = Clock::now();
+        auto describeBucket = [now](const std::unordered_map<uint32_t, Bucket>& map, uint32_t key,
+                                    const AdmissionLimit& limit, const std::string& name) {
+            auto it = map.find(key);
+            if (it == map.end()) return name + ": no recent connections";
+            Bucket b = it->second;
+            refill(b, limit, now);
+            char tokens[32];
+            snprintf(tokens, sizeof(tokens), "%.1f", b.tokens);
+            return name + ": open=" + std::to_string(b.active) + " | tokens=" + tokens +
+                   " | refused=" + std::to_string(b.rejected);
+        };
+        return describeBucket(ips, addr, ipLimit, formatAddr(addr)) + "\n" +
+               describeBucket(subnets, subnet, subnetLimit, formatAddr(subnet) + "/24");
+    }
+
+}
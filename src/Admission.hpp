@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+
+namespace Retchat {
+
+    // a connection rate (token bucket) and a concurrent connection cap. any value 0 = unlimited
+    struct AdmissionLimit {
+        double rate = 0;     // new connections per second
+        double burst = 0;    // connections allowed at once before the rate kicks in
+        uint32_t maxConnections = 0;
+    };
+
+    // decides whether an accepted socket gets a client at all. checked against the raw
+    // address before anything is allocated or any crypto runs, so a single host (or its /24)
+    // opening thousands of sockets costs a lookup and a close each instead of a handshake
+    class AdmissionControl {
+    public:
+        enum class Verdict { Admit, IpRate, IpCap, SubnetRate, SubnetCap };
+
+        AdmissionControl(const AdmissionLimit& perIp, const AdmissionLimit& perSubnet);
+
+        // addr in network byte order. an admitted connection counts until release() is called for it
+        Verdict admit(uint32_t addr);
+        void release(uint32_t addr);
+
+        void setIpLimit(const AdmissionLimit& limit);
+        void setSubnetLimit(const AdmissionLimit& limit);
+
+        static const char* describe(Verdict v);
+
+        std::string getSummary() const;
+        std::string queryAddress(uint32_t addr) const;
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Bucket {
+            double tokens = 0;
+            Clock::time_point refilled;
+            uint32_t active = 0;
+            uint64_t rejected = 0;
+        };
+
+        Bucket& bucketFor(std::unordered_map<uint32_t, Bucket>& map, uint32_t key, const AdmissionLimit& limit, Clock::time_point now);
+        static void refill(Bucket& b, const AdmissionLimit& limit, Clock::time_point now);
+        static bool isIdle(const Bucket& b, const AdmissionLimit& limit);
+        void sweep(Clock::time_point now);
+
+        mutable std::mutex mutex;
+        AdmissionLimit ipLimit;
+        AdmissionLimit subnetLimit;
+        std::unordered_map<uint32_t, Bucket> ips;
+        std::unordered_map<uint32_t, Bucket> subnets;
+        size_t sweepAt;
+
+        uint64_t admitted = 0;
+        uint64_t rejected[5] = {};
+    };
+
+}
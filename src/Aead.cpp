@@ -0,0 +1,103 @@
+#include "Aead.hpp"
+
+#include "Protocol.hpp"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace Retchat {
+
+    static void makeNonce(uint32_t prefix, uint64_t counter, uint8_t nonce[12]) {
+        for (int i = 0; i < 4; i++) nonce[i] = (prefix >> (24 - i * 8)) & 0xFF;
+        for (int i = 0; i < 8; i++) nonce[4 + i] = (counter >> (56 - i * 8)) & 0xFF;
+    }
+
+    // SHA256(session key || label), one label per direction or per room cipher
+    static void deriveKey(const uint8_t sessionKey[32], const char* label, uint8_t out[32]) {
+        uint8_t buf[64];
+        size_t labelLen = std::min(strlen(label), sizeof(buf) - 32);
+        memcpy(buf, sessionKey, 32);
+        memcpy(buf + 32, label, labelLen);
+        EVP_Digest(buf, 32 + labelLen, out, nullptr, EVP_sha256(), nullptr);
+        OPENSSL_cleanse(buf, sizeof(buf));
+    }
+
+    static EVP_CIPHER_CTX* makeContext(const EVP_CIPHER* cipher, const uint8_t key[32], bool encrypt) {
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        if (!ctx || EVP_CipherInit_ex(ctx, cipher, nullptr, key, nullptr, encrypt) <= 0) {
+            EVP_CIPHER_CTX_free(ctx);
+            return nullptr;
+        }
+        return ctx;
+    }
+
+    Aead::~Aead() {
+        EVP_CIPHER_CTX_free(sealCtx);
+        EVP_CIPHER_CTX_free(openCtx);
+    }
+
+    bool Aead::init(uint32_t cipher, const uint8_t sessionKey[32], bool server) {
+        uint8_t c2s[32], s2c[32];
+        deriveKey(sessionKey, "retchat c2s", c2s);
+        deriveKey(sessionKey, "retchat s2c", s2c);
+        bool ok = initKeys(cipher, server ? s2c : c2s, server ? c2s : s2c);
+        OPENSSL_cleanse(c2s, sizeof(c2s));
+        OPENSSL_cleanse(s2c, sizeof(s2c));
+        return ok;
+    }
+
+    bool Aead::initRoom(uint32_t cipher, const uint8_t roomKey[32]) {
+        // the two ciphers share counters, so they must never share a key
+        uint8_t key[32];
+        deriveKey(roomKey, cipher == FEAT_AES_256_GCM ? "retchat room aes" : "retchat room chacha", key);
+        bool ok = initKeys(cipher, key, key, cipher);
+        OPENSSL_cleanse(key, sizeof(key));
+        return ok;
+    }
+
+    bool Aead::initKeys(uint32_t cipherBit, const uint8_t sealKey[32], const uint8_t openKey[32], uint32_t prefix) {
+        const EVP_CIPHER* cipher = cipherBit == FEAT_AES_256_GCM ? EVP_aes_256_gcm()
+                                 : cipherBit == FEAT_CHACHA20_POLY1305 ? EVP_chacha20_poly1305()
+                                 : nullptr;
+        if (!cipher) return false;
+
+        EVP_CIPHER_CTX_free(sealCtx);
+        EVP_CIPHER_CTX_free(openCtx);
+        sealCtx = makeContext(cipher, sealKey, true);
+        openCtx = makeContext(cipher, openKey, false);
+        noncePrefix = prefix;
+        if (sealCtx && openCtx) return true;
+        EVP_CIPHER_CTX_free(sealCtx);
+        EVP_CIPHER_CTX_free(openCtx);
+        sealCtx = openCtx = nullptr;
+        return false;
+    }
+
+    bool Aead::seal(uint64_t counter, const uint8_t* aad, size_t aadLen, const uint8_t* in, uint8_t* out, size_t len, uint8_t tag[AEAD_TAG_SIZE]) {
+        // both ciphers default to the 12-byte nonce, only the iv changes per frame
+        uint8_t nonce[12];
+        makeNonce(noncePrefix, counter, nonce);
+        int outLen;
+        return EVP_EncryptInit_ex(sealCtx, nullptr, nullptr, nullptr, nonce) > 0 &&
+               EVP_EncryptUpdate(sealCtx, nullptr, &outLen, aad, aadLen) > 0 &&
+               EVP_EncryptUpdate(sealCtx, out, &outLen, in, len) > 0 &&
+               EVP_EncryptFinal_ex(sealCtx, out + outLen, &outLen) > 0 &&
+               EVP_CIPHER_CTX_ctrl(sealCtx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE, tag) > 0;
+    }
+
+    bool Aead::open(uint64_t counter, const uint8_t* aad, size_t aadLen, uint8_t* data, size_t len, const uint8_t tag[AEAD_TAG_SIZE]) {
+        uint8_t nonce[12];
+        makeNonce(noncePrefix, counter, nonce);
+        int outLen;
+        return EVP_DecryptInit_ex(openCtx, nullptr, nullptr, nullptr, nonce) > 0 &&
+               EVP_DecryptUpdate(openCtx, nullptr, &outLen, aad, aadLen) > 0 &&
+               EVP_DecryptUpdate(openCtx, data, &outLen, data, len) > 0 &&
+               EVP_CIPHER_CTX_ctrl(openCtx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE, (void*) tag) > 0 &&
+               EVP_DecryptFinal_ex(openCtx, data + outLen, &outLen) > 0;
+    }
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <openssl/evp.h>
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace Retchat {
+
+    constexpr size_t AEAD_TAG_SIZE = 16;
+    constexpr size_t AEAD_HEADER_SIZE = AEAD_TAG_SIZE + 4;  // tag + length
+    constexpr size_t ROOM_FRAME_HEADER_SIZE = AEAD_HEADER_SIZE + 4 + 8;  // + key id + counter
+
+    // the version 2 record layer: one AES-256-GCM or ChaCha20-Poly1305 context per direction,
+    // keyed once and reused for every frame. each direction gets its own key derived from the
+    // session key, so the same counter never meets the same key twice
+    class Aead {
+    public:
+        Aead() = default;
+        ~Aead();
+        Aead(const Aead&) = delete;
+        Aead& operator=(const Aead&) = delete;
+
+        // cipher is one of the FEAT_* cipher bits
+        bool init(uint32_t cipher, const uint8_t sessionKey[32], bool server);
+        // a room key, both ways, with a key of its own for each cipher
+        bool initRoom(uint32_t cipher, const uint8_t roomKey[32]);
+        // explicit keys. noncePrefix goes in the first 4 bytes of every nonce
+        bool initKeys(uint32_t cipher, const uint8_t sealKey[32], const uint8_t openKey[32], uint32_t noncePrefix = 0);
+        bool isActive() const { return sealCtx != nullptr; }
+
+        // in place, or from in to out when sealing. the tag is written to / checked against tag,
+        // aad is authenticated only
+        bool seal(uint64_t counter, const uint8_t* aad, size_t aadLen, uint8_t* data, size_t len, uint8_t tag[AEAD_TAG_SIZE]) {
+            return seal(counter, aad, aadLen, data, data, len, tag);
+        }
+        bool seal(uint64_t counter, const uint8_t* aad, size_t aadLen, const uint8_t* in, uint8_t* out, size_t len, uint8_t tag[AEAD_TAG_SIZE]);
+        bool open(uint64_t counter, const uint8_t* aad, size_t aadLen, uint8_t* data, size_t len, const uint8_t tag[AEAD_TAG_SIZE]);
+
+    private:
+        EVP_CIPHER_CTX* sealCtx = nullptr;
+        EVP_CIPHER_CTX* openCtx = nullptr;
+        uint32_t noncePrefix = 0;
+    };
+
+}
@@ -0,0 +1,287 @@
+#include "BufferPool.hpp"
+
+#include <openssl/crypto.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+#include <mutex>
+
+constexpr size_t SIZE_CLASSES[] = { 256, 4 * 1024, 64 * 1024 };  // chat lines, lists, small images
+constexpr size_t CLASS_FREE_BYTES = 4 * 1024 * 1024;             // per class and thread
+constexpr size_t CLASS_COUNT = sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+constexpr size_t LARGE_CLASS = 2 * 1024 * 1024;  // a 1 MB image frame and then some
+constexpr size_t LARGE_FREE_LIMIT = 8;           // shared by all threads
+constexpr size_t BLOCK_SIZE = 64;                // fits the control block of a pooled buffer
+constexpr size_t BLOCK_FREE_LIMIT = CLASS_FREE_BYTES / SIZE_CLASSES[0];  // per thread
+
+
+namespace Retchat {
+
+    using Bytes = std::vector<uint8_t>;
+
+    // only ever written by the thread owning them, so plain loads and stores are enough
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    struct ThreadCache {
+        std::vector<Bytes*> free[CLASS_COUNT];
+        void* blocks = nullptr;  // linked through their first word
+        size_t blockCount = 0;
+
+        std::atomic<uint64_t> messages{0};
+        std::atomic<uint64_t> acquired{0};
+        std::atomic<uint64_t> allocated{0};
+        std::atomic<uint64_t> blocksAllocated{0};
+        std::atomic<uint64_t> cryptoAllocated{0};
+        std::atomic<uint64_t> cachedBytes{0};
+
+        ThreadCache();
+        ~ThreadCache();
+    };
+
+    // every live thread cache, plus what exited threads counted and the large class freelist
+    struct Registry {
+        std::mutex mutex;
+        std::vector<ThreadCache*> caches;
+        BufferPool::Stats retired;
+        std::vector<Bytes*> large;
+
+        ~Registry() {
+            for (Bytes* b : large) delete b;
+        }
+    };
+
+    static Registry& registry() {
+        static Registry r;
+        return r;
+    }
+
+    static thread_local ThreadCache cache;
+    static thread_local bool cacheGone = false;  // trivially destructible, still readable after cache is gone
+
+    static ThreadCache* localCache() {
+        // buffers may still be dropped while a thread's statics are being torn down
+        return cacheGone ? nullptr : &cache;
+    }
+
+    ThreadCache::ThreadCache() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.caches.push_back(this);
+    }
+
+    ThreadCache::~ThreadCache() {
+        for (auto& list : free) {
+            for (Bytes* b : list) delete b;
+        }
+        while (blocks) {
+            void* next = *static_cast<void**>(blocks);
+            ::operator delete(blocks);
+            blocks = next;
+        }
+        Registry& r = registry();
+        {
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.retired.messages += messages;
+            r.retired.acquired += acquired;
+            r.retired.allocated += allocated;
+            r.retired.blocks += blocksAllocated;
+            r.retired.crypto += cryptoAllocated;
+            for (size_t i = 0; i < r.caches.size(); i++) {
+                if (r.caches[i] != this) continue;
+                r.caches[i] = r.caches.back();
+                r.caches.pop_back();
+                break;
+            }
+        }
+        cacheGone = true;
+    }
+
+    static void* allocateBlock(size_t size) {
+        ThreadCache* tc = localCache();
+        if (size > BLOCK_SIZE || !tc) return ::operator new(size);
+        if (tc->blocks) {
+            void* block = tc->blocks;
+            tc->blocks = *static_cast<void**>(block);
+            tc->blockCount--;
+            return block;
+        }
+        bump(tc->blocksAllocated);
+        return ::operator new(BLOCK_SIZE);
+    }
+
+    static void freeBlock(void* block, size_t size) {
+        ThreadCache* tc = localCache();
+        if (size > BLOCK_SIZE || !tc || tc->blockCount >= BLOCK_FREE_LIMIT) {
+            ::operator delete(block);
+            return;
+        }
+        *static_cast<void**>(block) = tc->blocks;
+        tc->blocks = block;
+        tc->blockCount++;
+    }
+
+    // hands shared_ptr its control block from the block freelist
+    template <typename T>
+    struct BlockAllocator {
+        using value_type = T;
+
+        BlockAllocator() = default;
+        template <typename U> BlockAllocator(const BlockAllocator<U>&) {}
+
+        T* allocate(size_t n) { return static_cast<T*>(allocateBlock(n * sizeof(T))); }
+        void deallocate(T* p, size_t n) { freeBlock(p, n * sizeof(T)); }
+
+        template <typename U> bool operator==(const BlockAllocator<U>&) const { return true; }
+        template <typename U> bool operator!=(const BlockAllocator<U>&) const { return false; }
+    };
+
+    static void release(Bytes* b) {
+        // whoever drops the last reference keeps the buffer, which is usually the loop thread
+        // that sent it, i.e. the one serializing and sealing the next ones
+        size_t capacity = b->capacity();
+        b->clear();
+        if (capacity == LARGE_CLASS) {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            if (r.large.size() < LARGE_FREE_LIMIT) {
+                r.large.push_back(b);
+                return;
+            }
+        } else if (ThreadCache* tc = localCache()) {
+            // anything that grew past its class is let go rather than filed under the wrong one
+            for (size_t i = 0; i < CLASS_COUNT; i++) {
+                if (capacity != SIZE_CLASSES[i]) continue;
+                if ((tc->free[i].size() + 1) * capacity > CLASS_FREE_BYTES) break;
+                tc->free[i].push_back(b);
+                bump(tc->cachedBytes, capacity);
+                return;
+            }
+        }
+        delete b;
+    }
+
+    struct Recycle {
+        void operator()(Bytes* b) const { release(b); }
+    };
+
+    struct Wipe {
+        void operator()(Bytes* b) const {
+            OPENSSL_cleanse(b->data(), b->capacity());
+            release(b);
+        }
+    };
+
+    static Bytes* fresh(ThreadCache* tc, size_t capacity) {
+        if (tc) bump(tc->allocated);
+        Bytes* b = new Bytes();
+        b->reserve(capacity);
+        return b;
+    }
+
+    static Bytes* take(size_t capacity) {
+        ThreadCache* tc = localCache();
+        if (tc) bump(tc->acquired);
+
+        Bytes* b = nullptr;
+        size_t i = 0;
+        while (i < CLASS_COUNT && SIZE_CLASSES[i] < capacity) i++;
+        if (i < CLASS_COUNT) {
+            if (tc && !tc->free[i].empty()) {
+                b = tc->free[i].back();
+                tc->free[i].pop_back();
+                tc->cachedBytes.store(tc->cachedBytes.load(std::memory_order_relaxed) - SIZE_CLASSES[i], std::memory_order_relaxed);
+            } else {
+                b = fresh(tc, SIZE_CLASSES[i]);
+            }
+        } else if (capacity <= LARGE_CLASS) {
+            Registry& r = registry();
+            {
+                std::lock_guard<std::mutex> lock(r.mutex);
+                if (!r.large.empty()) {
+                    b = r.large.back();
+                    r.large.pop_back();
+                }
+            }
+            if (!b) b = fresh(tc, LARGE_CLASS);
+        } else {
+            b = fresh(tc, capacity);
+        }
+        return b;
+    }
+
+    std::shared_ptr<std::vector<uint8_t>> BufferPool::acquire(size_t capacity) {
+        return std::shared_ptr<Bytes>(take(capacity), Recycle(), BlockAllocator<Bytes>());
+    }
+
+    std::shared_ptr<std::vector<uint8_t>> BufferPool::acquireSecret(size_t capacity) {
+        return std::shared_ptr<Bytes>(take(capacity), Wipe(), BlockAllocator<Bytes>());
+    }
+
+    void BufferPool::countMessage() {
+        if (ThreadCache* tc = localCache()) bump(tc->messages);
+    }
+
+    // OpenSSL allocating on a thread whose cache is already gone, or isn't one of ours
+    static std::atomic<uint64_t> strayCryptoAllocations{0};
+    static bool cryptoCounted = false;
+
+    static void countCrypto() {
+        if (ThreadCache* tc = localCache()) bump(tc->cryptoAllocated);
+        else strayCryptoAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void* cryptoMalloc(size_t size, const char*, int) {
+        countCrypto();
+        return malloc(size);
+    }
+
+    static void* cryptoRealloc(void* p, size_t size, const char*, int) {
+        countCrypto();
+        return realloc(p, size);
+    }
+
+    static void cryptoFree(void* p, const char*, int) {
+        free(p);
+    }
+
+    bool BufferPool::countCryptoAllocations() {
+        cryptoCounted = CRYPTO_set_mem_functions(cryptoMalloc, cryptoRealloc, cryptoFree) == 1;
+        return cryptoCounted;
+    }
+
+    BufferPool::Stats BufferPool::getStats() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        Stats total = r.retired;
+        for (ThreadCache* tc : r.caches) {
+            total.messages += tc->messages.load(std::memory_order_relaxed);
+            total.acquired += tc->acquired.load(std::memory_order_relaxed);
+            total.allocated += tc->allocated.load(std::memory_order_relaxed);
+            total.blocks += tc->blocksAllocated.load(std::memory_order_relaxed);
+            total.crypto += tc->cryptoAllocated.load(std::memory_order_relaxed);
+            total.cachedBytes += tc->cachedBytes.load(std::memory_order_relaxed);
+        }
+        total.crypto += strayCryptoAllocations.load(std::memory_order_relaxed);
+        total.cachedBytes += r.large.size() * LARGE_CLASS;
+        return total;
+    }
+
+    std::string BufferPool::getSummary() {
+        Stats s = getStats();
+        std::string perMessage = "-";
+        if (s.messages) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.3f", (double) (s.allocated + s.blocks + s.crypto) / s.messages);
+            perMessage = buf;
+        }
+        std::string crypto = cryptoCounted ? std::to_string(s.crypto) : "uncounted";
+        return "buffers: " + std::to_string(s.acquired) + " handed out, " + std::to_string(s.allocated) +
+               " allocated + " + std::to_string(s.blocks) + " control blocks + " + crypto + " by OpenSSL | " +
+               perMessage + " allocations per message over " +
+               std::to_string(s.messages) + " | " + std::to_string(s.cachedBytes / 1024) + "KB cached";
+    }
+
+}
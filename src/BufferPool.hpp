@@ -0,0 +1,47 @@
+#pragma once
+
+#include "SharedBuffer.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace Retchat {
+
+    // recycles the buffers packets are serialized and sealed into. every buffer belongs to a
+    // size class and goes back on a freelist of that class when its last reference drops,
+    // keeping its capacity, and the shared_ptr control block is recycled the same way. the
+    // small classes are freelists per thread, image-sized frames share one short list since
+    // there are few of them and each is big. once the freelists are warm, steady traffic
+    // doesn't touch the heap at all
+    class BufferPool {
+    public:
+        // an empty buffer with room for at least capacity bytes, writable until it's handed
+        // out as a SharedBuffer
+        static std::shared_ptr<std::vector<uint8_t>> acquire(size_t capacity);
+        // the same for keys and the like, wiped before it goes back on a freelist. capacity has
+        // to cover all of it, a buffer that grows leaves a copy behind
+        static std::shared_ptr<std::vector<uint8_t>> acquireSecret(size_t capacity);
+
+        // one per frame a client sent, so allocations can be put per message
+        static void countMessage();
+        // sends OpenSSL's own allocations through a counter as well, so the figures per message
+        // include whatever the crypto allocates. only works before OpenSSL has allocated anything
+        static bool countCryptoAllocations();
+
+        struct Stats {
+            uint64_t messages = 0;
+            uint64_t acquired = 0;   // buffers handed out
+            uint64_t allocated = 0;  // of those, how many the freelists couldn't serve
+            uint64_t blocks = 0;     // control blocks allocated
+            uint64_t crypto = 0;     // OpenSSL allocations, if they're counted
+            size_t cachedBytes = 0;  // capacity sitting on freelists
+        };
+        static Stats getStats();
+        static std::string getSummary();
+    };
+
+}
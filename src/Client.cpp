@@ -1,191 +1,276 @@
 #include "Client.hpp"
 
+#include "BufferPool.hpp"
 #include "DiffieHellman.hpp"
 #include "Logger.hpp"
 #include "Protocol.hpp"
 #include "Server.hpp"
 
 #include <openssl/bn.h>
-#include <openssl/evp.h>
-#include <openssl/hmac.h>
+#include <openssl/crypto.h>
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <array>
+#include <cerrno>
+#include <climits>
 #include <chrono>
+#include <cstring>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
-#include <pthread.h>
-#include <poll.h>
 
 
 constexpr int MAX_NICK_LENGTH = 20;
 constexpr size_t MAX_PACKET_SIZE = 2 * 1024 * 1024;  // 2 MB
+constexpr size_t MAX_PUBKEY_SIZE = 4096;
+constexpr size_t FRAME_HEADER_SIZE = 32 + 4;  // hmac + length
+constexpr size_t READ_CHUNK_SIZE = 16 * 1024;  // free space to have before each read
+constexpr size_t READ_AHEAD_SIZE = 256 * 1024;  // buffered before decoding, when the socket has more
+constexpr size_t IDLE_BUFFER_CAPACITY = 4 * 1024;  // shrink buffers back to this once drained
+constexpr int KEEPALIVE_INTERVAL_SEC = 30;
+constexpr int KEEPALIVE_WAIT_SEC = 10;
+constexpr int HANDSHAKE_TIMEOUT_SEC = 10;
+constexpr int LINGER_SEC = 10;  // how long a closing connection gets to take its last packets
+constexpr uint32_t SERVER_FEATURES = Retchat::FEAT_CIPHERS | Retchat::FEAT_ROOM_KEYS | Retchat::FEAT_BATCH |
+                                      Retchat::FEAT_COMPRESS | Retchat::FEAT_IMAGE_STREAMS |
+                                      Retchat::FEAT_IMAGE_REFS;  // offered to version 2 clients
+constexpr size_t BATCH_MAX_SIZE = 16 * 1024;  // packets packed into one batch frame, type byte and lengths included
+constexpr size_t MAX_IMAGE_STREAMS = 4;  // per client at a time
+constexpr size_t MAX_FETCHABLE_IMAGES = 256;  // the most recent refs a client may still fetch
+constexpr size_t LARGE_FRAME_SIZE = 64 * 1024;  // refused past the hard memory watermark
+constexpr size_t HEAVY_SENDER_BYTES = 256 * 1024;  // a second, paused first past the soft one
+constexpr int PRESSURE_CHECK_MS = 50;  // how often a paused client looks whether memory came back
+constexpr int PAUSE_WARNING_SEC = 10;  // per client, however often it's paused
 
 namespace Retchat {
 
-    Client::Client(int fd, Server* srv, const std::string& ip) 
-        : sockfd(fd), server(srv), ip(ip), sendCounter(0), recvCounter(0), connected(true) 
+    // what images may be sent as, and whether the format is compressed already
+    struct ImageType {
+        std::string_view mime;
+        bool compressed;
+    };
+    static constexpr ImageType IMAGE_TYPES[] = {
+        { "image/png", true }, { "image/jpeg", true }, { "image/webp", true }, { "image/avif", true }
+    };
+
+    static const ImageType* findImageType(std::string_view mime) {
+        for (const ImageType& t : IMAGE_TYPES) {
+            if (t.mime == mime) return &t;
+        }
+        return nullptr;
+    }
+
+    // server side stream ids, unique so recipients never mix up two senders' streams
+    static std::atomic<uint32_t> nextImageStream{1};
+    // past the origins that aren't clients
+    static std::atomic<uint64_t> nextClientId{Client::SERVER_ORIGIN + 1};
+
+    static uint32_t offeredFeatures(const ServerConfig& cfg) {
+        uint32_t features = SERVER_FEATURES;
+        if (!cfg.compress) features &= ~FEAT_COMPRESS;
+        if (!cfg.imageCacheBytes) features &= ~FEAT_IMAGE_REFS;
+        return features;
+    }
+
+    Client::Client(int fd, Server* srv, EventLoop* lp, const std::string& ip)
+        : id(nextClientId++), sockfd(fd), server(srv), loop(lp), ip(ip), sendCounter(0), recvCounter(0), connected(true)
     {
         name = "usuario" + std::to_string(fd);
         room = "lobby";
         lastRecvTime = std::chrono::steady_clock::now();
     }
 
-    Client::~Client() { close(sockfd); }
+    Client::~Client() {
+        MemoryGovernor& memory = server->getMemory();
+        memory.track(MemoryGovernor::Pool::Queued, queuedBytes, 0);
+        memory.track(MemoryGovernor::Pool::Receive, trackedReceive, 0);
+        ::close(sockfd);
+    }
 
     void Client::start() {
-        pthread_t tid;
-        pthread_create(&tid, nullptr, [](void* arg) -> void* {
-            ((Client*) arg)->run();
-            return nullptr;
-        }, this);
-        pthread_detach(tid);
+        loop->post([this]() { beginHandshake(); });
     }
 
-    bool Client::handshake() {
-        BIGNUM* server_priv = BN_new();
-        BIGNUM* server_pub = BN_new();
-        BIGNUM* client_pub = BN_new();
-        BIGNUM* shared = BN_new();
-
-        DH::generatePrivateKey(server_priv);
-        DH::computePublicKey(server_priv, server_pub);
+    void Client::beginHandshake() {
+        streamGen = loop->addStream(sockfd, this);
+        if (!streamGen) {
+            Logger::error("could not register fd=" + std::to_string(sockfd) + " with event loop");
+            close();
+            return;
+        }
 
-        size_t pub_len = BN_num_bytes(server_pub);
-        uint8_t* pub_buf = new uint8_t[pub_len];
-        BN_bn2bin(server_pub, pub_buf);
-        uint32_t net_len = htonl(pub_len);
+        // the deadline covers the whole handshake, however long the workers take
+        state = State::ServerKey;
+        loop->schedule(handshakeTimer, std::chrono::seconds(HANDSHAKE_TIMEOUT_SEC));
 
-        if (send(sockfd, &net_len, 4, 0) != 4 ||
-            send(sockfd, pub_buf, pub_len, 0) != (ssize_t)pub_len) {
-            delete[] pub_buf;
-            goto error;
+        HandshakePool& pool = server->getHandshakePool();
+        HandshakePool::KeyPair kp;
+        if (pool.takeKeyPair(kp)) {
+            sendServerKey(std::move(kp));
+            return;
         }
-        delete[] pub_buf;
 
-        if (recv(sockfd, &net_len, 4, 0) != 4) goto error;
-        pub_len = ntohl(net_len);
-        if (pub_len > 4096) goto error;
-        pub_buf = new uint8_t[pub_len];
-        if (recv(sockfd, pub_buf, pub_len, 0) != (ssize_t)pub_len) {
-            delete[] pub_buf;
-            goto error;
+        // the precomputed ones ran out, have a worker make one
+        EventLoop* lp = loop;
+        int fd = sockfd;
+        uint32_t gen = streamGen;
+        bool queued = pool.submit([lp, fd, gen]() {
+            auto result = std::make_shared<HandshakePool::KeyPair>(HandshakePool::generateKeyPair());
+            lp->post([lp, fd, gen, result]() {
+                auto* c = static_cast<Client*>(lp->findStream(fd, gen));
+                if (c) c->sendServerKey(std::move(*result));
+            });
+        });
+        if (!queued) {
+            Logger::warn("handshake backlog full, refusing fd=" + std::to_string(sockfd) + " (" + ip + ")");
+            close();
         }
-        BN_bin2bn(pub_buf, pub_len, client_pub);
-        delete[] pub_buf;
+    }
 
-        DH::computeSharedSecret(client_pub, server_priv, shared);
-        DH::deriveEncKey(shared, encKey);
+    void Client::sendServerKey(HandshakePool::KeyPair&& kp) {
+        serverKey = std::move(kp);
 
-        BN_free(server_priv); BN_free(server_pub);
-        BN_free(client_pub); BN_free(shared);
+        std::vector<uint8_t> msg(4 + serverKey.pub.size());
+        uint32_t net_len = htonl(serverKey.pub.size());
+        memcpy(msg.data(), &net_len, 4);
+        memcpy(msg.data() + 4, serverKey.pub.data(), serverKey.pub.size());
 
-        // expect the client to echo the same value back.
-        {
-            HandshakePacket verPkt;
-            verPkt.version = PROTOCOL_VERSION;
-            sendPacket(verPkt);
+        state = State::KeyExchange;
+        sendRaw(msg.data(), msg.size());
+    }
 
-            std::vector<uint8_t> plain;
-            if (!readFrame(plain) || plain.empty()) {
-                Logger::error("version exchange: no response from fd=" + std::to_string(sockfd));
-                return false;
-            }
-            if (plain[0] != PKT_HANDSHAKE) {
-                Logger::error("version exchange: unexpected packet type from fd=" + std::to_string(sockfd));
-                return false;
-            }
-            HandshakePacket clientVer;
-            if (!clientVer.deserialize(plain.data() + 1, plain.size() - 1) ||
-                clientVer.version != PROTOCOL_VERSION)
-            {
-                uint16_t cv = clientVer.version;  // capture before sendPacket uses encKey
-                SystemPacket err;
-                err.isError = true;
-                err.code    = MSG_VERSION_MISMATCH;
-                err.params  = { std::to_string(PROTOCOL_VERSION), std::to_string(cv) };
-                sendPacket(err);
-                Logger::warn("version mismatch on fd=" + std::to_string(sockfd) +
-                             ": expected " + std::to_string(PROTOCOL_VERSION) +
-                             ", got " + std::to_string(cv));
-                return false;
-            }
-        }
+    bool Client::onKeyExchange() {
+        size_t avail = inBuf.size();
+        if (avail < 4) return true;
+        uint32_t net_len;
+        memcpy(&net_len, inBuf.data(), 4);
+        net_len = ntohl(net_len);
+        bool x25519 = net_len & KEY_X25519_FLAG;
+        size_t pub_len = net_len & ~KEY_X25519_FLAG;
+        if (pub_len > MAX_PUBKEY_SIZE || (x25519 && pub_len != X25519_KEY_SIZE)) return false;
+        if (avail < 4 + pub_len) return true;
 
-        return true;
+        std::vector<uint8_t> peer(inBuf.data() + 4, inBuf.data() + 4 + pub_len);
+        inBuf.consume(4 + pub_len);
 
-    error:
-        BN_free(server_priv); BN_free(server_pub);
-        BN_free(client_pub); BN_free(shared);
-        Logger::error("handshake failed for fd=" + std::to_string(sockfd) + " (" + name + ")");
-        return false;
+        // either way the math is done on a worker and the loop moves on
+        state = State::DeriveKey;
+        EventLoop* lp = loop;
+        int fd = sockfd;
+        uint32_t gen = streamGen;
+        auto result = std::make_shared<KeyResult>();
+        std::function<void()> job;
+        if (x25519) {
+            // version 2: our DH key went unused, so another connection can have it
+            version = PROTOCOL_VERSION_2;
+            server->getHandshakePool().returnKeyPair(std::move(serverKey));
+            job = [result, peer]() {
+                uint8_t pub[X25519_KEY_SIZE];
+                result->ok = X25519::exchange(peer.data(), pub, result->key.data());
+                uint32_t netLen = htonl(KEY_X25519_FLAG | X25519_KEY_SIZE);
+                result->reply.resize(4 + X25519_KEY_SIZE);
+                memcpy(result->reply.data(), &netLen, 4);
+                memcpy(result->reply.data() + 4, pub, X25519_KEY_SIZE);
+            };
+        } else {
+            std::shared_ptr<BIGNUM> priv(serverKey.priv.release(), HandshakePool::BignumFree());
+            job = [result, priv, peer]() {
+                BIGNUM* client_pub = BN_bin2bn(peer.data(), peer.size(), nullptr);
+                BIGNUM* shared = BN_new();
+                DH::computeSharedSecret(client_pub, priv.get(), shared);
+                DH::deriveEncKey(shared, result->key.data());
+                BN_free(client_pub);
+                BN_clear_free(shared);
+                result->ok = true;
+            };
+        }
+        serverKey = HandshakePool::KeyPair();
+
+        bool queued = server->getHandshakePool().submit([lp, fd, gen, result, job]() {
+            job();
+            lp->post([lp, fd, gen, result]() {
+                auto* c = static_cast<Client*>(lp->findStream(fd, gen));
+                if (c) c->onKeyDerived(*result);
+            });
+        });
+        if (!queued) Logger::warn("handshake backlog full, refusing fd=" + std::to_string(sockfd) + " (" + ip + ")");
+        return queued;
     }
 
-    bool Client::readFrame(std::vector<uint8_t>& outPlain) {
-        uint8_t recvHmac[32];
-        size_t hmacRead = 0;
-        while (hmacRead < 32) {
-            ssize_t r = recv(sockfd, recvHmac + hmacRead, 32 - hmacRead, 0);
-            if (r <= 0) return false;
-            hmacRead += r;
+    void Client::onKeyDerived(const KeyResult& result) {
+        if (state != State::DeriveKey) return;
+        if (!result.ok) {
+            Logger::error("key exchange failed for fd=" + std::to_string(sockfd) + " (" + ip + ")");
+            close();
+            return;
         }
+        memcpy(encKey, result.key.data(), 32);
+        frameCrypto.init(encKey);
+        if (!result.reply.empty()) sendRaw(result.reply.data(), result.reply.size());
 
-        uint32_t netLen;
-        size_t lenRead = 0;
-        while (lenRead < 4) {
-            ssize_t r = recv(sockfd, (char*)&netLen + lenRead, 4 - lenRead, 0);
-            if (r <= 0) return false;
-            lenRead += r;
-        }
-        uint32_t msgLen = ntohl(netLen);
-        if (msgLen == 0 || msgLen > MAX_PACKET_SIZE) return false;
+        // expect the client to echo the same value back.
+        state = State::VersionExchange;
+        HandshakePacket verPkt;
+        verPkt.version = version;
+        if (version >= PROTOCOL_VERSION_2) verPkt.features = offeredFeatures(server->getConfig());
+        sendPacket(verPkt);
 
-        std::vector<uint8_t> ciphertext(msgLen);
-        size_t total = 0;
-        while (total < msgLen) {
-            ssize_t r = recv(sockfd, ciphertext.data() + total, msgLen - total, 0);
-            if (r <= 0) return false;
-            total += r;
-        }
+        // anything that arrived meanwhile can be decoded now
+        processInput(false);
+    }
 
-        // verify HMAC
-        unsigned int hmacLen;
-        uint8_t expectedHmac[32];
-        HMAC(EVP_sha256(), encKey, 32, ciphertext.data(), msgLen, expectedHmac, &hmacLen);
-        if (CRYPTO_memcmp(recvHmac, expectedHmac, 32) != 0) return false;  // do not discard, instead kill connection
+    bool Client::onVersionExchange(const uint8_t* plain, size_t len) {
+        if (len == 0) {
+            Logger::error("version exchange: no response from fd=" + std::to_string(sockfd));
+            return false;
+        }
+        if (plain[0] != PKT_HANDSHAKE) {
+            Logger::error("version exchange: unexpected packet type from fd=" + std::to_string(sockfd));
+            return false;
+        }
+        HandshakePacket clientVer;
+        // the key exchange already decided the version, the client has to agree
+        if (!clientVer.deserialize(plain + 1, len - 1) ||
+            clientVer.version != version)
+        {
+            uint16_t cv = clientVer.version;
+            SystemPacket err;
+            err.isError = true;
+            err.code    = MSG_VERSION_MISMATCH;
+            err.params  = { std::to_string(version), std::to_string(cv) };
+            sendPacket(err);
+            Logger::warn("version mismatch on fd=" + std::to_string(sockfd) +
+                         ": expected " + std::to_string(version) +
+                         ", got " + std::to_string(cv));
+            return false;
+        }
 
-        // decrypt
-        DH::xorCrypt(ciphertext.data(), msgLen, encKey, recvCounter);
-        recvCounter++;
-        outPlain.swap(ciphertext);
+        // only what we offered, a single cipher, and room keys only along with one
+        uint32_t cipher = clientVer.features & FEAT_CIPHERS;
+        if ((clientVer.features & ~offeredFeatures(server->getConfig())) || (cipher & (cipher - 1)) ||
+            ((clientVer.features & FEAT_ROOM_KEYS) && !cipher)) {
+            Logger::warn("bad feature set from fd=" + std::to_string(sockfd) + ": " + std::to_string(clientVer.features));
+            return false;
+        }
+        features = clientVer.features;
+        if (cipher) {
+            // every frame from here on, both ways, goes through the AEAD
+            if (!aead.init(cipher, encKey, true)) {
+                Logger::error("could not set up cipher for fd=" + std::to_string(sockfd));
+                return false;
+            }
+            sendCounter = recvCounter = 0;
+        }
         return true;
     }
 
-void Client::sendPacket(const Packet& pkt) {
-    std::vector<uint8_t> payload;
-    payload.push_back(pkt.type);
-    pkt.serialize(payload);
-
-    // encrypt
-    std::vector<uint8_t> ciphertext = payload;
-    DH::xorCrypt(ciphertext.data(), ciphertext.size(), encKey, sendCounter);
-    sendCounter++;
-
-    // HMAC
-    uint8_t hmac[32];
-    unsigned int hmacLen;
-    HMAC(EVP_sha256(), encKey, 32, ciphertext.data(), ciphertext.size(), hmac, &hmacLen);
-
-    uint32_t netLen = htonl(ciphertext.size());
-    std::lock_guard<std::mutex> lock(sendMutex);
-    send(sockfd, hmac, 32, 0);
-    send(sockfd, &netLen, 4, 0);
-    send(sockfd, ciphertext.data(), ciphertext.size(), 0);
-}
-    void Client::run() {
-        if (!handshake()) {
-            server->removeClient(this);
-            return;
-        }
+    void Client::onReady() {
+        state = State::Ready;
+        loop->cancel(handshakeTimer);
+        loop->schedule(keepAliveTimer, std::chrono::seconds(KEEPALIVE_INTERVAL_SEC));
 
         // welcome message
         SystemPacket welcome;
@@ -195,227 +280,1053 @@ void Client::sendPacket(const Packet& pkt) {
         sendPacket(welcome);
 
         server->getRoom(room).addClient(this);
+        // only now, so nothing is queued by nick for a client that isn't keyed yet
+        server->getNicks().add(name, this);
 
         JoinNotifyPacket joinNotify;
         joinNotify.nick = name;
         server->broadcastToRoom(room, nullptr, joinNotify);
+    }
 
-        struct pollfd pfd;
-        pfd.fd = sockfd;
-        pfd.events = POLLIN;
+    Client::FrameResult Client::readFrame(uint8_t*& plain, size_t& len) {
+        size_t avail = inBuf.size();
+        if (aead.isActive()) {
+            if (avail < AEAD_HEADER_SIZE) return FrameResult::NeedMore;
+            uint8_t* frame = inBuf.data();
+            uint32_t netLen;
+            memcpy(&netLen, frame + AEAD_TAG_SIZE, 4);
+            uint32_t msgLen = ntohl(netLen);
+            if (msgLen == 0 || msgLen > MAX_PACKET_SIZE) return FrameResult::Invalid;
+            if (msgLen >= LARGE_FRAME_SIZE && !(features & FEAT_COMPRESS) && refuseLarge(msgLen)) {
+                skipFrame(AEAD_HEADER_SIZE + msgLen);
+                return FrameResult::Refused;
+            }
+            if (avail < AEAD_HEADER_SIZE + msgLen) return FrameResult::NeedMore;
 
-        constexpr int POLL_TIMEOUT_MS = 1000;  // check every second
-        constexpr int KEEPALIVE_INTERVAL_SEC = 30;
-        constexpr int KEEPALIVE_WAIT_SEC = 10;
+            uint8_t* ciphertext = frame + AEAD_HEADER_SIZE;
+            if (!aead.open(recvCounter, frame + AEAD_TAG_SIZE, 4, ciphertext, msgLen, frame)) return FrameResult::Invalid;
+            recvCounter++;
+            inBuf.consume(AEAD_HEADER_SIZE + msgLen);
+            plain = ciphertext;
+            len = msgLen;
+            return FrameResult::Ok;
+        }
 
-        while (connected) {
-            auto now = std::chrono::steady_clock::now();
-            double idleSec = std::chrono::duration<double>(now - lastRecvTime).count();
+        if (avail < FRAME_HEADER_SIZE) return FrameResult::NeedMore;
 
-            // if waiting for ack and timeout exceeded, disconnect
-            if (waitingForAck) {
-                double sinceSent = std::chrono::duration<double>(now - lastKeepAliveSent).count();
-                if (sinceSent > KEEPALIVE_WAIT_SEC) {
-                    Logger::warn("keepalive timeout, disconnecting " + name);
-                    break;
+        uint8_t* frame = inBuf.data();
+        uint32_t netLen;
+        memcpy(&netLen, frame + 32, 4);
+        uint32_t msgLen = ntohl(netLen);
+        if (msgLen == 0 || msgLen > MAX_PACKET_SIZE) return FrameResult::Invalid;
+        if (msgLen >= LARGE_FRAME_SIZE && !(features & FEAT_COMPRESS) && refuseLarge(msgLen)) {
+            skipFrame(FRAME_HEADER_SIZE + msgLen);
+            return FrameResult::Refused;
+        }
+        if (avail < FRAME_HEADER_SIZE + msgLen) return FrameResult::NeedMore;
+
+        uint8_t* ciphertext = frame + FRAME_HEADER_SIZE;
+
+        // verify HMAC
+        uint8_t expectedHmac[32];
+        frameCrypto.mac(ciphertext, msgLen, expectedHmac);
+        if (CRYPTO_memcmp(frame, expectedHmac, 32) != 0) return FrameResult::Invalid;  // do not discard, instead kill connection
+
+        // decrypt in place, the plaintext stays valid until the next read into the buffer
+        frameCrypto.xorCrypt(ciphertext, msgLen, recvCounter);
+        recvCounter++;
+        inBuf.consume(FRAME_HEADER_SIZE + msgLen);
+        plain = ciphertext;
+        len = msgLen;
+        return FrameResult::Ok;
+    }
+
+    void Client::handleReadable(uint32_t events) {
+        // read straight into the receive buffer until the socket is drained. a short read
+        // means it already is, so a burst of pipelined frames costs a single recv, unless
+        // the peer also hung up and we need to read on to the eof
+        bool eof = events & (EPOLLHUP | EPOLLERR);
+        bool drainToEof = events & EPOLLRDHUP;
+        for (;;) {
+            size_t space = inBuf.prepare(READ_CHUNK_SIZE);
+            ssize_t r = recv(sockfd, inBuf.writePtr(), space, MSG_DONTWAIT);
+            if (r > 0) {
+                inBuf.commit(r);
+                countReceived(r);
+                if (discarding) {
+                    // nothing else is buffered while a refused frame is still coming in
+                    size_t n = std::min(discarding, inBuf.size());
+                    inBuf.consume(n);
+                    discarding -= n;
                 }
+                if ((size_t) r < space && !drainToEof) break;
+                // a peer that keeps the socket full doesn't get to grow the buffer past a frame
+                // and a bit, what's buffered is decoded before reading on
+                if (inBuf.size() >= READ_AHEAD_SIZE && (!processInput(false) || readPaused)) return;
+                continue;
             }
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            eof = true;
+            break;
+        }
+        processInput(eof);
+    }
+
+    void Client::onData(const uint8_t* data, size_t len) {
+        // ring mode: the loop already received these for us
+        if (state == State::Closed) return;
+        countReceived(len);
+        if (discarding) {
+            size_t n = std::min(discarding, len);
+            discarding -= n;
+            data += n;
+            len -= n;
+        }
+        inBuf.append(data, len);
+        processInput(false);
+    }
 
-            if (!waitingForAck && idleSec > KEEPALIVE_INTERVAL_SEC) {
-                KeepAlivePacket keep;
-                sendPacket(keep);
-                waitingForAck = true;
-                lastKeepAliveSent = now;
+    bool Client::processInput(bool eof) {
+        // decode every complete frame that's buffered, a trailing partial one waits for more
+        while (state != State::Closed) {
+            // waiting on a handshake worker, leave the bytes buffered until it's done
+            if (state == State::ServerKey || state == State::DeriveKey) break;
+            if (state == State::KeyExchange) {
+                State before = state;
+                if (!onKeyExchange()) {
+                    Logger::error("handshake failed for fd=" + std::to_string(sockfd) + " (" + name + ")");
+                    close();
+                    return false;
+                }
+                if (state == before) break;
+                continue;
             }
 
-            int ret = poll(&pfd, 1, POLL_TIMEOUT_MS);
-            if (ret < 0) {
-                if (errno == EINTR) continue;
-                break;
+            uint8_t* plain;
+            size_t len;
+            FrameResult res = readFrame(plain, len);
+            if (res == FrameResult::NeedMore) break;
+            if (res == FrameResult::Refused) continue;
+            if (res == FrameResult::Invalid) {
+                close();
+                return false;
             }
+            lastRecvTime = std::chrono::steady_clock::now();
 
-            if (ret > 0 && (pfd.revents & POLLIN)) {
-                std::vector<uint8_t> plain;
-                if (readFrame(plain)) {
-                    if (!plain.empty()) {
-                        size_t off = 0;
-                        uint8_t type = plain[off++];
-                        Packet* pkt = Packet::create((PacketType)type);
-                        if (pkt && pkt->deserialize(plain.data() + off, plain.size() - off)) {
-                            processPacket(pkt);
-                            delete pkt;
-                        }
-                    }
-                    lastRecvTime = std::chrono::steady_clock::now();
-                } else {
-                    break;
+            if (state == State::VersionExchange) {
+                if (!onVersionExchange(plain, len)) {
+                    close();
+                    return false;
                 }
+                onReady();
+                continue;
             }
+
+            if (len > 0 && plain[0] == PKT_COMPRESSED && (features & FEAT_COMPRESS)) {
+                // a broken stream can't be picked up again, so that's the end of the connection
+                inflated.clear();
+                if (!compressor.decompress(plain + 1, len - 1, inflated, MAX_PACKET_SIZE)) {
+                    Logger::warn("bad compressed frame from fd=" + std::to_string(sockfd) + " (" + ip + ")");
+                    close();
+                    return false;
+                }
+                plain = inflated.data();
+                len = inflated.size();
+            }
+            if (len >= LARGE_FRAME_SIZE && refuseLarge(len)) continue;
+            if (len > 0) processFrame((PacketType) plain[0], plain + 1, len - 1);
         }
 
-        connected = false;
+        if (eof) {
+            close();
+            return false;
+        }
+        applyBackpressure();
+        trackReceiveMemory();
+        return true;
+    }
+
+    void Client::countReceived(size_t n) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - inWindowStart >= std::chrono::seconds(1)) {
+            // a gap of a whole second or more means the last one was quiet
+            lastWindowBytes = now - inWindowStart < std::chrono::seconds(2) ? inWindowBytes : 0;
+            inWindowStart = now;
+            inWindowBytes = 0;
+        }
+        inWindowBytes += n;
+    }
+
+    void Client::trackReceiveMemory() {
+        size_t now = inBuf.capacity() + inflated.capacity();
+        if (now == trackedReceive) return;
+        server->getMemory().track(MemoryGovernor::Pool::Receive, trackedReceive, now);
+        trackedReceive = now;
+    }
+
+    void Client::applyBackpressure() {
+        if (readPaused || state != State::Ready) return;
+        MemoryGovernor& memory = server->getMemory();
+        MemoryGovernor::Level level = memory.getLevel();
+        if (level == MemoryGovernor::Level::Normal) return;
+
+        // heavy senders first. past the hard watermark, anyone halfway through a large frame
+        // that can't just be dropped too
+        bool large = level == MemoryGovernor::Level::Hard && holdsLargeFrame();
+        bool heavy = std::max(inWindowBytes, lastWindowBytes) >= HEAVY_SENDER_BYTES;
 
-        std::string n = name;
-        std::string r = room;
-        LeaveNotifyPacket leaveNotify;
-        leaveNotify.nick = n;
-        server->broadcastToRoom(r, nullptr, leaveNotify);
+        // read space goes back right away instead of at the next idle check
+        inBuf.release(IDLE_BUFFER_CAPACITY);
+        if (inflated.capacity() > IDLE_BUFFER_CAPACITY) std::vector<uint8_t>().swap(inflated);
+        if (!heavy && !large) return;
 
-        server->removeClient(this);
+        // what it sends from here on waits in the kernel, and then in the peer's send buffer
+        readPaused = true;
+        loop->pauseReading(sockfd);
+        memory.countPause();
+        if (ImageCache* images = server->getImageCache()) images->shrink();
+        // a sender that keeps at it is paused over and over, once in a while is enough to say so
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastPauseWarning >= std::chrono::seconds(PAUSE_WARNING_SEC)) {
+            lastPauseWarning = now;
+            Logger::warn(std::string("memory over the ") + (large ? "hard" : "soft") + " watermark, pausing reads from fd=" +
+                         std::to_string(sockfd) + " (" + name + ")");
+        }
+        loop->schedule(pressureTimer, std::chrono::milliseconds(PRESSURE_CHECK_MS));
     }
 
-    void Client::processPacket(Packet* pkt) {
-        switch (pkt->type) {
-            case PKT_KEEPALIVE: {
-                KeepAliveAckPacket ack;
-                sendPacket(ack);
-                break;
+    void Client::onPressureTimer() {
+        if (state == State::Closed || !readPaused) return;
+        MemoryGovernor& memory = server->getMemory();
+        MemoryGovernor::Level level = memory.getLevel();
+        if (level != MemoryGovernor::Level::Normal) {
+            if (ImageCache* images = server->getImageCache()) images->shrink();
+            if (level == MemoryGovernor::Level::Hard && !holdsLargeFrame()) {
+                inBuf.release(IDLE_BUFFER_CAPACITY);
+                trackReceiveMemory();
             }
-            case PKT_KEEPALIVE_ACK: {
-                waitingForAck = false;
-                break;
+            loop->schedule(pressureTimer, std::chrono::milliseconds(PRESSURE_CHECK_MS));
+            return;
+        }
+        readPaused = false;
+        memory.countResume();
+        // it starts over, whatever it sent before the pause has been dealt with
+        inWindowBytes = lastWindowBytes = 0;
+        loop->resumeReading(sockfd);
+    }
+
+    bool Client::refuseLarge(size_t len) {
+        MemoryGovernor& memory = server->getMemory();
+        if (state != State::Ready || memory.getLevel() != MemoryGovernor::Level::Hard) return false;
+        // fanned out, a large frame would cost the most exactly when there's nothing left
+        memory.countRefused();
+        SystemPacket err;
+        err.isError = true;
+        err.code = MSG_SERVER_BUSY;
+        err.params = { std::to_string(len) };
+        sendPacket(err);
+        return true;
+    }
+
+    bool Client::holdsLargeFrame() {
+        // a large frame that's only partly in. it started before the hard watermark was hit, or
+        // readFrame would have refused it, and it's holding its space until the rest arrives
+        size_t lenAt = aead.isActive() ? AEAD_TAG_SIZE : 32;
+        if (inBuf.size() < lenAt + 4) return false;
+        uint32_t netLen;
+        memcpy(&netLen, inBuf.data() + lenAt, 4);
+        size_t msgLen = ntohl(netLen);
+        if (msgLen < LARGE_FRAME_SIZE) return false;
+        if ((features & FEAT_COMPRESS) || !refuseLarge(msgLen)) return true;
+        skipFrame((aead.isActive() ? AEAD_HEADER_SIZE : FRAME_HEADER_SIZE) + msgLen);
+        return false;
+    }
+
+    void Client::skipFrame(size_t total) {
+        // unread, but it still used up its nonce. a compressed one would leave the inflate
+        // stream behind, so those are never skipped
+        size_t n = std::min(total, inBuf.size());
+        inBuf.consume(n);
+        discarding = total - n;
+        recvCounter++;
+    }
+
+    // only these may be thrown away when a client can't keep up. the rest drive the
+    // protocol or the connection itself and always go through
+    static bool isDroppable(PacketType type) {
+        switch (type) {
+            case PKT_NICK_NOTIFY:
+            case PKT_JOIN_NOTIFY:
+            case PKT_LEAVE_NOTIFY:
+            case PKT_ROOM_LIST:
+            case PKT_USER_LIST:
+            case PKT_CHAT_MSG:
+            case PKT_DM_MSG:
+            case PKT_IMAGE_MSG:
+            case PKT_IMAGE_BEGIN:
+            case PKT_IMAGE_CHUNK:
+            case PKT_IMAGE_REF:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool isImageStream(PacketType type) {
+        return type == PKT_IMAGE_BEGIN || type == PKT_IMAGE_CHUNK || type == PKT_IMAGE_ABORT;
+    }
+
+    void Client::sendShared(const SharedBuffer& payload, uint64_t origin) {
+        // nothing can be sealed before the handshake has started
+        if (!connected || !streamGen || payload->empty()) return;
+        PacketType type = (PacketType) (*payload)[0];
+        if (isImageStream(type) && !(features & FEAT_IMAGE_STREAMS)) return;
+        if (type == PKT_ROOM_KEY || type == PKT_DM_MSG) origin = PRIVATE_ORIGIN;
+        enqueue(Outgoing{ type, false, payload, origin });
+    }
+
+    std::string Client::getCompressionSummary() const {
+        return (features & FEAT_COMPRESS) ? compressor.getSummary() : "off";
+    }
+
+    uint32_t Client::getRoomCipher() const {
+        return (features & FEAT_ROOM_KEYS) ? features & FEAT_CIPHERS : 0;
+    }
+
+    void Client::sendSealed(PacketType type, const SharedBuffer& frame) {
+        if (!connected || !streamGen) return;
+        if (isImageStream(type) && !(features & FEAT_IMAGE_STREAMS)) return;
+        enqueue(Outgoing{ type, true, frame, SERVER_ORIGIN });
+    }
+
+    void Client::enqueue(Outgoing&& out) {
+        size_t size = out.bytes->size();
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            if (closeAfterFlush) return;
+            if (!isDroppable(out.type) || makeRoom(size)) {
+                addQueued(size);
+                outQueue.push_back(std::move(out));
             }
-            case PKT_NICK_REQUEST: {
-                auto* req = (NickRequestPacket*) pkt;
-                std::string newNick = req->newNick;
-                
-                bool invalid = false;
-                SystemMessageCode code = MSG_NICK_EMPTY;
-                std::vector<std::string> params;
-                
-                size_t start = newNick.find_first_not_of(" \t\n\r");
-                size_t end = newNick.find_last_not_of(" \t\n\r");
-                
-                if (start == std::string::npos) {
-                    invalid = true;
-                    code = MSG_NICK_EMPTY;
-                } else {
-                    newNick = newNick.substr(start, end - start + 1);
-                    if (newNick.length() < 1) {
-                        invalid = true;
-                        code = MSG_NICK_EMPTY;
-                    } else if (newNick.length() > MAX_NICK_LENGTH) {
-                        invalid = true;
-                        code = MSG_NICK_TOO_LONG;
-                        params.push_back(std::to_string(MAX_NICK_LENGTH));
-                    } else if (newNick.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-") != std::string::npos) {
-                        invalid = true;
-                        code = MSG_NICK_INVALID_CHARS;
-                    } else if (newNick == name) {
-                        invalid = true;
-                        code = MSG_NICK_SAME;
-                    } else if (server->isNicknameBanned(newNick)) {
-                        invalid = true;
-                        code = MSG_NICK_BANNED;
+            // one flush request covers everything queued until the loop gets to it
+            if (flushPending || outQueue.empty()) return;
+            flushPending = true;
+        }
+        // batch frames pay off when there's more than one packet to put in them
+        unsigned int window = (features & FEAT_BATCH) ? server->getConfig().batchWindowUs : 0;
+        if (window) loop->requestFlush(sockfd, streamGen, std::chrono::microseconds(window));
+        else loop->requestFlush(sockfd, streamGen);
+    }
+
+    bool Client::makeRoom(size_t size) {
+        // sendMutex held
+        const ServerConfig& cfg = server->getConfig();
+        if (queuedBytes + size <= cfg.outQueueBytes) {
+            overflowing = false;
+            return true;
+        }
+        if (!overflowing) {
+            overflowing = true;
+            Logger::warn("outbound queue full for fd=" + std::to_string(sockfd) + " (" +
+                         std::to_string(queuedBytes.load()) + " bytes pending)");
+        }
+
+        switch (cfg.overflowPolicy) {
+            case OverflowPolicy::Drop:
+                break;
+            case OverflowPolicy::Coalesce:
+                // the newest messages matter most, so the oldest droppable ones make room
+                for (auto it = outQueue.begin(); it != outQueue.end() && queuedBytes + size > cfg.outQueueBytes;) {
+                    if (!isDroppable(it->type)) {
+                        ++it;
+                        continue;
                     }
+                    removeQueued(it->bytes->size());
+                    droppedPackets++;
+                    it = outQueue.erase(it);
                 }
-                
-                if (invalid) {
-                    SystemPacket err;
-                    err.isError = true;
-                    err.code = code;
-                    err.params = params;
-                    sendPacket(err);
-                    break;
-                }
-                
-                if (server->isNicknameTaken(newNick, room, this)) {
-                    SystemPacket err;
-                    err.isError = true;
-                    err.code = MSG_NICK_TAKEN;
-                    err.params = { newNick };
-                    sendPacket(err);
-                } else {
-                    std::string old = name;
-                    name = newNick;
-                    NickAckPacket ack;
-                    ack.newNick = name;
-                    sendPacket(ack);
-                    NickNotifyPacket notify;
-                    notify.oldNick = old;
-                    notify.newNick = name;
-                    server->broadcastToRoom(room, this, notify);
-                }
+                if (queuedBytes + size <= cfg.outQueueBytes) return true;
                 break;
-            }
-            case PKT_JOIN_REQUEST: {
-                auto* req = (JoinRequestPacket*) pkt;
-                if (req->roomName == room) {
-                    SystemPacket err;
-                    err.isError = true;
-                    err.code = MSG_JOIN_ALREADY;
-                    sendPacket(err);
-                } else if (server->isNicknameTaken(name, req->roomName, nullptr)) {
-                    SystemPacket err;
-                    err.isError = true;
-                    err.code = MSG_JOIN_NAME_TAKEN;
-                    err.params = { req->roomName };
-                    sendPacket(err);
-                } else {
-                    std::string oldRoom = room;
-                    // leave old room
-                    LeaveNotifyPacket leaveNotify;
-                    leaveNotify.nick = name;
-                    server->broadcastToRoom(oldRoom, this, leaveNotify);
-                    server->getRoom(oldRoom).removeClient(this);
-                    // join new room
-                    room = req->roomName;
-                    server->getRoom(room).addClient(this);
-                    JoinAckPacket ack;
-                    ack.roomName = room;
-                    sendPacket(ack);
-                    JoinNotifyPacket joinNotify;
-                    joinNotify.nick = name;
-                    server->broadcastToRoom(room, this, joinNotify);
-                }
+            case OverflowPolicy::Disconnect: {
+                Logger::warn("evicting slow consumer fd=" + std::to_string(sockfd) + " (" + ip + ")");
+                for (const auto& out : outQueue) removeQueued(out.bytes->size());
+                droppedPackets += outQueue.size();
+                outQueue.clear();
+
+                // tell it why, then hang up once that's out
+                DisconnectPacket bye;
+                SharedBuffer payload = bye.serializeShared();
+                addQueued(payload->size());
+                outQueue.push_back(Outgoing{ bye.TYPE, false, std::move(payload), SERVER_ORIGIN });
+                closeAfterFlush = true;
+                connected = false;
                 break;
             }
-            case PKT_CHAT_MSG: {
-                auto* chat = (ChatPacket*) pkt;
-                ChatPacket broadcast;
-                broadcast.sender = name;
-                broadcast.text = chat->text;
-                server->broadcastToRoom(room, this, broadcast);
-                break;
+        }
+        droppedPackets++;
+        return false;
+    }
+
+    void Client::sendRaw(const uint8_t* data, size_t len) {
+        // loop thread only, goes out ahead of anything queued
+        auto frame = BufferPool::acquire(len);
+        frame->assign(data, data + len);
+        wire.push_back(std::move(frame));
+        addQueued(len);
+        writeWire();
+    }
+
+    void Client::addQueued(size_t n) {
+        size_t before = queuedBytes.fetch_add(n);
+        server->getMemory().track(MemoryGovernor::Pool::Queued, before, before + n);
+    }
+
+    void Client::removeQueued(size_t n) {
+        size_t before = queuedBytes.fetch_sub(n);
+        server->getMemory().track(MemoryGovernor::Pool::Queued, before, before - n);
+    }
+
+    SharedBuffer Client::sealFrame(const std::vector<uint8_t>& payload) {
+        // loop thread only, so frames are sealed in the order they hit the wire. the shared
+        // payload is only read, encryption writes straight into this recipient's frame.
+        // version 1 frames are only laid out here, flush seals them all in one batch
+        size_t len = payload.size();
+        uint32_t netLen = htonl(len);
+        if (aead.isActive()) {
+            auto frame = BufferPool::acquire(AEAD_HEADER_SIZE + len);
+            frame->resize(AEAD_HEADER_SIZE + len);
+            uint8_t* out = frame->data();
+            memcpy(out + AEAD_TAG_SIZE, &netLen, 4);
+            if (!aead.seal(sendCounter, out + AEAD_TAG_SIZE, 4, payload.data(), out + AEAD_HEADER_SIZE, len, out)) {
+                return nullptr;
             }
-            case PKT_DM_REQUEST: {
-                auto* dm = (DmRequestPacket*) pkt;
-                server->sendDm(this, dm->targetNick, dm->text);
-                break;
+            sendCounter++;
+            return frame;
+        }
+
+        auto frame = BufferPool::acquire(FRAME_HEADER_SIZE + len);
+        frame->resize(FRAME_HEADER_SIZE + len);
+        uint8_t* out = frame->data();
+        memcpy(out + 32, &netLen, 4);
+        // keystream XOR, then the HMAC of the ciphertext in front of it
+        sealJobs.push_back({ &frameCrypto, sendCounter++, payload.data(), out + FRAME_HEADER_SIZE, len, out });
+        return frame;
+    }
+
+    bool Client::sealToWire(const std::vector<uint8_t>& payload, size_t counted, uint64_t origin) {
+        const std::vector<uint8_t>* body = &payload;
+        if (features & FEAT_COMPRESS) {
+            if (origin != PRIVATE_ORIGIN && payload.size() >= server->getConfig().compressMinBytes) {
+                // nothing one sender can choose gets matched against another's words
+                if (origin != deflateOrigin && !compressor.reset()) return false;
+                deflateOrigin = origin;
+                // kept until the batch is sealed, like the batches
+                auto deflated = BufferPool::acquire(1 + Compressor::outputRoom(payload.size()));
+                deflated->push_back(PKT_COMPRESSED);
+                if (!compressor.compress(payload.data(), payload.size(), *deflated)) return false;
+                body = deflated.get();
+                packed.push_back(std::move(deflated));
+            } else {
+                compressor.countSkipped(payload.size());
+            }
+        }
+        SharedBuffer frame = sealFrame(*body);
+        if (!frame) return false;
+        // the header and the lengths of a batch, less whatever compression saved
+        if (frame->size() >= counted) addQueued(frame->size() - counted);
+        else removeQueued(counted - frame->size());
+        wire.push_back(std::move(frame));
+        return true;
+    }
+
+    static bool isPrecompressed(const std::vector<uint8_t>& pkt) {
+        // streams and the cache only carry types that are compressed already, the begin packet
+        // and the image packet the cache took it from were checked
+        if (pkt[0] == PKT_IMAGE_CHUNK || pkt[0] == PKT_IMAGE_BLOB) return true;
+        if (pkt[0] != PKT_IMAGE_MSG) return false;
+        ImageView img;
+        if (!img.deserialize(pkt.data() + 1, pkt.size() - 1)) return false;
+        const ImageType* t = findImageType(img.mimeType);
+        return t && t->compressed;
+    }
+
+    bool Client::packRun() {
+        // a lone packet doesn't need the batch around it
+        bool ok = true;
+        if (run.size() == 1) {
+            ok = sealToWire(*run[0], run[0]->size(), runOrigin);
+        } else if (!run.empty()) {
+            auto batch = BufferPool::acquire(runSize);
+            batch->push_back(PKT_BATCH);
+            size_t counted = 0;
+            for (const std::vector<uint8_t>* pkt : run) {
+                batch->push_back((uint8_t) (pkt->size() >> 8));
+                batch->push_back((uint8_t) pkt->size());
+                batch->insert(batch->end(), pkt->begin(), pkt->end());
+                counted += pkt->size();
+            }
+            ok = sealToWire(*batch, counted, runOrigin);
+            packed.push_back(std::move(batch));
+        }
+        run.clear();
+        runSize = 1;
+        return ok;
+    }
+
+    void Client::flush() {
+        bool closing;
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            closing = closeAfterFlush;
+        }
+        if (closing && !lingerTimer.isScheduled()) loop->schedule(lingerTimer, std::chrono::seconds(LINGER_SEC));
+
+        // whatever was sealed before has to be out first, or dropping queued packets
+        // would stop bounding anything
+        if (!writeWire()) return;
+
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            flushBatch.swap(outQueue);
+            flushPending = false;
+            closing = closeAfterFlush;
+        }
+        // the batch keeps its payloads alive until the deferred version 1 frames are sealed.
+        // for clients taking batch frames, runs of plain packets are packed into one frame,
+        // and with compression a run only ever holds one origin's packets. private packets
+        // and images that wouldn't compress go out on their own, out of the way of the stream,
+        // and room keys always do, so no plain copy of one is left in a pooled batch
+        bool batching = features & FEAT_BATCH;
+        bool compressing = features & FEAT_COMPRESS;
+        bool ok = true;
+        for (auto& out : flushBatch) {
+            if (out.sealed) {
+                if (!(ok = packRun())) break;
+                wire.push_back(std::move(out.bytes));
+                continue;
+            }
+            size_t size = out.bytes->size();
+            bool image = out.type == PKT_IMAGE_MSG || out.type == PKT_IMAGE_CHUNK || out.type == PKT_IMAGE_BLOB;
+            bool alone = out.type == PKT_ROOM_KEY ||
+                         (compressing && (out.origin == PRIVATE_ORIGIN || (image && isPrecompressed(*out.bytes))));
+            if (alone) {
+                if (!(ok = packRun()) || !(ok = sealToWire(*out.bytes, size, PRIVATE_ORIGIN))) break;
+                continue;
+            }
+            bool split = runSize + 2 + size > BATCH_MAX_SIZE || (compressing && out.origin != runOrigin);
+            if (batching && split && !(ok = packRun())) break;
+            if (batching && runSize + 2 + size <= BATCH_MAX_SIZE) {
+                run.push_back(out.bytes.get());
+                runSize += 2 + size;
+                runOrigin = out.origin;
+                continue;
+            }
+            if (!(ok = sealToWire(*out.bytes, size, out.origin))) break;
+        }
+        if (ok) ok = packRun();
+        if (ok) CryptoContext::sealBatch(sealJobs.data(), sealJobs.size());
+        sealJobs.clear();
+        packed.clear();
+        run.clear();
+        runSize = 1;
+        flushBatch.clear();
+        if (!ok) {
+            Logger::error("could not encrypt a frame for fd=" + std::to_string(sockfd) + ", dropping the connection");
+            shutdown(sockfd, SHUT_RDWR);
+            return;
+        }
+        if (!writeWire()) return;
+
+        // the loop sees the hangup and tears the connection down
+        if (closing) shutdown(sockfd, SHUT_RDWR);
+    }
+
+    bool Client::writeWire() {
+        if (loop->usesRing()) {
+            if (ringInFlight) {
+                if (loop->sendPending(sockfd)) return false;
+                removeQueued(ringInFlight);
+                ringInFlight = 0;
+            }
+            if (wire.empty()) return true;
+            // the loop owns the frames from here on and gathers them into one sendmsg
+            if (wireOff > 0) {
+                const auto& front = *wire[wireHead];
+                auto rest = BufferPool::acquire(front.size() - wireOff);
+                rest->assign(front.begin() + wireOff, front.end());
+                wire[wireHead] = std::move(rest);
+                wireOff = 0;
+            }
+            for (size_t i = wireHead; i < wire.size(); i++) {
+                ringInFlight += wire[i]->size();
+                loop->queueSend(sockfd, streamGen, std::move(wire[i]));
+            }
+            wire.clear();
+            wireHead = 0;
+            return false;
+        }
+
+        // every sealed frame goes out in one sendmsg, as many as the kernel takes
+        static thread_local iovec iov[IOV_MAX];
+        while (!wire.empty()) {
+            int count = 0;
+            for (auto it = wire.begin() + wireHead; it != wire.end() && count < IOV_MAX; ++it, ++count) {
+                size_t off = count == 0 ? wireOff : 0;
+                iov[count].iov_base = const_cast<uint8_t*>((*it)->data()) + off;
+                iov[count].iov_len = (*it)->size() - off;
             }
-            case PKT_IMAGE_MSG: {
-                auto* img = (ImagePacket*) pkt;
-
-                static const std::unordered_set<std::string> allowed = {
-                    "image/png", "image/jpeg", "image/webp", "image/avif"
-                };
-                if (allowed.find(img->mimeType) == allowed.end()) {
-                    SystemPacket err;
-                    err.isError = true;
-                    err.code = MSG_IMAGE_UNSUPPORTED;
-                    err.params = { img->mimeType };
-                    sendPacket(err);
-                    break;
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ssize_t w = sendmsg(sockfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (w > 0) {
+                removeQueued(w);
+                size_t n = (size_t) w;
+                while (n > 0) {
+                    size_t left = wire[wireHead]->size() - wireOff;
+                    if (n < left) {
+                        wireOff += n;
+                        break;
+                    }
+                    n -= left;
+                    wire[wireHead++].reset();
+                    wireOff = 0;
                 }
-                img->sender = name;
-
-                if (img->target.empty()) {
-                    // doom message
-                    server->broadcastToRoom(room, this, *img);
-                } else {
-                    // direct message
-                    server->sendImageDm(this, img->target, *img);
+                if (wireHead == wire.size()) {
+                    wire.clear();
+                    wireHead = 0;
                 }
-                break;
+                continue;
             }
-            default:
-                break;
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;  // EPOLLOUT will resume
+            // peer is gone, the loop will see the hangup and clean up
+            shutdown(sockfd, SHUT_RDWR);
+            size_t unsent = 0;
+            for (size_t i = wireHead; i < wire.size(); i++) unsent += wire[i]->size();
+            removeQueued(unsent - wireOff);
+            wire.clear();
+            wireHead = wireOff = 0;
+            break;
+        }
+        return true;
+    }
+
+    void Client::onEvent(uint32_t events) {
+        if (state == State::Closed) return;
+        if (events & EPOLLOUT) flush();
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) handleReadable(events);
+    }
+
+    void Client::onHandshakeTimeout() {
+        Logger::warn("handshake timeout for fd=" + std::to_string(sockfd) + " (" + ip + ")");
+        close();
+    }
+
+    void Client::onKeepAliveTimer() {
+        if (state != State::Ready) return;
+
+        // it can't answer while we're not reading from it
+        if (readPaused) {
+            loop->schedule(keepAliveTimer, std::chrono::seconds(KEEPALIVE_INTERVAL_SEC));
+            return;
+        }
+
+        // the ack didn't make it in time
+        if (waitingForAck) {
+            Logger::warn("keepalive timeout, disconnecting " + name);
+            close();
+            return;
         }
+
+        // partial frames are rare, an idle connection doesn't need to hold on to its read space
+        inBuf.release(IDLE_BUFFER_CAPACITY);
+        if (inflated.capacity() > IDLE_BUFFER_CAPACITY) std::vector<uint8_t>().swap(inflated);
+        trackReceiveMemory();
+
+        // the timer isn't pushed back on every frame, it just rechecks when it fires
+        auto now = std::chrono::steady_clock::now();
+        auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastRecvTime);
+        auto interval = std::chrono::milliseconds(KEEPALIVE_INTERVAL_SEC * 1000);
+        if (idle < interval) {
+            loop->schedule(keepAliveTimer, interval - idle);
+            return;
+        }
+        KeepAlivePacket keep;
+        sendPacket(keep);
+        waitingForAck = true;
+        loop->schedule(keepAliveTimer, std::chrono::seconds(KEEPALIVE_WAIT_SEC));
+    }
+
+    void Client::onLingerTimeout() {
+        // a peer that never reads its last packets doesn't get to hold the socket open
+        shutdown(sockfd, SHUT_RDWR);
+    }
+
+    void Client::close() {
+        // best effort, so an error sent right before closing still has a chance to go out
+        if (state != State::Closed && streamGen) flush();
+        bool wasReady = state == State::Ready;
+        state = State::Closed;
+        connected = false;
+        loop->removeStream(sockfd);
+        if (readPaused) server->getMemory().countResume();
+
+        while (!imageStreams.empty()) endImageStream(imageStreams.back().id, false);
+        if (wasReady) {
+            LeaveNotifyPacket leaveNotify;
+            leaveNotify.nick = name;
+            server->broadcastToRoom(room, nullptr, leaveNotify);
+        }
+
+        server->removeClient(this);  // deletes this
+    }
+
+    void Client::processFrame(PacketType type, const uint8_t* data, size_t len) {
+        // parsed on the stack into views over the frame, nothing is copied unless it has to
+        // outlive it. malformed ones are ignored
+        BufferPool::countMessage();
+        ClientMessage msg;
+        if (!parseClientMessage(type, data, len, msg)) return;
+        std::visit([this](auto& pkt) { handle(pkt); }, msg);
+    }
+
+    void Client::handle(std::monostate) {}
+
+    void Client::handle(const KeepAlivePacket&) {
+        KeepAliveAckPacket ack;
+        sendPacket(ack);
+    }
+
+    void Client::handle(const KeepAliveAckPacket&) {
+        // the pending deadline goes back to being the next idle check
+        waitingForAck = false;
+    }
+
+    void Client::handle(const NickRequestView& req) {
+        std::string newNick(req.newNick);
+        
+        bool invalid = false;
+        SystemMessageCode code = MSG_NICK_EMPTY;
+        std::vector<std::string> params;
+        
+        size_t start = newNick.find_first_not_of(" \t\n\r");
+        size_t end = newNick.find_last_not_of(" \t\n\r");
+        
+        if (start == std::string::npos) {
+            invalid = true;
+            code = MSG_NICK_EMPTY;
+        } else {
+            newNick = newNick.substr(start, end - start + 1);
+            if (newNick.length() < 1) {
+                invalid = true;
+                code = MSG_NICK_EMPTY;
+            } else if (newNick.length() > MAX_NICK_LENGTH) {
+                invalid = true;
+                code = MSG_NICK_TOO_LONG;
+                params.push_back(std::to_string(MAX_NICK_LENGTH));
+            } else if (newNick.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-") != std::string::npos) {
+                invalid = true;
+                code = MSG_NICK_INVALID_CHARS;
+            } else if (newNick == name) {
+                invalid = true;
+                code = MSG_NICK_SAME;
+            } else if (server->isNicknameBanned(newNick)) {
+                invalid = true;
+                code = MSG_NICK_BANNED;
+            }
+        }
+        
+        if (invalid) {
+            SystemPacket err;
+            err.isError = true;
+            err.code = code;
+            err.params = params;
+            sendPacket(err);
+            return;
+        }
+        
+        if (server->isNicknameTaken(newNick, room, this)) {
+            SystemPacket err;
+            err.isError = true;
+            err.code = MSG_NICK_TAKEN;
+            err.params = { newNick };
+            sendPacket(err);
+        } else {
+            std::string old = name;
+            name = newNick;
+            server->getNicks().rename(old, name, this);
+            NickAckPacket ack;
+            ack.newNick = name;
+            sendPacket(ack);
+            NickNotifyPacket notify;
+            notify.oldNick = old;
+            notify.newNick = name;
+            server->broadcastToRoom(room, this, notify);
+        }
+    }
+
+    void Client::handle(const JoinRequestView& req) {
+        if (req.roomName == room) {
+            SystemPacket err;
+            err.isError = true;
+            err.code = MSG_JOIN_ALREADY;
+            sendPacket(err);
+        } else if (server->isNicknameTaken(name, std::string(req.roomName), nullptr)) {
+            SystemPacket err;
+            err.isError = true;
+            err.code = MSG_JOIN_NAME_TAKEN;
+            err.params = { std::string(req.roomName) };
+            sendPacket(err);
+        } else {
+            std::string oldRoom = room;
+            // streams into the old room can't go on once we're gone
+            for (size_t i = imageStreams.size(); i-- > 0;) {
+                if (imageStreams[i].target.empty()) endImageStream(imageStreams[i].id, true);
+            }
+            // leave old room
+            LeaveNotifyPacket leaveNotify;
+            leaveNotify.nick = name;
+            server->broadcastToRoom(oldRoom, this, leaveNotify);
+            server->getRoom(oldRoom).removeClient(this);
+            // join new room
+            room = req.roomName;
+            server->getRoom(room).addClient(this);
+            JoinAckPacket ack;
+            ack.roomName = room;
+            sendPacket(ack);
+            JoinNotifyPacket joinNotify;
+            joinNotify.nick = name;
+            server->broadcastToRoom(room, this, joinNotify);
+        }
+    }
+
+    void Client::handle(const ChatRequestView& req) {
+        // the text goes straight from the frame into the one buffer every member shares
+        ChatView chat;
+        chat.sender = name;
+        chat.text = req.text;
+        server->broadcastToRoom(room, this, chat);
+    }
+
+    void Client::handle(const DmRequestView& dm) {
+        server->sendDm(this, dm.targetNick, dm.text);
+    }
+
+    void Client::handle(const ImageView& req) {
+        if (!findImageType(req.mimeType)) {
+            SystemPacket err;
+            err.isError = true;
+            err.code = MSG_IMAGE_UNSUPPORTED;
+            err.params = { std::string(req.mimeType) };
+            sendPacket(err);
+            return;
+        }
+        ImageView img = req;
+        img.sender = name;
+
+        // members taking image refs get the hash, and only fetch the bytes if they don't have them.
+        // when none of the recipients does, the image isn't hashed or kept at all
+        ImageCache* cache = server->getImageCache();
+        if (cache) {
+            bool wanted = false;
+            if (img.target.empty()) wanted = server->getRoom(room).hasImageRefMembers(this);
+            else server->getNicks().with(img.target, [&](Client* c) { wanted = c->takesImageRefs(); });
+            if (!wanted) cache = nullptr;
+        }
+        SharedBuffer ref;
+        if (cache) {
+            ImageHash hash = cache->put(img.imageData.data, img.imageData.size);
+            ImageRefView r;
+            r.sender = img.sender;
+            r.target = img.target;
+            r.mimeType = img.mimeType;
+            r.fileName = img.fileName;
+            memcpy(r.hash, hash.data(), hash.size());
+            r.size = img.imageData.size;
+            ref = r.serializeShared();
+        }
+
+        size_t refs;
+        if (img.target.empty()) {
+            // doom message
+            refs = server->broadcastToRoom(room, this, img.serializeShared(), ref);
+        } else {
+            // direct message
+            refs = server->sendImageDm(this, img.target, img, ref);
+        }
+        if (cache) cache->countRefs(refs, img.imageData.size);
+    }
+
+    void Client::allowFetch(const uint8_t hash[32]) {
+        ImageHash h;
+        memcpy(h.data(), hash, h.size());
+        std::lock_guard<std::mutex> lock(fetchMutex);
+        if (std::find(fetchable.begin(), fetchable.end(), h) != fetchable.end()) return;
+        fetchable.push_back(h);
+        if (fetchable.size() > MAX_FETCHABLE_IMAGES) fetchable.pop_front();
+    }
+
+    bool Client::mayFetch(const ImageHash& hash) {
+        std::lock_guard<std::mutex> lock(fetchMutex);
+        return std::find(fetchable.begin(), fetchable.end(), hash) != fetchable.end();
+    }
+
+    void Client::handle(const ImageFetchPacket& req) {
+        if (!takesImageRefs()) return;
+        ImageHash hash;
+        memcpy(hash.data(), req.hash, hash.size());
+        // only images it got a ref to, anything else looks gone, DM images included
+        if (!mayFetch(hash)) {
+            replyFetch(hash, nullptr);
+            return;
+        }
+        // a spilled image is read back on the cache's disk thread, and the reply comes from there
+        EventLoop* lp = loop;
+        int fd = sockfd;
+        uint32_t gen = streamGen;
+        SharedBuffer blob;
+        ImageCache::Lookup found = server->getImageCache()->get(hash, blob, [lp, fd, gen, hash](SharedBuffer b) {
+            lp->post([lp, fd, gen, hash, b]() {
+                auto* c = static_cast<Client*>(lp->findStream(fd, gen));
+                if (c) c->replyFetch(hash, b);
+            });
+        });
+        if (found != ImageCache::Lookup::Reading) replyFetch(hash, blob);
+    }
+
+    void Client::replyFetch(const ImageHash& hash, const SharedBuffer& blob) {
+        if (blob) {
+            sendShared(blob, PRIVATE_ORIGIN);
+            return;
+        }
+        ImageBlobView gone;
+        memcpy(gone.hash, hash.data(), sizeof(gone.hash));
+        sendPacket(gone);
+    }
+
+    void Client::handle(const ImageBeginView& req) {
+        if (!(features & FEAT_IMAGE_STREAMS)) return;
+        if (req.size >= LARGE_FRAME_SIZE && refuseLarge(req.size)) return;
+        if (!findImageType(req.mimeType)) {
+            SystemPacket err;
+            err.isError = true;
+            err.code = MSG_IMAGE_UNSUPPORTED;
+            err.params = { std::string(req.mimeType) };
+            sendPacket(err);
+            return;
+        }
+        bool inUse = std::any_of(imageStreams.begin(), imageStreams.end(),
+                                 [&](const ImageStream& st) { return st.id == req.streamId; });
+        if (req.size == 0 || req.size > MAX_IMAGE_DATA_SIZE || inUse || imageStreams.size() >= MAX_IMAGE_STREAMS) {
+            SystemPacket err;
+            err.isError = true;
+            err.code = MSG_IMAGE_STREAM_FAILED;
+            err.params = { std::to_string(req.streamId) };
+            sendPacket(err);
+            return;
+        }
+
+        // recipients that can't take streams would never see the image, so the sender is told
+        // to send it whole instead
+        bool streamable = true;
+        if (req.target.empty()) streamable = server->getRoom(room).allTakeImageStreams(this);
+        else server->getNicks().with(req.target, [&](Client* c) { streamable = c->takesImageStreams(); });
+        if (!streamable) {
+            SystemPacket err;
+            err.isError = true;
+            err.code = MSG_IMAGE_STREAM_REFUSED;
+            err.params = { std::to_string(req.streamId) };
+            sendPacket(err);
+            return;
+        }
+
+        ImageStream st{ req.streamId, nextImageStream++, std::string(req.target), room, req.size, 0 };
+        ImageBeginView begin = req;
+        begin.sender = name;
+        begin.streamId = st.relayId;
+        if (!relayImage(st, begin.serializeShared())) {
+            SystemPacket err;
+            err.isError = true;
+            err.code = MSG_DM_TARGET_NOT_FOUND;
+            err.params = { st.target };
+            sendPacket(err);
+            return;
+        }
+        imageStreams.push_back(std::move(st));
+    }
+
+    void Client::handle(const ImageChunkView& req) {
+        // chunks still on their way after an abort are dropped quietly
+        auto it = std::find_if(imageStreams.begin(), imageStreams.end(),
+                               [&](const ImageStream& st) { return st.id == req.streamId; });
+        if (it == imageStreams.end()) return;
+        // a whole image the size of a large frame, just a chunk at a time
+        if (it->size >= LARGE_FRAME_SIZE && server->getMemory().getLevel() == MemoryGovernor::Level::Hard) {
+            server->getMemory().countRefused();
+            endImageStream(it->id, true);
+            return;
+        }
+        if (req.offset != it->received || req.data.size == 0 || req.data.size > it->size - it->received) {
+            endImageStream(it->id, true);
+            return;
+        }
+
+        // only the stream id changes, the bytes go out as they came in
+        ImageChunkView chunk = req;
+        chunk.streamId = it->relayId;
+        it->received += req.data.size;
+        if (!relayImage(*it, chunk.serializeShared())) {
+            endImageStream(it->id, true);
+            return;
+        }
+        if (it->received == it->size) imageStreams.erase(it);
+    }
+
+    void Client::handle(const ImageAbortPacket& req) {
+        endImageStream(req.streamId, false);
+    }
+
+    bool Client::relayImage(const ImageStream& stream, const SharedBuffer& payload) {
+        if (stream.target.empty()) {
+            server->broadcastToRoom(stream.room, this, payload);
+            return true;
+        }
+        return server->sendToNick(stream.target, payload);
+    }
+
+    void Client::endImageStream(uint32_t id, bool failed) {
+        auto it = std::find_if(imageStreams.begin(), imageStreams.end(),
+                               [&](const ImageStream& st) { return st.id == id; });
+        if (it == imageStreams.end()) return;
+        ImageAbortPacket abort;
+        abort.streamId = it->relayId;
+        relayImage(*it, abort.serializeShared());
+        if (failed) {
+            SystemPacket err;
+            err.isError = true;
+            err.code = MSG_IMAGE_STREAM_FAILED;
+            err.params = { std::to_string(id) };
+            sendPacket(err);
+        }
+        imageStreams.erase(it);
     }
 
     void Client::disconnect() {
+        // whatever is already queued (a kick or ban notice) goes out first, then the
+        // owning loop shuts the socket down and sees the hangup
         connected = false;
-        close(sockfd);
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            if (closeAfterFlush) return;
+            closeAfterFlush = true;
+            if (flushPending) return;
+            flushPending = true;
+        }
+        uint32_t gen = streamGen;
+        if (gen) loop->requestFlush(sockfd, gen);
+        else shutdown(sockfd, SHUT_RDWR);
     }
 
 }
\ No newline at end of file
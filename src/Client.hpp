@@ -1,8 +1,22 @@
 #pragma once
 
+#include "Aead.hpp"
+#include "Compressor.hpp"
+#include "CryptoContext.hpp"
+#include "EventLoop.hpp"
+#include "HandshakePool.hpp"
+#include "ImageCache.hpp"
 #include "Packet.hpp"
+#include "Protocol.hpp"
+#include "RecvBuffer.hpp"
 
+#include <openssl/bn.h>
+
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <deque>
 #include <netinet/in.h>
 #include <string>
 #include <vector>
@@ -13,43 +27,209 @@ namespace Retchat {
 
     class Server;
 
-    class Client {
+    class Client : public EventLoop::Handler {
     public:
-        Client(int sockfd, Server* server, const std::string& ip);
+        // whose words a queued packet carries, for compression: a client's id, or one of these
+        static constexpr uint64_t SERVER_ORIGIN = 0;
+        static constexpr uint64_t PRIVATE_ORIGIN = UINT64_MAX;  // DMs, keys, fetched images: never compressed
+
+        Client(int sockfd, Server* server, EventLoop* loop, const std::string& ip);
         ~Client();
         void start();
-        void sendPacket(const Packet& pkt);
+        template <typename P>
+        void sendPacket(const P& pkt) { sendShared(pkt.serializeShared()); }
+        // a packet already serialized with serializeShared, so many clients can share it.
+        // compression never lets packets of different origins share a frame or a dictionary,
+        // so one sender's text can't be used to guess another's from the frame sizes
+        void sendShared(const SharedBuffer& payload, uint64_t origin = SERVER_ORIGIN);
         void disconnect();
         bool isConnected() const { return connected; }
+        // the cipher room broadcasts to this client are sealed with, 0 when it doesn't take room keys
+        uint32_t getRoomCipher() const;
+        bool takesImageRefs() const { return features & FEAT_IMAGE_REFS; }
+        bool takesImageStreams() const { return features & FEAT_IMAGE_STREAMS; }
+        // a ref to this image went (or is going) out to this client, so it may fetch the image
+        void allowFetch(const uint8_t hash[32]);
+        // queue a frame the room already sealed, it goes out as is
+        void sendSealed(PacketType type, const SharedBuffer& frame);
 
         int getSockfd() const { return sockfd; }
+        uint64_t getId() const { return id; }
         std::string getIp() const { return ip; }
         std::string getName() const { return name; }
         std::string getRoom() const { return room; }
         void setName(const std::string& n) { name = n; }
         void setRoom(const std::string& r) { room = r; }
+        size_t getQueuedBytes() const { return queuedBytes.load(std::memory_order_relaxed); }
+        uint64_t getDroppedPackets() const { return droppedPackets.load(std::memory_order_relaxed); }
+        std::string getCompressionSummary() const;
+
+        void onEvent(uint32_t events) override;
+        void onData(const uint8_t* data, size_t len) override;
 
     private:
-        void run();
-        bool handshake();
-        bool readFrame(std::vector<uint8_t>& outPlain);
-        void processPacket(Packet* pkt);
+        // connection lifecycle, driven by the owning event loop
+        enum class State { ServerKey, KeyExchange, DeriveKey, VersionExchange, Ready, Closed };
+        enum class FrameResult { Ok, NeedMore, Invalid, Refused };
 
-        std::string ip;
+        void beginHandshake();
+        void sendServerKey(HandshakePool::KeyPair&& kp);
+        bool onKeyExchange();
+        struct KeyResult {
+            bool ok = false;
+            std::array<uint8_t, 32> key;
+            std::vector<uint8_t> reply;  // raw bytes for the client ahead of the version exchange
+        };
+        void onKeyDerived(const KeyResult& result);
+        bool onVersionExchange(const uint8_t* plain, size_t len);
+        void onReady();
+        void handleReadable(uint32_t events);
+        // false once the connection is closed, and this gone
+        bool processInput(bool eof);
+        FrameResult readFrame(uint8_t*& plain, size_t& len);
+        void processFrame(PacketType type, const uint8_t* data, size_t len);
+        void handle(std::monostate);
+        void handle(const KeepAlivePacket& pkt);
+        void handle(const KeepAliveAckPacket& pkt);
+        void handle(const NickRequestView& req);
+        void handle(const JoinRequestView& req);
+        void handle(const ChatRequestView& req);
+        void handle(const DmRequestView& dm);
+        void handle(const ImageView& req);
+        void handle(const ImageBeginView& req);
+        void handle(const ImageChunkView& req);
+        void handle(const ImageAbortPacket& req);
+        void handle(const ImageFetchPacket& req);
+        bool mayFetch(const ImageHash& hash);
+        // the fetched image, or the empty blob that says it's gone
+        void replyFetch(const ImageHash& hash, const SharedBuffer& blob);
+        struct ImageStream;
+        bool relayImage(const ImageStream& stream, const SharedBuffer& payload);
+        // tells the recipients, and with failed the sender too
+        void endImageStream(uint32_t id, bool failed);
+        void sendRaw(const uint8_t* data, size_t len);
+        // queuedBytes, kept in step with the memory governor
+        void addQueued(size_t n);
+        void removeQueued(size_t n);
+        // inbound side of the memory governor: what the receive buffers hold, how much this
+        // client sends, and reading paused and resumed as memory runs short and comes back
+        void countReceived(size_t n);
+        void trackReceiveMemory();
+        void applyBackpressure();
+        void onPressureTimer();
+        bool refuseLarge(size_t len);
+        // past the hard watermark: refuses a large frame that's partly buffered. true if it's one
+        // that can't be dropped and is still held
+        bool holdsLargeFrame();
+        // drops a refused frame, the part that's buffered now and the rest as it comes in
+        void skipFrame(size_t total);
+        struct Outgoing;
+        void enqueue(Outgoing&& out);
+        bool makeRoom(size_t size);
+        void flush();
+        bool writeWire();
+        SharedBuffer sealFrame(const std::vector<uint8_t>& payload);
+        // seals payload onto the wire, counted is how much of it queuedBytes already holds.
+        // for clients taking compression it's deflated first unless it's small or private, and
+        // the dictionary starts over whenever the origin changes
+        bool sealToWire(const std::vector<uint8_t>& payload, size_t counted, uint64_t origin);
+        bool packRun();
+        void close();
+        void onHandshakeTimeout();
+        void onKeepAliveTimer();
+        void onLingerTimeout();
 
+        uint64_t id;  // unique for the server's lifetime, unlike the fd or the address
         int sockfd;
         Server* server;
+        EventLoop* loop;
+        std::string ip;
+        std::atomic<uint32_t> streamGen{0};
         std::string name;
         std::string room;
         uint8_t encKey[32];
+        CryptoContext frameCrypto;  // version 1 frames, keyed once the key exchange is done
         uint64_t sendCounter, recvCounter;
-        bool connected;
+        std::atomic<bool> connected;
+        State state = State::ServerKey;
+        HandshakePool::KeyPair serverKey;
+        uint16_t version = PROTOCOL_VERSION;
+        uint32_t features = 0;  // negotiated in the version exchange
+        Aead aead;
+        Compressor compressor;  // both directions, driven by the loop thread
+        uint64_t deflateOrigin = SERVER_ORIGIN;  // whose packets the deflate history holds
+        std::vector<uint8_t> inflated;  // the last compressed frame the client sent, inflated
+        size_t trackedReceive = 0;  // inBuf and inflated as the memory governor last saw them
+        size_t discarding = 0;  // bytes of a refused frame still to come, dropped instead of buffered
+
+        // bytes received in the current second and the one before, for telling heavy senders
+        // apart when memory runs short. loop thread only
+        std::chrono::steady_clock::time_point inWindowStart;
+        size_t inWindowBytes = 0;
+        size_t lastWindowBytes = 0;
+        bool readPaused = false;
+        std::chrono::steady_clock::time_point lastPauseWarning;
+
+        // inbound bytes not yet parsed, only touched by the loop thread
+        RecvBuffer inBuf;
+
+        // outbound packets, queued as shared plaintext by any thread. they're only encrypted
+        // when the owning loop moves them to the socket, so queued ones can still be dropped
+        struct Outgoing {
+            PacketType type;
+            bool sealed;         // a room frame, ready for the wire as is
+            SharedBuffer bytes;  // type byte + payload, or the sealed frame
+            uint64_t origin;
+        };
         std::mutex sendMutex;
+        std::deque<Outgoing> outQueue;
+        std::deque<Outgoing> flushBatch;  // swapped with outQueue by flush, both keep their storage
+        bool flushPending = false;
+        bool closeAfterFlush = false;
+        bool overflowing = false;
+        std::atomic<size_t> queuedBytes{0};  // queued + sealed but unsent, counted against the budget
+        std::atomic<uint64_t> droppedPackets{0};
+
+        // sealed frames the socket hasn't accepted yet, written with one sendmsg per flush.
+        // only touched by the loop thread. a vector consumed from wireHead and cleared once
+        // drained, so it keeps its capacity instead of allocating as frames come and go
+        std::vector<SharedBuffer> wire;
+        size_t wireHead = 0;
+        std::vector<CryptoContext::SealJob> sealJobs;  // version 1 frames flush seals in one go
+        // the plain packets flush is collecting into the next batch frame, and the batches
+        // it built, which have to live until they're sealed
+        std::vector<const std::vector<uint8_t>*> run;
+        size_t runSize = 1;  // as a batch: type byte + a length and a packet each
+        uint64_t runOrigin = SERVER_ORIGIN;  // with compression a run never mixes origins
+        std::vector<SharedBuffer> packed;
+        size_t wireOff = 0;  // into wire[wireHead]
+        size_t ringInFlight = 0;
+
+        // images this client is streaming, forwarded a chunk at a time. loop thread only
+        struct ImageStream {
+            uint32_t id;       // the client's
+            uint32_t relayId;  // what the recipients see
+            std::string target;  // empty for the room
+            std::string room;
+            uint32_t size;
+            uint32_t received;
+        };
+        std::vector<ImageStream> imageStreams;
+
+        // the images it was sent refs to, oldest first, and the only ones it may fetch.
+        // added to by whichever thread sends the ref
+        std::mutex fetchMutex;
+        std::deque<ImageHash> fetchable;
+
+        // deadlines, all on the owning loop's timer wheel
+        Timer handshakeTimer{ [this]() { onHandshakeTimeout(); } };
+        Timer keepAliveTimer{ [this]() { onKeepAliveTimer(); } };
+        Timer lingerTimer{ [this]() { onLingerTimeout(); } };
+        Timer pressureTimer{ [this]() { onPressureTimer(); } };
 
         // keepalive
         std::chrono::steady_clock::time_point lastRecvTime;
-        std::chrono::steady_clock::time_point lastKeepAliveSent;
         bool waitingForAck = false;
     };
 
-}
\ No newline at end of file
+}
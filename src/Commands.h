@@ -16,11 +16,12 @@ namespace Retchat {
     const std::string CMD_UNBANIP = "unbanip";
     const std::string CMD_QUERY   = "query";
     const std::string CMD_LIST    = "list";
+    const std::string CMD_LIMIT   = "limit";
 
-    const std::array<std::string, 9> CMDS = {
+    const std::array<std::string, 10> CMDS = {
         CMD_HELP, CMD_STOP, CMD_KICK,
         CMD_BAN, CMD_IPBAN, CMD_UNBAN, CMD_UNBANIP,
-        CMD_QUERY, CMD_LIST
+        CMD_QUERY, CMD_LIST, CMD_LIMIT
     };
 
 
@@ -38,10 +39,18 @@ namespace Retchat {
         } else if (cmd == CMD_QUERY) {
             Logger::info("query room <name>: info about a room");
             Logger::info("query client <fd>: info about a client");
+            Logger::info("query ip <ip>: connection limits state for an address and its /24");
+            Logger::info("query buffers: frame buffer pool usage and allocations per message");
+            Logger::info("query images: image cache contents and how much image data refs saved");
+            Logger::info("query memory: memory held for clients against the watermarks, and who is being pushed back");
         } else if (cmd == CMD_LIST) {
             Logger::info("list rooms: list all rooms");
             Logger::info("list clients: list all connected clients");
             Logger::info("list bans: list all active bans");
+        } else if (cmd == CMD_LIMIT) {
+            Logger::info("limit: show connection limits and refused connections");
+            Logger::info("limit <ip|subnet> <rate>/<burst>/<max>|off: change the per-ip or per-/24 limit");
+            Logger::info("limit memory <soft>/<hard>|off: change the memory watermarks, in bytes");
         } else if (cmd == CMD_STOP) {
             Logger::info("stop: shut down the server");
         } else if (cmd == CMD_HELP) {
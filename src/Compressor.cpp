@@ -0,0 +1,173 @@
+#include "Compressor.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+
+constexpr int WINDOW_BITS = 12;   // 4 KB, negative below for raw deflate
+constexpr int MEM_LEVEL = 5;      // 16 KB of hash state
+constexpr int LEVEL = 3;          // chat lines gain next to nothing from the slower levels
+constexpr size_t GROW_SIZE = 256; // room added whenever the output fills up
+constexpr uint8_t FLUSH_TAIL[] = { 0x00, 0x00, 0xff, 0xff };  // ends every sync flush
+
+
+namespace Retchat {
+
+    // only ever written by the owning loop, so plain loads and stores are enough
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static uint64_t since(std::chrono::steady_clock::time_point start) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    }
+
+    Compressor::~Compressor() {
+        if (deflater) {
+            deflateEnd(deflater);
+            delete deflater;
+        }
+        if (inflater) {
+            inflateEnd(inflater);
+            delete inflater;
+        }
+    }
+
+    bool Compressor::initDeflate() {
+        deflater = new z_stream();
+        // every frame is its own block, too small to pay for building huffman trees
+        if (deflateInit2(deflater, LEVEL, Z_DEFLATED, -WINDOW_BITS, MEM_LEVEL, Z_FIXED) == Z_OK) return true;
+        delete deflater;
+        deflater = nullptr;
+        return false;
+    }
+
+    bool Compressor::initInflate() {
+        inflater = new z_stream();
+        if (inflateInit2(inflater, -WINDOW_BITS) == Z_OK) return true;
+        delete inflater;
+        inflater = nullptr;
+        return false;
+    }
+
+    bool Compressor::compress(const uint8_t* in, size_t len, std::vector<uint8_t>& out) {
+        if (!deflater && !initDeflate()) return false;
+        auto start = std::chrono::steady_clock::now();
+        size_t base = out.size();
+        size_t used = base;
+        deflater->next_in = const_cast<uint8_t*>(in);
+        deflater->avail_in = len;
+        do {
+            out.resize(used + outputRoom(len));
+            deflater->next_out = out.data() + used;
+            deflater->avail_out = out.size() - used;
+            // a buffer that filled up exactly leaves nothing for the next call to do
+            int ret = deflate(deflater, Z_SYNC_FLUSH);
+            used = out.size() - deflater->avail_out;
+            if (ret == Z_BUF_ERROR) break;
+            if (ret != Z_OK) return false;
+        } while (deflater->avail_out == 0);
+
+        // the receiver puts the marker back before inflating
+        if (used - base < sizeof(FLUSH_TAIL)) return false;
+        out.resize(used - sizeof(FLUSH_TAIL));
+        bump(framesOut);
+        bump(plainOut, len);
+        bump(compressedOut, out.size() - base);
+        bump(nanos, since(start));
+        return true;
+    }
+
+    size_t Compressor::outputRoom(size_t len) {
+        return GROW_SIZE + len / 2;
+    }
+
+    bool Compressor::reset() {
+        // a sync flush ends on a byte boundary with no block open, so the receiver reads on
+        // as if nothing happened, only without the history to match against
+        if (!deflater) return true;
+        return deflateReset(deflater) == Z_OK;
+    }
+
+    bool Compressor::decompress(const uint8_t* in, size_t len, std::vector<uint8_t>& out, size_t maxSize) {
+        if (!inflater && !initInflate()) return false;
+        auto start = std::chrono::steady_clock::now();
+        size_t base = out.size();
+        size_t used = base;
+        // the frame, then the flush marker the sender left off
+        const uint8_t* parts[] = { in, FLUSH_TAIL };
+        size_t lens[] = { len, sizeof(FLUSH_TAIL) };
+        for (int i = 0; i < 2; i++) {
+            inflater->next_in = const_cast<uint8_t*>(parts[i]);
+            inflater->avail_in = lens[i];
+            while (inflater->avail_in > 0) {
+                if (used == out.size()) {
+                    if (used - base >= maxSize) return false;
+                    out.resize(std::min(used + GROW_SIZE + len * 2, base + maxSize));
+                }
+                inflater->next_out = out.data() + used;
+                inflater->avail_out = out.size() - used;
+                // the stream lasts as long as the connection, a final block ends it for good
+                int ret = inflate(inflater, Z_SYNC_FLUSH);
+                used = out.size() - inflater->avail_out;
+                if (ret != Z_OK && ret != Z_BUF_ERROR) return false;
+                if (ret == Z_BUF_ERROR && inflater->avail_out > 0) return false;
+            }
+        }
+        // whatever inflate still holds comes out once there's room for it
+        while (inflater->avail_out == 0) {
+            if (used - base >= maxSize) return false;
+            out.resize(std::min(used + GROW_SIZE, base + maxSize));
+            inflater->next_out = out.data() + used;
+            inflater->avail_out = out.size() - used;
+            int ret = inflate(inflater, Z_SYNC_FLUSH);
+            used = out.size() - inflater->avail_out;
+            if (ret == Z_BUF_ERROR) break;
+            if (ret != Z_OK) return false;
+        }
+        out.resize(used);
+        bump(framesIn);
+        bump(compressedIn, len);
+        bump(plainIn, used - base);
+        bump(nanos, since(start));
+        return true;
+    }
+
+    void Compressor::countSkipped(size_t len) {
+        bump(skippedOut);
+        bump(plainOut, len);
+        bump(compressedOut, len);
+    }
+
+    Compressor::Stats Compressor::getStats() const {
+        Stats s;
+        s.framesOut = framesOut.load(std::memory_order_relaxed);
+        s.skippedOut = skippedOut.load(std::memory_order_relaxed);
+        s.plainOut = plainOut.load(std::memory_order_relaxed);
+        s.compressedOut = compressedOut.load(std::memory_order_relaxed);
+        s.framesIn = framesIn.load(std::memory_order_relaxed);
+        s.compressedIn = compressedIn.load(std::memory_order_relaxed);
+        s.plainIn = plainIn.load(std::memory_order_relaxed);
+        s.nanos = nanos.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    std::string Compressor::getSummary() const {
+        Stats s = getStats();
+        auto ratio = [](uint64_t compressed, uint64_t plain) {
+            if (!plain) return std::string("-");
+            char buf[16];
+            snprintf(buf, sizeof(buf), "%.1f%%", 100.0 * compressed / plain);
+            return std::string(buf);
+        };
+        return "out " + std::to_string(s.framesOut) + " compressed + " + std::to_string(s.skippedOut) + " as is, " +
+               std::to_string(s.plainOut) + "B -> " + std::to_string(s.compressedOut) + "B (" + ratio(s.compressedOut, s.plainOut) +
+               ") | in " + std::to_string(s.framesIn) + " compressed, " + std::to_string(s.compressedIn) + "B -> " +
+               std::to_string(s.plainIn) + "B | " + std::to_string(s.nanos / 1000) + "us cpu";
+    }
+
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+typedef struct z_stream_s z_stream;
+
+
+namespace Retchat {
+
+    // one deflate stream per direction for a connection's whole lifetime, so every frame is
+    // compressed against what came before it and a chat line that repeats a nick or a phrase
+    // costs a few bytes. the sender can forget its history between frames and the receiver
+    // never needs to know. raw deflate with a 4 KB window keeps a connection's state around
+    // 40 KB, and each frame ends in a sync flush with its trailing 00 00 ff ff left off.
+    // both streams are only created once something goes through them
+    class Compressor {
+    public:
+        Compressor() = default;
+        ~Compressor();
+        Compressor(const Compressor&) = delete;
+        Compressor& operator=(const Compressor&) = delete;
+
+        // deflates in onto the end of out
+        bool compress(const uint8_t* in, size_t len, std::vector<uint8_t>& out);
+        // what compress usually grows out by for len bytes, to size the buffer up front
+        static size_t outputRoom(size_t len);
+        // the next frame is compressed against nothing that went before it
+        bool reset();
+        // inflates one frame's worth of the peer's stream onto the end of out, failing if it
+        // would grow out past maxSize
+        bool decompress(const uint8_t* in, size_t len, std::vector<uint8_t>& out, size_t maxSize);
+        // a frame that went out as is, too small or not worth it
+        void countSkipped(size_t len);
+
+        // written by the owning loop only, read by the console
+        struct Stats {
+            uint64_t framesOut = 0;     // compressed
+            uint64_t skippedOut = 0;
+            uint64_t plainOut = 0;      // bytes before compression
+            uint64_t compressedOut = 0; // and after
+            uint64_t framesIn = 0;
+            uint64_t compressedIn = 0;
+            uint64_t plainIn = 0;
+            uint64_t nanos = 0;         // spent deflating and inflating
+        };
+        Stats getStats() const;
+        std::string getSummary() const;
+
+    private:
+        bool initDeflate();
+        bool initInflate();
+
+        z_stream* deflater = nullptr;
+        z_stream* inflater = nullptr;
+
+        std::atomic<uint64_t> framesOut{0};
+        std::atomic<uint64_t> skippedOut{0};
+        std::atomic<uint64_t> plainOut{0};
+        std::atomic<uint64_t> compressedOut{0};
+        std::atomic<uint64_t> framesIn{0};
+        std::atomic<uint64_t> compressedIn{0};
+        std::atomic<uint64_t> plainIn{0};
+        std::atomic<uint64_t> nanos{0};
+    };
+
+}
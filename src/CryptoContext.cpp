@@ -0,0 +1,336 @@
+#include "CryptoContext.hpp"
+
+#include "Sha256Lanes.hpp"
+
+#include <openssl/crypto.h>
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+
+namespace Retchat {
+
+    constexpr size_t BLOCK = 32;  // one HMAC-SHA256 output, one keystream block
+
+    // what preferredLanes times each kernel on: a 16-frame batch, a few times over
+    constexpr size_t CALIBRATE_BATCH = 16;
+    constexpr size_t CALIBRATE_FRAME_SIZE = 256;
+    constexpr int CALIBRATE_REPEATS = 8;
+    constexpr int CALIBRATE_ROUNDS = 3;
+
+    typedef uint8_t Block __attribute__((vector_size(BLOCK)));
+
+    // one keystream block over the data, as a single vector op where the target has them
+    static inline void xorBlock(const uint8_t* in, uint8_t* out, const uint8_t* ks) {
+        Block d, k;
+        memcpy(&d, in, BLOCK);
+        memcpy(&k, ks, BLOCK);
+        d ^= k;
+        memcpy(out, &d, BLOCK);
+    }
+
+    static const uint32_t SHA256_IV[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    // time one kernel on full batches of typical frames, best of a few rounds
+    static double timeKernel(const CryptoContext::SealJob* jobs, size_t n, unsigned int lanes) {
+        using Clock = std::chrono::steady_clock;
+        double best = 1e30;
+        CryptoContext::sealBatch(jobs, n, lanes);
+        for (int round = 0; round < CALIBRATE_ROUNDS; round++) {
+            auto start = Clock::now();
+            for (int i = 0; i < CALIBRATE_REPEATS; i++) CryptoContext::sealBatch(jobs, n, lanes);
+            best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+        }
+        return best;
+    }
+
+    unsigned int CryptoContext::preferredLanes() {
+        static const unsigned int lanes = []() {
+            unsigned int widest = sha256LaneCount();
+            if (widest == 1) return 1u;
+            uint8_t key[32];
+            for (int i = 0; i < 32; i++) key[i] = (uint8_t) (i * 7 + 1);
+            CryptoContext ctx;
+            ctx.init(key);
+            std::vector<uint8_t> in(CALIBRATE_BATCH * CALIBRATE_FRAME_SIZE, 0x5a), out(in.size());
+            std::vector<uint8_t> tags(CALIBRATE_BATCH * 32);
+            std::vector<SealJob> jobs(CALIBRATE_BATCH);
+            for (size_t i = 0; i < CALIBRATE_BATCH; i++) {
+                jobs[i] = { &ctx, i, in.data() + i * CALIBRATE_FRAME_SIZE, out.data() + i * CALIBRATE_FRAME_SIZE,
+                            CALIBRATE_FRAME_SIZE, tags.data() + i * 32 };
+            }
+            unsigned int best = 1;
+            double bestTime = timeKernel(jobs.data(), jobs.size(), 1);
+            for (unsigned int candidate : { 8u, 16u }) {
+                if (candidate > widest) break;
+                double t = timeKernel(jobs.data(), jobs.size(), candidate);
+                if (t < bestTime) { best = candidate; bestTime = t; }
+            }
+            return best;
+        }();
+        return lanes;
+    }
+
+    static inline uint32_t load32(const uint8_t* p) {
+        return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+    }
+
+    static inline void store32(uint8_t* p, uint32_t v) {
+        p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+    }
+
+    // padding and length for the 32-byte messages (a keystream block, an inner hash) after a
+    // 64-byte key block
+    static const uint32_t DIGEST_PADDING[8] = { 0x80000000, 0, 0, 0, 0, 0, 0, (SHA256_CBLOCK + BLOCK) * 8 };
+
+    // copied in whole, so the kernel's wide loads don't wait on a mix of narrower stores
+    static inline void padDigest(uint32_t w[16], const uint32_t digest[8]) {
+        memcpy(w, digest, 8 * sizeof(uint32_t));
+        memcpy(w + 8, DIGEST_PADDING, sizeof(DIGEST_PADDING));
+    }
+
+    // the chaining value one pad block leaves
+    static void keyPad(const uint8_t pad[SHA256_CBLOCK], uint32_t state[8]) {
+        memcpy(state, SHA256_IV, sizeof(SHA256_IV));
+        sha256Blocks(state, pad, 1);
+    }
+
+    CryptoContext::~CryptoContext() {
+        OPENSSL_cleanse(innerState, sizeof(innerState));
+        OPENSSL_cleanse(outerState, sizeof(outerState));
+    }
+
+    void CryptoContext::init(const uint8_t key[32]) {
+        // keys up to the 64-byte block size are used as is, zero padded
+        uint8_t pad[SHA256_CBLOCK];
+        memset(pad, 0x36, sizeof(pad));
+        for (int i = 0; i < 32; i++) pad[i] ^= key[i];
+        keyPad(pad, innerState);
+
+        memset(pad, 0x5c, sizeof(pad));
+        for (int i = 0; i < 32; i++) pad[i] ^= key[i];
+        keyPad(pad, outerState);
+        OPENSSL_cleanse(pad, sizeof(pad));
+    }
+
+    void CryptoContext::hmac(const uint8_t* data, size_t len, uint8_t out[32]) const {
+        uint32_t h[8], w[32];
+        if (len == BLOCK) {
+            // a keystream block, the one that comes up most by far, goes through both hashes in one
+            sha256HmacBlock(innerState, outerState, data, out);
+            return;
+        }
+
+        // the inner hash goes on from the ipad state over data, then its padding and the length
+        // of key block + data
+        memcpy(h, innerState, sizeof(h));
+        size_t full = len / SHA256_CBLOCK;
+        if (full) sha256Blocks(h, data, full);
+        size_t rest = len - full * SHA256_CBLOCK;
+        size_t words = rest + 9 <= SHA256_CBLOCK ? 16 : 32;
+        uint8_t tail[2 * SHA256_CBLOCK] = {};
+        if (rest) memcpy(tail, data + full * SHA256_CBLOCK, rest);
+        tail[rest] = 0x80;
+        for (size_t i = 0; i < words - 2; i++) w[i] = load32(tail + i * 4);
+        uint64_t bits = (uint64_t) (SHA256_CBLOCK + len) * 8;
+        w[words - 2] = bits >> 32;
+        w[words - 1] = bits & 0xFFFFFFFF;
+        sha256Compress1(h, w);
+        if (words == 32) sha256Compress1(h, w + 16);
+
+        // the outer one is a single block from the opad state: the inner digest, padded
+        padDigest(w, h);
+        memcpy(h, outerState, sizeof(h));
+        sha256Compress1(h, w);
+        for (int i = 0; i < 8; i++) store32(out + i * 4, h[i]);
+    }
+
+    void CryptoContext::mac(const uint8_t* data, size_t len, uint8_t out[32]) const {
+        hmac(data, len, out);
+    }
+
+    void CryptoContext::xorCrypt(const uint8_t* in, uint8_t* out, size_t len, uint64_t counter) const {
+        // block 0 is the HMAC of the little-endian counter, every next one the HMAC of the previous
+        uint8_t counterBytes[8];
+        for (int i = 0; i < 8; i++) counterBytes[i] = (counter >> (i * 8)) & 0xFF;
+        uint8_t ks[BLOCK];
+        hmac(counterBytes, sizeof(counterBytes), ks);
+        xorFrom(in, out, len, 0, ks);
+    }
+
+    void CryptoContext::xorFrom(const uint8_t* in, uint8_t* out, size_t len, size_t off, uint8_t ks[32]) const {
+        for (; off + BLOCK <= len; off += BLOCK) {
+            xorBlock(in + off, out + off, ks);
+            if (off + BLOCK < len) hmac(ks, BLOCK, ks);
+        }
+        for (size_t i = 0; off + i < len; i++) out[off + i] = in[off + i] ^ ks[i];
+    }
+
+    void CryptoContext::deriveKeystream(uint8_t* keystream, size_t len, uint64_t counter) const {
+        memset(keystream, 0, len);
+        xorCrypt(keystream, len, counter);
+    }
+
+    void CryptoContext::sealBatch(const SealJob* jobs, size_t n, unsigned int lanes) {
+        if (!lanes) {
+            // with most lanes idle every frame would pay for the whole vector
+            lanes = preferredLanes();
+            if (n * 2 < lanes) lanes = 1;
+        }
+        if (lanes < 8) {
+            for (size_t i = 0; i < n; i++) {
+                const SealJob& job = jobs[i];
+                job.ctx->xorCrypt(job.in, job.out, job.len, job.counter);
+                job.ctx->mac(job.out, job.len, job.tag);
+            }
+            return;
+        }
+        sealLanes(jobs, n, lanes);
+    }
+
+    void CryptoContext::sealLanes(const SealJob* jobs, size_t n, unsigned int lanes) {
+        // every HMAC here is a chain of single-block compressions, so each lane runs a little
+        // state machine and all lanes advance one compression per kernel call. a lane whose
+        // frame is done takes the next one
+        enum Phase { CounterInner, KeystreamInner, KeystreamOuter, MacInner, MacOuter };
+        struct Lane {
+            const SealJob* job;
+            Phase phase;
+            size_t off;     // keystream bytes applied, or MAC input bytes hashed
+            size_t macEnd;  // MAC input length with its padding
+            uint32_t h[8];  // the last compression's output
+        };
+        void (*compressLanes)(uint32_t*, const uint32_t*) = lanes == 16 ? sha256Compress16 : sha256Compress8;
+
+        Lane lane[16];
+        uint32_t state[8 * 16], block[16 * 16];
+        size_t next = 0, active = 0;
+        auto assign = [&](Lane& l) {
+            l.job = next < n ? &jobs[next++] : nullptr;
+            if (!l.job) return;
+            l.phase = l.job->len ? CounterInner : MacInner;
+            l.off = 0;
+            l.macEnd = (l.job->len + 9 + SHA256_CBLOCK - 1) / SHA256_CBLOCK * SHA256_CBLOCK;
+            active++;
+        };
+        for (unsigned int i = 0; i < lanes; i++) assign(lane[i]);
+
+        while (active > 0) {
+            // a long frame left on its own goes faster through the single-buffer path
+            if (active == 1 && next == n) {
+                Lane* l = lane;
+                while (!l->job) l++;
+                const SealJob& job = *l->job;
+                if (l->phase == CounterInner) {
+                    job.ctx->xorCrypt(job.in, job.out, job.len, job.counter);
+                } else if (l->phase == KeystreamInner) {
+                    uint8_t ks[BLOCK];
+                    for (int i = 0; i < 8; i++) store32(ks + i * 4, l->h[i]);
+                    job.ctx->hmac(ks, BLOCK, ks);
+                    job.ctx->xorFrom(job.in, job.out, job.len, l->off, ks);
+                }
+                if (l->phase <= KeystreamInner || (l->phase == MacInner && l->off == 0)) {
+                    job.ctx->mac(job.out, job.len, job.tag);
+                    return;
+                }
+            }
+
+            for (unsigned int i = 0; i < lanes; i++) {
+                Lane& l = lane[i];
+                uint32_t w[16] = {};
+                const uint32_t* start = w;  // idle lanes hash anything
+                if (l.job) {
+                    const CryptoContext& ctx = *l.job->ctx;
+                    switch (l.phase) {
+                        case CounterInner: {
+                            // the counter is little-endian on the wire
+                            uint8_t counter[8];
+                            for (int b = 0; b < 8; b++) counter[b] = (l.job->counter >> (b * 8)) & 0xFF;
+                            w[0] = load32(counter);
+                            w[1] = load32(counter + 4);
+                            w[2] = 0x80000000;
+                            w[15] = (SHA256_CBLOCK + 8) * 8;
+                            start = ctx.innerState;
+                            break;
+                        }
+                        case KeystreamInner:
+                            padDigest(w, l.h);
+                            start = ctx.innerState;
+                            break;
+                        case KeystreamOuter:
+                        case MacOuter:
+                            padDigest(w, l.h);
+                            start = ctx.outerState;
+                            break;
+                        case MacInner: {
+                            const uint8_t* data = l.job->out;
+                            size_t len = l.job->len;
+                            if (l.off + SHA256_CBLOCK <= len) {
+                                for (int b = 0; b < 16; b++) w[b] = load32(data + l.off + b * 4);
+                            } else {
+                                uint8_t buf[SHA256_CBLOCK] = {};
+                                if (l.off < len) memcpy(buf, data + l.off, len - l.off);
+                                if (l.off <= len) buf[len - l.off] = 0x80;
+                                if (l.off + SHA256_CBLOCK == l.macEnd) {
+                                    uint64_t bits = (uint64_t) (SHA256_CBLOCK + len) * 8;
+                                    store32(buf + 56, bits >> 32);
+                                    store32(buf + 60, bits & 0xFFFFFFFF);
+                                }
+                                for (int b = 0; b < 16; b++) w[b] = load32(buf + b * 4);
+                            }
+                            start = l.off == 0 ? ctx.innerState : l.h;
+                            break;
+                        }
+                    }
+                }
+                for (int k = 0; k < 8; k++) state[k * lanes + i] = start[k];
+                for (int k = 0; k < 16; k++) block[k * lanes + i] = w[k];
+            }
+
+            compressLanes(state, block);
+
+            for (unsigned int i = 0; i < lanes; i++) {
+                Lane& l = lane[i];
+                if (!l.job) continue;
+                for (int k = 0; k < 8; k++) l.h[k] = state[k * lanes + i];
+                const SealJob& job = *l.job;
+                switch (l.phase) {
+                    case CounterInner:
+                    case KeystreamInner:
+                        l.phase = KeystreamOuter;
+                        break;
+                    case KeystreamOuter: {
+                        uint8_t ks[BLOCK];
+                        for (int k = 0; k < 8; k++) store32(ks + k * 4, l.h[k]);
+                        size_t chunk = std::min(BLOCK, job.len - l.off);
+                        if (chunk == BLOCK) xorBlock(job.in + l.off, job.out + l.off, ks);
+                        else for (size_t b = 0; b < chunk; b++) job.out[l.off + b] = job.in[l.off + b] ^ ks[b];
+                        l.off += chunk;
+                        if (l.off < job.len) {
+                            l.phase = KeystreamInner;
+                        } else {
+                            l.phase = MacInner;
+                            l.off = 0;
+                        }
+                        break;
+                    }
+                    case MacInner:
+                        l.off += SHA256_CBLOCK;
+                        if (l.off == l.macEnd) l.phase = MacOuter;
+                        break;
+                    case MacOuter:
+                        for (int k = 0; k < 8; k++) store32(job.tag + k * 4, l.h[k]);
+                        active--;
+                        assign(l);
+                        break;
+                }
+            }
+        }
+    }
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace Retchat {
+
+    // the version 1 frame crypto for one connection: the HMAC-SHA256 keystream XOR and the frame
+    // HMAC. the key's inner and outer pads are hashed once up front, so every HMAC after that
+    // starts from their chaining values instead of a fresh context and a full key schedule.
+    // nothing is allocated per frame and everything works in place or straight into the output. the bytes are the same as
+    // the one-shot DH::xorCrypt + HMAC path
+    class CryptoContext {
+    public:
+        // one frame for sealBatch: in is XORed with ctx's keystream for counter into out, then
+        // the HMAC of those len bytes of ciphertext goes into tag
+        struct SealJob {
+            const CryptoContext* ctx;
+            uint64_t counter;
+            const uint8_t* in;
+            uint8_t* out;
+            size_t len;
+            uint8_t* tag;  // 32 bytes
+        };
+
+        ~CryptoContext();
+
+        void init(const uint8_t key[32]);
+
+        // XOR data with the keystream for this frame counter, in place or from in to out
+        void xorCrypt(uint8_t* data, size_t len, uint64_t counter) const { xorCrypt(data, data, len, counter); }
+        void xorCrypt(const uint8_t* in, uint8_t* out, size_t len, uint64_t counter) const;
+        void deriveKeystream(uint8_t* keystream, size_t len, uint64_t counter) const;
+        // HMAC-SHA256 of data under the key
+        void mac(const uint8_t* data, size_t len, uint8_t out[32]) const;
+
+        // seals n independent frames, byte for byte what xorCrypt + mac give each of them. with
+        // AVX2 or AVX-512 the hashes of 8 or 16 frames run side by side in SIMD lanes. lanes
+        // forces a kernel (1, 8 or 16), 0 picks whatever suits this cpu and batch best
+        static void sealBatch(const SealJob* jobs, size_t n, unsigned int lanes = 0);
+        // the kernel sealBatch goes with by default. lanes only pay off where the single buffer
+        // code is slow (no SHA extensions), so each kernel the cpu has is timed on a few
+        // batches the first time this is called, and the fastest one sticks
+        static unsigned int preferredLanes();
+
+    private:
+        void hmac(const uint8_t* data, size_t len, uint8_t out[32]) const;
+        // XOR from offset off on, where ks is the keystream block for off
+        void xorFrom(const uint8_t* in, uint8_t* out, size_t len, size_t off, uint8_t ks[32]) const;
+        static void sealLanes(const SealJob* jobs, size_t n, unsigned int lanes);
+
+        // SHA-256 chaining values, where every HMAC and every lane kernel starts from
+        uint32_t innerState[8];  // after the key ^ ipad block
+        uint32_t outerState[8];  // after the key ^ opad block
+    };
+
+}
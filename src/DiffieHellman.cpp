@@ -1,4 +1,5 @@
 #include "DiffieHellman.hpp"
+#include "CryptoContext.hpp"
 #include "Logger.hpp"
 
 #include <algorithm>
@@ -6,9 +7,8 @@
 #include <cstdio>
 #include <cstdlib>
 
-#include <openssl/hmac.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
-#include <vector>
 
 
 static BIGNUM* dh_prime = nullptr;
@@ -62,40 +62,67 @@ void Retchat::DH::deriveEncKey(const BIGNUM* sharedSecret, uint8_t outKey[32]) {
     int len = BN_num_bytes(sharedSecret);
     uint8_t* buf = new uint8_t[len];
     BN_bn2bin(sharedSecret, buf);
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, buf, len);
-    SHA256_Final(outKey, &ctx);
+    EVP_Digest(buf, len, outKey, nullptr, EVP_sha256(), nullptr);
     delete[] buf;
 }
 
 void Retchat::DH::deriveKeystream(uint8_t* keystream, size_t len, const uint8_t* baseKey, uint64_t counter) {
-    uint8_t counterBytes[8];
-    for (int i = 0; i < 8; i++) counterBytes[i] = (counter >> (i * 8)) & 0xFF;
-    uint8_t digest[32];
-    unsigned int digestLen;
-    HMAC_CTX* hmac = HMAC_CTX_new();
-    HMAC_Init_ex(hmac, baseKey, 32, EVP_sha256(), nullptr);
-    HMAC_Update(hmac, counterBytes, 8);
-    HMAC_Final(hmac, digest, &digestLen);
-    HMAC_CTX_free(hmac);
-    size_t copied = 0;
-    while (copied < len) {
-        size_t chunk = std::min(len - copied, size_t(32));
-        memcpy(keystream + copied, digest, chunk);
-        copied += chunk;
-        if (copied < len) {
-            HMAC_CTX* hmac2 = HMAC_CTX_new();
-            HMAC_Init_ex(hmac2, baseKey, 32, EVP_sha256(), nullptr);
-            HMAC_Update(hmac2, digest, 32);
-            HMAC_Final(hmac2, digest, &digestLen);
-            HMAC_CTX_free(hmac2);
-        }
-    }
+    CryptoContext ctx;
+    ctx.init(baseKey);
+    ctx.deriveKeystream(keystream, len, counter);
+}
+
+static bool x25519Derive(EVP_PKEY* own, const uint8_t peerPub[32], uint8_t outKey[32]) {
+    EVP_PKEY* peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr, peerPub, 32);
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new(own, nullptr);
+    uint8_t shared[32];
+    size_t len = sizeof(shared);
+    // openssl refuses an all-zero result, so small-order peer keys fail here
+    bool ok = peer && ctx && EVP_PKEY_derive_init(ctx) > 0 && EVP_PKEY_derive_set_peer(ctx, peer) > 0 &&
+              EVP_PKEY_derive(ctx, shared, &len) > 0 && len == sizeof(shared);
+    if (ok) SHA256(shared, sizeof(shared), outKey);
+    OPENSSL_cleanse(shared, sizeof(shared));
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    return ok;
+}
+
+static EVP_PKEY* x25519Generate() {
+    EVP_PKEY* key = nullptr;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+    if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_keygen(ctx, &key) <= 0) key = nullptr;
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+bool Retchat::X25519::generateKeyPair(uint8_t priv[32], uint8_t pub[32]) {
+    EVP_PKEY* key = x25519Generate();
+    size_t privLen = 32, pubLen = 32;
+    bool ok = key && EVP_PKEY_get_raw_private_key(key, priv, &privLen) > 0 &&
+              EVP_PKEY_get_raw_public_key(key, pub, &pubLen) > 0;
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+bool Retchat::X25519::deriveEncKey(const uint8_t priv[32], const uint8_t peerPub[32], uint8_t outKey[32]) {
+    EVP_PKEY* own = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, nullptr, priv, 32);
+    bool ok = own && x25519Derive(own, peerPub, outKey);
+    EVP_PKEY_free(own);
+    return ok;
+}
+
+bool Retchat::X25519::exchange(const uint8_t peerPub[32], uint8_t ownPub[32], uint8_t outKey[32]) {
+    // keeps the generated key as is instead of round-tripping the private half through raw bytes
+    EVP_PKEY* own = x25519Generate();
+    size_t pubLen = 32;
+    bool ok = own && EVP_PKEY_get_raw_public_key(own, ownPub, &pubLen) > 0 && x25519Derive(own, peerPub, outKey);
+    EVP_PKEY_free(own);
+    return ok;
 }
 
 void Retchat::DH::xorCrypt(uint8_t* data, size_t len, const uint8_t* key, uint64_t counter) {
-    std::vector<uint8_t> keystream(len);
-    deriveKeystream(keystream.data(), len, key, counter);
-    for (size_t i = 0; i < len; i++) data[i] ^= keystream[i];
+    // for one-off callers, connections keep a CryptoContext keyed once instead
+    CryptoContext ctx;
+    ctx.init(key);
+    ctx.xorCrypt(data, len, counter);
 }
\ No newline at end of file
@@ -18,4 +18,14 @@ namespace Retchat {
         static void xorCrypt(uint8_t* data, size_t len, const uint8_t* key, uint64_t counter);
     };
 
+    // the version 2 key exchange, keys are raw 32-byte little-endian values.
+    // the derived key is SHA256 of the shared secret, same as with DH
+    class X25519 {
+    public:
+        static bool generateKeyPair(uint8_t priv[32], uint8_t pub[32]);
+        static bool deriveEncKey(const uint8_t priv[32], const uint8_t peerPub[32], uint8_t outKey[32]);
+        // server side in one go: a fresh ephemeral key, its public half and the derived key
+        static bool exchange(const uint8_t peerPub[32], uint8_t ownPub[32], uint8_t outKey[32]);
+    };
+
 }
\ No newline at end of file
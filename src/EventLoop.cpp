@@ -0,0 +1,470 @@
+#include "EventLoop.hpp"
+
+#include "Logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#ifdef RETCHAT_WITH_IO_URING
+#include <climits>
+#include <linux/io_uring.h>
+#endif
+
+
+constexpr int MAX_EVENTS = 256;
+
+#ifdef RETCHAT_WITH_IO_URING
+constexpr unsigned int RING_ENTRIES = 1024;
+constexpr unsigned int RING_BUF_COUNT = 512;  // power of two
+constexpr unsigned int RING_BUF_SIZE = 16 * 1024;
+
+// user_data layout: op(8) | generation(24) | fd or send op index(32)
+constexpr uint64_t OP_RECV = 1, OP_SEND = 2, OP_CANCEL = 3;
+
+static uint64_t encodeOp(uint64_t op, uint32_t gen, uint32_t arg) {
+    return (op << 56) | ((uint64_t) (gen & 0xFFFFFF) << 32) | arg;
+}
+#endif
+
+namespace Retchat {
+
+    EventLoop::EventLoop(int i) : id(i) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epfd < 0 || wakeFd < 0) {
+            Logger::error("event loop " + std::to_string(id) + ": " + strerror(errno));
+            exit(1);
+        }
+        struct epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;  // null marks the wakeup fd
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+#ifdef RETCHAT_WITH_IO_URING
+        ring.reset(new IoUring());
+        if (!ring->init(RING_ENTRIES, RING_BUF_COUNT, RING_BUF_SIZE)) {
+            Logger::warn("event loop " + std::to_string(id) + ": io_uring unavailable, falling back to epoll");
+            ring.reset();
+        } else {
+            // level-triggered, the ring is drained every iteration anyway
+            ev.events = EPOLLIN;
+            ev.data.ptr = ring.get();
+            epoll_ctl(epfd, EPOLL_CTL_ADD, ring->getFd(), &ev);
+        }
+#endif
+    }
+
+    EventLoop::~EventLoop() {
+        stop();
+        if (thread.joinable()) thread.join();
+        close(wakeFd);
+        close(epfd);
+    }
+
+    void EventLoop::start() {
+        running = true;
+        thread = std::thread(&EventLoop::run, this);
+    }
+
+    void EventLoop::stop() {
+        if (!running.exchange(false)) return;
+        wake();
+        if (thread.joinable() && !inLoopThread()) thread.join();
+    }
+
+    bool EventLoop::add(int fd, Handler* handler, uint32_t events) {
+        struct epoll_event ev{};
+        ev.events = events | EPOLLET;
+        ev.data.ptr = handler;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) return false;
+        handlers[fd] = handler;
+        handlerCount = handlers.size();
+        return true;
+    }
+
+    void EventLoop::remove(int fd) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        handlers.erase(fd);
+        handlerCount = handlers.size();
+    }
+
+    uint32_t EventLoop::addStream(int fd, Handler* handler) {
+        uint32_t gen = nextGen++ & 0xFFFFFF;
+        if (gen == 0) gen = nextGen++ & 0xFFFFFF;
+        Stream stream;
+        stream.handler = handler;
+        stream.gen = gen;
+#ifdef RETCHAT_WITH_IO_URING
+        if (ring) {
+            handlers[fd] = handler;
+            handlerCount = handlers.size();
+            streams[fd] = std::move(stream);
+            armRecv(fd, gen);
+            return gen;
+        }
+#endif
+        if (!add(fd, handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP)) return 0;
+        streams[fd] = std::move(stream);
+        return gen;
+    }
+
+    void EventLoop::removeStream(int fd) {
+        streams.erase(fd);
+#ifdef RETCHAT_WITH_IO_URING
+        if (ring) {
+            handlers.erase(fd);
+            handlerCount = handlers.size();
+            // cancels match on the fd number, so this has to reach the kernel before the fd is closed
+            ring->prepCancelFd(fd, encodeOp(OP_CANCEL, 0, 0));
+            ring->submit();
+            return;
+        }
+#endif
+        remove(fd);
+    }
+
+    EventLoop::Handler* EventLoop::findStream(int fd, uint32_t gen) const {
+        auto it = streams.find(fd);
+        return it != streams.end() && it->second.gen == gen ? it->second.handler : nullptr;
+    }
+
+    bool EventLoop::modify(int fd, Handler* handler, uint32_t events) {
+        struct epoll_event ev{};
+        ev.events = events | EPOLLET;
+        ev.data.ptr = handler;
+        return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+
+    void EventLoop::pauseReading(int fd) {
+        auto it = streams.find(fd);
+        if (it == streams.end() || it->second.paused) return;
+        it->second.paused = true;
+#ifdef RETCHAT_WITH_IO_URING
+        if (ring) {
+            // the recv ends with -ECANCELED and isn't armed again until reading resumes
+            if (it->second.recvArmed) ring->prepCancel(encodeOp(OP_RECV, it->second.gen, (uint32_t) fd), encodeOp(OP_CANCEL, 0, 0));
+            return;
+        }
+#endif
+        modify(fd, it->second.handler, EPOLLOUT | EPOLLRDHUP);
+    }
+
+    void EventLoop::resumeReading(int fd) {
+        auto it = streams.find(fd);
+        if (it == streams.end() || !it->second.paused) return;
+        it->second.paused = false;
+#ifdef RETCHAT_WITH_IO_URING
+        if (ring) {
+            if (!it->second.recvArmed) armRecv(fd, it->second.gen);
+            return;
+        }
+#endif
+        // bytes that arrived in the meantime are reported right away
+        modify(fd, it->second.handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+    }
+
+    void EventLoop::requestFlush(int fd, uint32_t gen) {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(flushMutex);
+            first = flushRequests.empty();
+            flushRequests.push_back(FlushRequest{ fd, gen });
+        }
+        // the loop runs flushes before it sleeps, only a sleeping loop needs waking
+        if (first && !inLoopThread()) wake();
+    }
+
+    void EventLoop::requestFlush(int fd, uint32_t gen, std::chrono::microseconds delay) {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(flushMutex);
+            auto due = std::chrono::steady_clock::now() + delay;
+            // nearly always appended, everyone asks for the same delay
+            auto pos = delayedFlushes.end();
+            while (pos != delayedFlushes.begin() && (pos - 1)->due > due) --pos;
+            first = pos == delayedFlushes.begin();
+            delayedFlushes.insert(pos, DelayedFlush{ due, FlushRequest{ fd, gen } });
+        }
+        // a sleeping loop has to pick a shorter timeout
+        if (first && !inLoopThread()) wake();
+    }
+
+    int EventLoop::msUntilDelayedFlush(std::chrono::steady_clock::time_point now) {
+        std::lock_guard<std::mutex> lock(flushMutex);
+        if (delayedFlushes.empty()) return -1;
+        auto left = std::chrono::duration_cast<std::chrono::microseconds>(delayedFlushes.front().due - now).count();
+        return left <= 0 ? 0 : (int) ((left + 999) / 1000);
+    }
+
+    void EventLoop::runFlushes(bool all) {
+        {
+            std::lock_guard<std::mutex> lock(flushMutex);
+            runningFlushes.swap(flushRequests);
+            if (!delayedFlushes.empty()) {
+                auto now = std::chrono::steady_clock::now();
+                size_t due = 0;
+                while (due < delayedFlushes.size() && (all || delayedFlushes[due].due <= now)) {
+                    runningFlushes.push_back(delayedFlushes[due++].req);
+                }
+                delayedFlushes.erase(delayedFlushes.begin(), delayedFlushes.begin() + due);
+            }
+        }
+        for (const auto& req : runningFlushes) {
+            auto it = streams.find(req.fd);
+            if (it == streams.end() || it->second.gen != req.gen) continue;  // connection is gone
+            it->second.handler->onEvent(EPOLLOUT);
+        }
+        runningFlushes.clear();
+    }
+
+    bool EventLoop::usesRing() const {
+#ifdef RETCHAT_WITH_IO_URING
+        return ring != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    void EventLoop::queueSend(int fd, uint32_t gen, SharedBuffer bytes) {
+#ifdef RETCHAT_WITH_IO_URING
+        auto it = streams.find(fd);
+        if (it == streams.end() || it->second.gen != gen) return;
+        if (it->second.queued.empty() && !it->second.sending) dirtyStreams.push_back(fd);
+        it->second.queued.push_back(std::move(bytes));
+#else
+        (void) fd; (void) gen; (void) bytes;
+#endif
+    }
+
+    bool EventLoop::sendPending(int fd) const {
+#ifdef RETCHAT_WITH_IO_URING
+        auto it = streams.find(fd);
+        return it != streams.end() && (it->second.sending || !it->second.queued.empty());
+#else
+        (void) fd;
+        return false;
+#endif
+    }
+
+    void EventLoop::wake() {
+        uint64_t one = 1;
+        (void) !write(wakeFd, &one, sizeof(one));
+    }
+
+    void EventLoop::post(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(taskMutex);
+            tasks.push_back(std::move(fn));
+        }
+        wake();
+    }
+
+    void EventLoop::runTasks() {
+        uint64_t drained;
+        while (read(wakeFd, &drained, sizeof(drained)) > 0) {}
+
+        std::vector<std::function<void()>> pending;
+        {
+            std::lock_guard<std::mutex> lock(taskMutex);
+            pending.swap(tasks);
+        }
+        for (auto& fn : pending) fn();
+    }
+
+    void EventLoop::run() {
+        if (pinnedCpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(pinnedCpu, &set);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+                Logger::warn("event loop " + std::to_string(id) + ": could not pin to cpu " + std::to_string(pinnedCpu));
+            }
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+
+        while (running) {
+            runFlushes();
+#ifdef RETCHAT_WITH_IO_URING
+            // everything queued during the last iteration goes out in one io_uring_enter
+            if (ring) {
+                submitSends();
+                ring->submit();
+            }
+#endif
+
+            // no periodic wakeups: sleep until there's I/O, a task, a timer or a delayed flush due
+            auto now = std::chrono::steady_clock::now();
+            int timeout = timers.msUntilNext(now);
+            int flushIn = msUntilDelayedFlush(now);
+            if (flushIn >= 0 && (timeout < 0 || flushIn < timeout)) timeout = flushIn;
+            int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                Logger::error("epoll_wait: " + std::string(strerror(errno)));
+                break;
+            }
+            for (int i = 0; i < n; i++) {
+                void* ptr = events[i].data.ptr;
+#ifdef RETCHAT_WITH_IO_URING
+                if (ring && ptr == ring.get()) continue;
+#endif
+                if (ptr) static_cast<Handler*>(ptr)->onEvent(events[i].events);
+            }
+#ifdef RETCHAT_WITH_IO_URING
+            if (ring) reapRing();
+#endif
+            runTasks();
+            timers.advance(std::chrono::steady_clock::now());
+        }
+        runTasks();
+        runFlushes(true);
+#ifdef RETCHAT_WITH_IO_URING
+        if (ring) {
+            submitSends();
+            ring->submit();
+        }
+#endif
+    }
+
+#ifdef RETCHAT_WITH_IO_URING
+
+    void EventLoop::armRecv(int fd, uint32_t gen) {
+        ring->prepRecvMultishot(fd, encodeOp(OP_RECV, gen, (uint32_t) fd));
+        streams[fd].recvArmed = true;
+    }
+
+    void EventLoop::reapRing() {
+        ring->reap([this](const IoUring::Completion& c) {
+            uint64_t op = c.userData >> 56;
+            uint32_t gen = (uint32_t) (c.userData >> 32) & 0xFFFFFF;
+            uint32_t arg = (uint32_t) c.userData;
+            if (op == OP_RECV) onRecvCompletion((int) arg, gen, c);
+            else if (op == OP_SEND) onSendCompletion(arg, c);
+        });
+    }
+
+    void EventLoop::onRecvCompletion(int fd, uint32_t gen, const IoUring::Completion& c) {
+        auto it = streams.find(fd);
+        Handler* h = (it != streams.end() && it->second.gen == gen) ? it->second.handler : nullptr;
+
+        if (c.res > 0 && IoUring::hasBuffer(c.flags)) {
+            uint16_t bid = IoUring::bufferId(c.flags);
+            if (h) h->onData(ring->buffer(bid), (size_t) c.res);
+            ring->recycleBuffer(bid);
+        } else if (c.res == 0) {
+            if (h) h->onEvent(EPOLLRDHUP | EPOLLHUP);
+            return;
+        } else if (c.res != -ENOBUFS && c.res != -ECANCELED) {
+            if (h) h->onEvent(EPOLLERR);
+            return;
+        }
+        if (IoUring::hasMore(c.flags)) return;
+
+        // multishot ended (ran out of buffers, or the kernel just stopped): re-arm while still
+        // alive, unless reading was paused
+        it = streams.find(fd);
+        if (it == streams.end() || it->second.gen != gen) return;
+        it->second.recvArmed = false;
+        if (!it->second.paused) armRecv(fd, gen);
+    }
+
+    void EventLoop::submitSends() {
+        std::vector<int> dirty;
+        dirty.swap(dirtyStreams);
+        for (int fd : dirty) {
+            auto it = streams.find(fd);
+            if (it == streams.end()) continue;
+            if (!it->second.sending && !it->second.queued.empty()) startSend(fd, it->second);
+        }
+    }
+
+    void EventLoop::startSend(int fd, Stream& stream) {
+        size_t idx;
+        if (!freeSendOps.empty()) {
+            idx = freeSendOps.back();
+            freeSendOps.pop_back();
+        } else {
+            idx = sendOps.size();
+            sendOps.emplace_back(new SendOp());
+        }
+        SendOp& op = *sendOps[idx];
+        op.fd = fd;
+        op.gen = stream.gen;
+        op.iovOff = 0;
+
+        // everything queued for this stream goes out as one sendmsg
+        size_t take = std::min(stream.queued.size(), (size_t) IOV_MAX);
+        op.chunks.assign(std::make_move_iterator(stream.queued.begin()),
+                         std::make_move_iterator(stream.queued.begin() + take));
+        stream.queued.erase(stream.queued.begin(), stream.queued.begin() + take);
+        op.iov.clear();
+        for (auto& chunk : op.chunks) op.iov.push_back(iovec{ const_cast<uint8_t*>(chunk->data()), chunk->size() });
+
+        stream.sending = true;
+        submitSendOp(idx);
+    }
+
+    void EventLoop::submitSendOp(size_t idx, bool pollFirst) {
+        SendOp& op = *sendOps[idx];
+        memset(&op.msg, 0, sizeof(op.msg));
+        op.msg.msg_iov = op.iov.data() + op.iovOff;
+        op.msg.msg_iovlen = op.iov.size() - op.iovOff;
+        ring->prepSendmsg(op.fd, &op.msg, encodeOp(OP_SEND, op.gen, (uint32_t) idx), pollFirst);
+    }
+
+    void EventLoop::onSendCompletion(size_t idx, const IoUring::Completion& c) {
+        SendOp& op = *sendOps[idx];
+        auto it = streams.find(op.fd);
+        bool live = it != streams.end() && it->second.gen == op.gen;
+
+        if (live && c.res > 0) {
+            size_t n = (size_t) c.res;
+            while (n > 0 && op.iovOff < op.iov.size()) {
+                iovec& v = op.iov[op.iovOff];
+                if (n >= v.iov_len) {
+                    n -= v.iov_len;
+                    op.iovOff++;
+                } else {
+                    v.iov_base = static_cast<uint8_t*>(v.iov_base) + n;
+                    v.iov_len -= n;
+                    n = 0;
+                }
+            }
+            if (op.iovOff < op.iov.size()) {
+                submitSendOp(idx);  // short send, keep going with the rest
+                return;
+            }
+        } else if (live && c.res == -EAGAIN) {
+            submitSendOp(idx, true);
+            return;
+        }
+
+        op.chunks.clear();
+        op.iov.clear();
+        freeSendOps.push_back(idx);
+        if (!live) return;
+
+        Stream& stream = it->second;
+        stream.sending = false;
+        if (c.res < 0) {
+            // the socket is dead, recv will report it and the handler will clean up
+            stream.queued.clear();
+        } else if (!stream.queued.empty()) {
+            startSend(op.fd, stream);
+        } else {
+            stream.handler->onEvent(EPOLLOUT);  // all out, the handler may have more for us
+        }
+    }
+
+#endif
+
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "SharedBuffer.hpp"
+#include "TimerWheel.hpp"
+
+#ifdef RETCHAT_WITH_IO_URING
+#include "IoUring.hpp"
+#include <sys/uio.h>
+#endif
+
+
+namespace Retchat {
+
+    // one epoll instance driven by one thread. every socket registered here is
+    // only ever read from this thread, so handlers don't need to lock their read state.
+    // when built with RETCHAT_WITH_IO_URING, stream sockets do their I/O through an
+    // io_uring instead and epoll only watches listeners, the wakeup fd and the ring itself.
+    class EventLoop {
+    public:
+        class Handler {
+        public:
+            virtual ~Handler() = default;
+            virtual void onEvent(uint32_t events) = 0;
+            virtual void onData(const uint8_t*, size_t) {}
+        };
+
+        explicit EventLoop(int id);
+        ~EventLoop();
+
+        void start();
+        void stop();
+        void pinToCpu(int cpu) { pinnedCpu = cpu; }
+
+        // edge-triggered registration, must be called from the loop thread
+        bool add(int fd, Handler* handler, uint32_t events);
+        void remove(int fd);
+
+        // connected sockets. returns a generation that has to accompany requestFlush and
+        // queueSend, so nothing meant for a closed connection reaches a new one that reused its fd.
+        // must be called from the loop thread
+        uint32_t addStream(int fd, Handler* handler);
+        void removeStream(int fd);
+        // the stream's handler, or null once it's gone or its fd was reused. loop thread only
+        Handler* findStream(int fd, uint32_t gen) const;
+        // stop reading the stream until resumeReading, so whatever the peer sends waits in the
+        // kernel and tcp flow control pushes back on it. must be called from the loop thread
+        void pauseReading(int fd);
+        void resumeReading(int fd);
+
+        // have the stream's handler called with EPOLLOUT on the loop thread, once per iteration
+        // no matter how often it was requested. safe to call from anywhere
+        void requestFlush(int fd, uint32_t gen);
+        // the same, but not before delay has passed, so more can be queued up in the meantime.
+        // the loop wakes up for it on time, no matter how coarse its timers are
+        void requestFlush(int fd, uint32_t gen, std::chrono::microseconds delay);
+
+        // ring mode only: hand bytes to the loop, which batches every pending send into one
+        // submission per iteration and calls the handler with EPOLLOUT once they're all out.
+        // must be called from the loop thread
+        bool usesRing() const;
+        void queueSend(int fd, uint32_t gen, SharedBuffer bytes);
+        // whether bytes handed over with queueSend are still waiting on the kernel
+        bool sendPending(int fd) const;
+
+        // timers fire on the loop thread, which sleeps until the next one is due.
+        // must be called from the loop thread
+        void schedule(Timer& timer, std::chrono::milliseconds delay) { timers.schedule(timer, delay); }
+        void cancel(Timer& timer) { timers.cancel(timer); }
+
+        // run fn on the loop thread; safe to call from anywhere
+        void post(std::function<void()> fn);
+        bool inLoopThread() const { return std::this_thread::get_id() == thread.get_id(); }
+
+        int getId() const { return id; }
+        size_t getHandlerCount() const { return handlerCount.load(std::memory_order_relaxed); }
+
+    private:
+        void run();
+        void runTasks();
+        bool modify(int fd, Handler* handler, uint32_t events);
+        void wake();
+        // all also runs the delayed ones that aren't due yet
+        void runFlushes(bool all = false);
+        int msUntilDelayedFlush(std::chrono::steady_clock::time_point now);
+
+        int id;
+        int pinnedCpu = -1;
+        int epfd = -1;
+        int wakeFd = -1;
+        std::thread thread;
+        std::atomic<bool> running{false};
+
+        std::unordered_map<int, Handler*> handlers;
+        std::atomic<size_t> handlerCount{0};
+
+        std::mutex taskMutex;
+        std::vector<std::function<void()>> tasks;
+
+        TimerWheel timers;
+
+        struct Stream {
+            Handler* handler;
+            uint32_t gen;
+            bool paused = false;
+#ifdef RETCHAT_WITH_IO_URING
+            bool recvArmed = false;  // a multishot recv is in the kernel, or its cancel is
+            bool sending = false;
+            std::vector<SharedBuffer> queued;
+#endif
+        };
+        std::unordered_map<int, Stream> streams;
+        uint32_t nextGen = 1;
+
+        struct FlushRequest {
+            int fd;
+            uint32_t gen;
+        };
+        std::mutex flushMutex;
+        std::vector<FlushRequest> flushRequests;
+        std::vector<FlushRequest> runningFlushes;  // loop thread only, swapped with flushRequests
+        struct DelayedFlush {
+            std::chrono::steady_clock::time_point due;
+            FlushRequest req;
+        };
+        std::vector<DelayedFlush> delayedFlushes;  // soonest first, under flushMutex
+
+#ifdef RETCHAT_WITH_IO_URING
+        // one sendmsg in flight per stream; owns its bytes until the kernel is done with them
+        struct SendOp {
+            int fd;
+            uint32_t gen;
+            std::vector<SharedBuffer> chunks;
+            std::vector<iovec> iov;
+            size_t iovOff = 0;
+            msghdr msg;
+        };
+        void armRecv(int fd, uint32_t gen);
+        void reapRing();
+        void onRecvCompletion(int fd, uint32_t gen, const IoUring::Completion& c);
+        void onSendCompletion(size_t idx, const IoUring::Completion& c);
+        void submitSends();
+        void startSend(int fd, Stream& stream);
+        void submitSendOp(size_t idx, bool pollFirst = false);
+
+        std::unique_ptr<IoUring> ring;
+        std::vector<int> dirtyStreams;
+        std::vector<std::unique_ptr<SendOp>> sendOps;
+        std::vector<size_t> freeSendOps;
+#endif
+    };
+
+}
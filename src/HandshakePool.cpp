@@ -0,0 +1,119 @@
+#include "HandshakePool.hpp"
+
+#include "DiffieHellman.hpp"
+#include "Logger.hpp"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+// handshake workers yield to the event loops when cpu is scarce, so a reconnect storm
+// slows down handshakes instead of chat traffic
+constexpr int WORKER_NICE = 5;
+
+namespace Retchat {
+
+    HandshakePool::HandshakePool(unsigned int n, size_t size, size_t pending)
+        : threadCount(n ? n : 1), poolSize(size), maxPending(pending) {}
+
+    HandshakePool::~HandshakePool() {
+        stop();
+    }
+
+    void HandshakePool::start() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = true;
+            keyPairs.reserve(poolSize);
+        }
+        for (unsigned int i = 0; i < threadCount; i++) threads.emplace_back(&HandshakePool::run, this);
+    }
+
+    void HandshakePool::stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running) return;
+            running = false;
+        }
+        cv.notify_all();
+        for (auto& t : threads) t.join();
+        threads.clear();
+        jobs.clear();
+    }
+
+    bool HandshakePool::takeKeyPair(KeyPair& out) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (keyPairs.empty()) return false;
+            out = std::move(keyPairs.back());
+            keyPairs.pop_back();
+        }
+        cv.notify_one();  // somebody can start refilling
+        return true;
+    }
+
+    void HandshakePool::returnKeyPair(KeyPair&& kp) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (running && keyPairs.size() < poolSize) keyPairs.push_back(std::move(kp));
+    }
+
+    bool HandshakePool::submit(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running || jobs.size() >= maxPending) return false;
+            jobs.push_back(std::move(fn));
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    HandshakePool::KeyPair HandshakePool::generateKeyPair() {
+        KeyPair kp;
+        kp.priv.reset(BN_new());
+        BIGNUM* pub = BN_new();
+        DH::generatePrivateKey(kp.priv.get());
+        DH::computePublicKey(kp.priv.get(), pub);
+        kp.pub.resize(BN_num_bytes(pub));
+        BN_bn2bin(pub, kp.pub.data());
+        BN_free(pub);
+        return kp;
+    }
+
+    size_t HandshakePool::getPendingCount() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.size();
+    }
+
+    size_t HandshakePool::getKeyPairCount() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return keyPairs.size();
+    }
+
+    void HandshakePool::run() {
+        if (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), WORKER_NICE) != 0) {
+            Logger::warn("handshake worker: could not lower priority");
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+            if (!jobs.empty()) {
+                std::function<void()> job = std::move(jobs.front());
+                jobs.pop_front();
+                lock.unlock();
+                job();
+                lock.lock();
+                continue;
+            }
+            if (keyPairs.size() < poolSize) {
+                lock.unlock();
+                KeyPair kp = generateKeyPair();
+                lock.lock();
+                if (keyPairs.size() < poolSize) keyPairs.push_back(std::move(kp));
+                continue;
+            }
+            cv.wait(lock);
+        }
+    }
+
+}
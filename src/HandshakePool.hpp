@@ -0,0 +1,67 @@
+#pragma once
+
+#include <openssl/bn.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace Retchat {
+
+    // the expensive half of every handshake, kept off the event loops. workers run queued
+    // jobs (shared secrets, or key pairs when the pool ran dry) first, and spend idle time
+    // refilling a pool of precomputed server key pairs, so a new connection normally gets
+    // its server key without any modexp at all
+    class HandshakePool {
+    public:
+        struct BignumFree {
+            void operator()(BIGNUM* bn) const { BN_clear_free(bn); }
+        };
+        using BignumPtr = std::unique_ptr<BIGNUM, BignumFree>;
+
+        struct KeyPair {
+            BignumPtr priv;
+            std::vector<uint8_t> pub;  // big-endian, as it goes on the wire
+        };
+
+        HandshakePool(unsigned int threads, size_t poolSize, size_t maxPending);
+        ~HandshakePool();
+
+        void start();
+        void stop();
+
+        // a precomputed key pair, false when the pool has run dry
+        bool takeKeyPair(KeyPair& out);
+        // hand back a key pair whose private half never took part in an exchange
+        void returnKeyPair(KeyPair&& kp);
+        // run fn on a worker. false when the backlog is full, and the handshake should be refused
+        bool submit(std::function<void()> fn);
+
+        static KeyPair generateKeyPair();
+
+        unsigned int getThreadCount() const { return threadCount; }
+        size_t getPendingCount() const;
+        size_t getKeyPairCount() const;
+
+    private:
+        void run();
+
+        unsigned int threadCount;
+        size_t poolSize;
+        size_t maxPending;
+        std::vector<std::thread> threads;
+        bool running = false;
+
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::function<void()>> jobs;
+        std::vector<KeyPair> keyPairs;
+    };
+
+}
@@ -0,0 +1,373 @@
+#include "ImageCache.hpp"
+
+#include "Logger.hpp"
+#include "Protocol.hpp"
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+
+constexpr size_t BLOB_HEADER_SIZE = 1 + 32;  // type + hash
+
+
+namespace Retchat {
+
+    static ImageHash hashOf(const uint8_t* data, size_t len) {
+        ImageHash hash;
+        EVP_Digest(data, len, hash.data(), nullptr, EVP_sha256(), nullptr);
+        return hash;
+    }
+
+    static std::string toHex(const ImageHash& hash) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (uint8_t b : hash) {
+            hex += digits[b >> 4];
+            hex += digits[b & 15];
+        }
+        return hex;
+    }
+
+    static bool fromHex(const std::string& hex, ImageHash& hash) {
+        if (hex.size() != 64) return false;
+        for (size_t i = 0; i < 32; i++) {
+            unsigned int b;
+            if (sscanf(hex.c_str() + i * 2, "%2x", &b) != 1) return false;
+            hash[i] = (uint8_t) b;
+        }
+        return toHex(hash) == hex;
+    }
+
+    static SharedBuffer makeBlob(const ImageHash& hash, const uint8_t* data, size_t len) {
+        // lives as long as the image stays cached, so it's sized exactly instead of pooled
+        auto blob = std::make_shared<std::vector<uint8_t>>();
+        blob->reserve(BLOB_HEADER_SIZE + len);
+        blob->push_back(PKT_IMAGE_BLOB);
+        blob->insert(blob->end(), hash.begin(), hash.end());
+        blob->insert(blob->end(), data, data + len);
+        return blob;
+    }
+
+    ImageCache::ImageCache(size_t memory, const std::string& dir, size_t spill, MemoryGovernor* gov)
+        : memoryLimit(memory), spillDir(dir), spillLimit(spill), governor(gov)
+    {
+        if (spillDir.empty()) return;
+        if (mkdir(spillDir.c_str(), 0700) != 0 && errno != EEXIST) {
+            Logger::warn("could not create image spill directory " + spillDir + ", keeping images in memory only");
+            spillDir.clear();
+            return;
+        }
+        loadSpilled();
+        diskThread = std::thread(&ImageCache::runDisk, this);
+    }
+
+    ImageCache::~ImageCache() {
+        {
+            std::lock_guard<std::mutex> lock(diskMutex);
+            diskStopping = true;
+        }
+        diskCv.notify_all();
+        if (diskThread.joinable()) diskThread.join();
+    }
+
+    void ImageCache::loadSpilled() {
+        DIR* dir = opendir(spillDir.c_str());
+        if (!dir) return;
+        struct Found {
+            ImageHash hash;
+            size_t size;
+            time_t mtime;
+        };
+        std::vector<Found> found;
+        while (dirent* e = readdir(dir)) {
+            Found f;
+            struct stat st;
+            if (!fromHex(e->d_name, f.hash) || stat(pathOf(f.hash).c_str(), &st) != 0) continue;
+            f.size = st.st_size;
+            f.mtime = st.st_mtime;
+            found.push_back(f);
+        }
+        closedir(dir);
+
+        // newest first, which is the order they'd have been used in
+        std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) { return a.mtime > b.mtime; });
+        for (const Found& f : found) {
+            spilled.push_back(Entry{ f.hash, f.size, nullptr });
+            onDisk[f.hash] = std::prev(spilled.end());
+            spilledBytes += f.size;
+        }
+        while (spilledBytes > spillLimit && !spilled.empty()) dropFile(std::prev(spilled.end()));
+        queueDiskWork(takeDiskWork());
+        if (!spilled.empty()) {
+            Logger::info("image cache: " + std::to_string(spilled.size()) + " spilled images (" +
+                         std::to_string(spilledBytes / 1024) + "KB) in " + spillDir);
+        }
+    }
+
+    std::string ImageCache::pathOf(const ImageHash& hash) const {
+        return spillDir + "/" + toHex(hash);
+    }
+
+    ImageHash ImageCache::put(const uint8_t* data, size_t len) {
+        ImageHash hash = hashOf(data, len);
+        DiskWork work;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t before = held();
+            auto it = inMemory.find(hash);
+            if (it != inMemory.end()) {
+                memory.splice(memory.begin(), memory, it->second);
+                reposts++;
+                return hash;
+            }
+            // it was spilled, but here it is anyway
+            auto disk = onDisk.find(hash);
+            if (disk != onDisk.end()) {
+                dropFile(disk->second);
+                reposts++;
+            } else {
+                stored++;
+            }
+            insert(hash, makeBlob(hash, data, len), len);
+            track(before);
+            work = takeDiskWork();
+        }
+        queueDiskWork(std::move(work));
+        return hash;
+    }
+
+    ImageCache::Lookup ImageCache::get(const ImageHash& hash, SharedBuffer& blob, std::function<void(SharedBuffer)> done) {
+        std::unique_lock<std::mutex> lock(mutex);
+        fetches++;
+        auto it = inMemory.find(hash);
+        if (it != inMemory.end()) {
+            memory.splice(memory.begin(), memory, it->second);
+            fetchedBytes += it->second->size;
+            blob = it->second->blob;
+            return Lookup::Found;
+        }
+        auto disk = onDisk.find(hash);
+        if (disk == onDisk.end()) {
+            fetchMisses++;
+            return Lookup::Gone;
+        }
+        size_t size = disk->second->size;
+        if (!disk->second->blob) {
+            queueDisk([this, hash, size, done]() { readFile(hash, size, done); });
+            return Lookup::Reading;
+        }
+        // its file isn't written yet, so it's still right here
+        size_t before = held();
+        blob = disk->second->blob;
+        dropFile(disk->second);
+        insert(hash, blob, size);
+        track(before);
+        fetchedBytes += size;
+        DiskWork work = takeDiskWork();
+        lock.unlock();
+        queueDiskWork(std::move(work));
+        return Lookup::Found;
+    }
+
+    void ImageCache::countRefs(size_t n, size_t imageSize) {
+        if (!n) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        refs += n;
+        refBytes += n * imageSize;
+    }
+
+    void ImageCache::insert(const ImageHash& hash, SharedBuffer blob, size_t size) {
+        memory.push_front(Entry{ hash, size, std::move(blob) });
+        inMemory[hash] = memory.begin();
+        memoryBytes += size;
+        evict(memoryLimit);
+        if (governor && governor->getLevel() != MemoryGovernor::Level::Normal) evict(size);
+    }
+
+    void ImageCache::track(size_t before) {
+        if (governor) governor->track(MemoryGovernor::Pool::Images, before, held());
+    }
+
+    void ImageCache::shrink() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (memory.empty()) return;
+        size_t before = held();
+        evict(0);
+        track(before);
+        DiskWork work = takeDiskWork();
+        lock.unlock();
+        queueDiskWork(std::move(work));
+    }
+
+    void ImageCache::evict(size_t limit) {
+        while (memoryBytes > limit && !memory.empty()) {
+            Entry& e = memory.back();
+            memoryBytes -= e.size;
+            inMemory.erase(e.hash);
+            if (!spillDir.empty() && e.size <= spillLimit) {
+                // findable as spilled right away, served from memory until the disk thread wrote it
+                spilled.push_front(Entry{ e.hash, e.size, e.blob });
+                onDisk[e.hash] = spilled.begin();
+                spilledBytes += e.size;
+                writingBytes += e.size;
+                pending.writes.emplace_back(e.hash, e.blob);
+            }
+            memory.pop_back();
+        }
+        while (spilledBytes > spillLimit && !spilled.empty()) dropFile(std::prev(spilled.end()));
+    }
+
+    void ImageCache::dropFile(std::list<Entry>::iterator it) {
+        if (it->blob) writingBytes -= it->size;
+        ImageHash hash = it->hash;
+        spilledBytes -= it->size;
+        onDisk.erase(hash);
+        spilled.erase(it);
+        pending.unlinks.push_back(hash);
+    }
+
+    ImageCache::DiskWork ImageCache::takeDiskWork() {
+        DiskWork work;
+        std::swap(work, pending);
+        return work;
+    }
+
+    void ImageCache::queueDiskWork(DiskWork work) {
+        if (work.writes.empty() && work.unlinks.empty()) return;
+        queueDisk([this, work = std::move(work)]() mutable {
+            for (const auto& w : work.writes) writeFile(w.first, w.second);
+            // a file spilled again since is left alone, its new write is either done or queued
+            // behind this one
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto& hashes = work.unlinks;
+                hashes.erase(std::remove_if(hashes.begin(), hashes.end(),
+                                            [this](const ImageHash& h) { return onDisk.count(h) > 0; }),
+                             hashes.end());
+            }
+            for (const ImageHash& hash : work.unlinks) unlink(pathOf(hash).c_str());
+        });
+    }
+
+    void ImageCache::queueDisk(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(diskMutex);
+            diskJobs.push_back(std::move(job));
+        }
+        diskCv.notify_one();
+    }
+
+    void ImageCache::runDisk() {
+        // whatever is queued still runs on the way out, so no spill is left half done
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(diskMutex);
+                diskCv.wait(lock, [this]() { return diskStopping || !diskJobs.empty(); });
+                if (diskJobs.empty()) return;
+                job = std::move(diskJobs.front());
+                diskJobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    void ImageCache::writeFile(const ImageHash& hash, const SharedBuffer& blob) {
+        std::string path = pathOf(hash);
+        std::ofstream f(path, std::ios::binary | std::ios::trunc);
+        bool ok = f.write(reinterpret_cast<const char*>(blob->data() + BLOB_HEADER_SIZE), blob->size() - BLOB_HEADER_SIZE) &&
+                  f.flush();
+        f.close();
+        if (!ok) {
+            Logger::warn("image cache: could not spill to " + path);
+            unlink(path.c_str());
+        }
+
+        bool stale;
+        DiskWork work;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = onDisk.find(hash);
+            // taken back or dropped meanwhile, maybe before this was even queued, so the file
+            // is this write's to take away again. spilled again instead, a write of its own is
+            // done or queued behind this one
+            stale = it == onDisk.end();
+            if (!stale && it->second->blob == blob) {
+                size_t before = held();
+                if (ok) {
+                    writingBytes -= it->second->size;
+                    it->second->blob = nullptr;
+                } else {
+                    dropFile(it->second);
+                }
+                track(before);
+                work = takeDiskWork();
+            }
+        }
+        if (stale && ok) unlink(path.c_str());
+        queueDiskWork(std::move(work));
+    }
+
+    void ImageCache::readFile(const ImageHash& hash, size_t size, const std::function<void(SharedBuffer)>& done) {
+        SharedBuffer blob;
+        {
+            // another fetch may have read it in already
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = inMemory.find(hash);
+            if (it != inMemory.end()) blob = it->second->blob;
+        }
+        if (blob) {
+            done(blob);
+            return;
+        }
+
+        // back into memory, as long as the file still holds what its name says
+        std::string path = pathOf(hash);
+        std::vector<uint8_t> data(size);
+        std::ifstream f(path, std::ios::binary);
+        bool ok = f.read(reinterpret_cast<char*>(data.data()), size) && f.peek() == EOF && hashOf(data.data(), size) == hash;
+        DiskWork work;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t before = held();
+            auto disk = onDisk.find(hash);
+            if (disk != onDisk.end() && (ok || !disk->second->blob)) dropFile(disk->second);
+            auto it = inMemory.find(hash);
+            if (it != inMemory.end()) {
+                // reposted while the file was being read
+                blob = it->second->blob;
+            } else if (ok) {
+                diskReads++;
+                fetchedBytes += size;
+                blob = makeBlob(hash, data.data(), size);
+                insert(hash, blob, size);
+            } else {
+                Logger::warn("image cache: dropping unreadable or damaged " + path);
+                fetchMisses++;
+            }
+            track(before);
+            work = takeDiskWork();
+        }
+        queueDiskWork(std::move(work));
+        done(blob);
+    }
+
+    std::string ImageCache::getSummary() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t saved = refBytes > fetchedBytes ? refBytes - fetchedBytes : 0;
+        return "images: " + std::to_string(memory.size()) + " in memory (" + std::to_string(memoryBytes / 1024) + "KB), " +
+               std::to_string(spilled.size()) + " spilled (" + std::to_string(spilledBytes / 1024) + "KB) | " +
+               std::to_string(stored) + " stored, " + std::to_string(reposts) + " reposted | " + std::to_string(refs) +
+               " refs sent, " + std::to_string(fetches) + " fetched (" + std::to_string(fetchMisses) + " gone, " +
+               std::to_string(diskReads) + " from disk) | " + std::to_string(saved / 1024) + "KB not sent";
+    }
+
+}
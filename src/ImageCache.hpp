@@ -0,0 +1,126 @@
+#pragma once
+
+#include "MemoryGovernor.hpp"
+#include "SharedBuffer.hpp"
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace Retchat {
+
+    using ImageHash = std::array<uint8_t, 32>;  // sha-256 of the image bytes
+
+    // images clients sent, by content, so recipients that take image refs can be sent the
+    // hash and fetch the bytes only if they don't have them yet. the most recently used ones
+    // stay in memory, ready to send as a PKT_IMAGE_BLOB. the ones pushed out of memory are
+    // spilled into files named after their hash, and the oldest files are deleted once those
+    // go over their own budget. images are few and big, so one mutex covers all of it. the
+    // files are only ever touched by the cache's own disk thread, in the order the operations
+    // were queued, so a slow disk never holds up an event loop or the mutex
+    class ImageCache {
+    public:
+        enum class Lookup { Found, Reading, Gone };
+
+        // an empty spillDir keeps memory only. files spilled by an earlier run are picked up again.
+        // what stays in memory is reported to the governor, if there is one
+        ImageCache(size_t memoryBytes, const std::string& spillDir, size_t spillBytes, MemoryGovernor* governor = nullptr);
+        ~ImageCache();
+
+        // hashes the image and keeps it if it's new
+        ImageHash put(const uint8_t* data, size_t len);
+        // Found: blob is the image as a ready PKT_IMAGE_BLOB. Reading: it was spilled and is being
+        // read back in, done gets it on the disk thread (null if the file turned out unreadable).
+        // Gone: it's in neither place
+        Lookup get(const ImageHash& hash, SharedBuffer& blob, std::function<void(SharedBuffer)> done);
+        // refs that went out in place of an image of that size
+        void countRefs(size_t refs, size_t imageSize);
+        // memory is short: every image goes to disk, or away without a spill directory. while the
+        // governor is past its soft watermark, a new image stays in memory alone, for the first fetches
+        void shrink();
+
+        std::string getSummary() const;
+
+    private:
+        struct HashKey {
+            size_t operator()(const ImageHash& h) const {
+                size_t v;
+                memcpy(&v, h.data(), sizeof(v));
+                return v;
+            }
+        };
+        struct Entry {
+            ImageHash hash;
+            size_t size;
+            SharedBuffer blob;  // in memory, or spilled with its file not written yet
+        };
+        using Index = std::unordered_map<ImageHash, std::list<Entry>::iterator, HashKey>;
+        // what the disk thread has to do after an operation, collected under the mutex and
+        // queued as one job once it's let go
+        struct DiskWork {
+            std::vector<std::pair<ImageHash, SharedBuffer>> writes;
+            std::vector<ImageHash> unlinks;  // after the writes
+        };
+
+        // mutex held
+        void insert(const ImageHash& hash, SharedBuffer blob, size_t size);
+        void evict(size_t limit);
+        void dropFile(std::list<Entry>::iterator it);
+        DiskWork takeDiskWork();
+        void track(size_t before);
+        size_t held() const { return memoryBytes + writingBytes; }
+
+        std::string pathOf(const ImageHash& hash) const;
+        void loadSpilled();
+
+        // disk thread
+        void queueDisk(std::function<void()> job);
+        // mutex not held
+        void queueDiskWork(DiskWork work);
+        void runDisk();
+        void writeFile(const ImageHash& hash, const SharedBuffer& blob);
+        void readFile(const ImageHash& hash, size_t size, const std::function<void(SharedBuffer)>& done);
+
+        size_t memoryLimit;
+        std::string spillDir;
+        size_t spillLimit;
+        MemoryGovernor* governor;
+
+        mutable std::mutex mutex;
+        std::list<Entry> memory;  // most recently used first
+        std::list<Entry> spilled;
+        Index inMemory, onDisk;
+        size_t memoryBytes = 0;
+        size_t spilledBytes = 0;
+        size_t writingBytes = 0;  // spilled, but still in memory until the disk thread wrote them
+        DiskWork pending;
+
+        std::thread diskThread;
+        std::mutex diskMutex;
+        std::condition_variable diskCv;
+        std::deque<std::function<void()>> diskJobs;
+        bool diskStopping = false;
+
+        uint64_t stored = 0;      // new images
+        uint64_t reposts = 0;     // images it already had
+        uint64_t fetches = 0;
+        uint64_t fetchMisses = 0;
+        uint64_t diskReads = 0;
+        uint64_t refs = 0;
+        uint64_t refBytes = 0;    // image bytes the refs stood for
+        uint64_t fetchedBytes = 0;
+    };
+
+}
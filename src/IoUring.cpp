@@ -0,0 +1,212 @@
+#include "IoUring.hpp"
+
+#include "Logger.hpp"
+
+#include <linux/io_uring.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+constexpr uint16_t BUF_GROUP_ID = 0;
+
+static int sysSetup(unsigned int entries, io_uring_params* p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sysEnter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static int sysRegister(int fd, unsigned int opcode, void* arg, unsigned int nrArgs) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+namespace Retchat {
+
+    IoUring::~IoUring() {
+        if (bufRing) munmap(bufRing, bufRingSize);
+        if (sqes) munmap(sqes, sqesSize);
+        if (cqRing && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing) munmap(sqRing, sqRingSize);
+        if (ringFd >= 0) close(ringFd);
+    }
+
+    bool IoUring::init(unsigned int entries, unsigned int count, unsigned int size) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        // multishot recv can post many cqes per sqe, so give the cq some headroom
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 8;
+        ringFd = sysSetup(entries, &p);
+        if (ringFd < 0) {
+            Logger::warn("io_uring_setup: " + std::string(strerror(errno)));
+            return false;
+        }
+
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) { sqRing = nullptr; return false; }
+        if (singleMmap) {
+            cqRing = sqRing;
+        } else {
+            cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) { cqRing = nullptr; return false; }
+        }
+        sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        void* sq = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sq == MAP_FAILED) return false;
+        sqes = static_cast<io_uring_sqe*>(sq);
+
+        auto* sqBase = static_cast<uint8_t*>(sqRing);
+        sqHead    = reinterpret_cast<unsigned*>(sqBase + p.sq_off.head);
+        sqTail    = reinterpret_cast<unsigned*>(sqBase + p.sq_off.tail);
+        sqMask    = reinterpret_cast<unsigned*>(sqBase + p.sq_off.ring_mask);
+        sqEntries = reinterpret_cast<unsigned*>(sqBase + p.sq_off.ring_entries);
+        sqFlags   = reinterpret_cast<unsigned*>(sqBase + p.sq_off.flags);
+        sqArray   = reinterpret_cast<unsigned*>(sqBase + p.sq_off.array);
+        sqeTail = submittedTail = *sqTail;
+
+        auto* cqBase = static_cast<uint8_t*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cqBase + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cqBase + p.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cqBase + p.cq_off.ring_mask);
+        cqes   = reinterpret_cast<io_uring_cqe*>(cqBase + p.cq_off.cqes);
+
+        // provided buffer ring, registered once so recvs never need a user buffer per sqe
+        bufCount = count;
+        bufSize = size;
+        bufRingSize = bufCount * sizeof(io_uring_buf);
+        void* br = mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (br == MAP_FAILED) return false;
+        bufRing = static_cast<io_uring_buf_ring*>(br);
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t) (uintptr_t) bufRing;
+        reg.ring_entries = bufCount;
+        reg.bgid = BUF_GROUP_ID;
+        if (sysRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            Logger::warn("io_uring provided buffer ring: " + std::string(strerror(errno)));
+            return false;
+        }
+
+        bufs.resize((size_t) bufCount * bufSize);
+        for (unsigned int i = 0; i < bufCount; i++) recycleBuffer((uint16_t) i);
+        return true;
+    }
+
+    io_uring_sqe* IoUring::getSqe() {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqeTail - head >= *sqEntries) {
+            // full: push what we have to the kernel and try again
+            submit();
+            head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if (sqeTail - head >= *sqEntries) return nullptr;
+        }
+        unsigned idx = sqeTail & *sqMask;
+        io_uring_sqe* sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[idx] = idx;
+        sqeTail++;
+        return sqe;
+    }
+
+    bool IoUring::prepRecvMultishot(int fd, uint64_t userData) {
+        io_uring_sqe* sqe = getSqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP_ID;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    bool IoUring::prepSendmsg(int fd, const msghdr* msg, uint64_t userData, bool pollFirst) {
+        io_uring_sqe* sqe = getSqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        if (pollFirst) sqe->ioprio = IORING_RECVSEND_POLL_FIRST;
+        sqe->addr = (uint64_t) (uintptr_t) msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    bool IoUring::prepCancelFd(int fd, uint64_t userData) {
+        io_uring_sqe* sqe = getSqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    bool IoUring::prepCancel(uint64_t target, uint64_t userData) {
+        io_uring_sqe* sqe = getSqe();
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    int IoUring::submit() {
+        unsigned toSubmit = sqeTail - submittedTail;
+        if (toSubmit == 0) return 0;
+        __atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+        int ret;
+        do {
+            ret = sysEnter(ringFd, toSubmit, 0, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret > 0) submittedTail += ret;
+        return ret;
+    }
+
+    void IoUring::reap(const std::function<void(const Completion&)>& fn) {
+        for (;;) {
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            while (head != tail) {
+                const io_uring_cqe& cqe = cqes[head & *cqMask];
+                Completion c{ cqe.user_data, cqe.res, cqe.flags };
+                head++;
+                __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+                fn(c);
+            }
+            // the kernel parks cqes that didn't fit; ask it to flush them and go again
+            if (!(__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)) break;
+            sysEnter(ringFd, 0, 0, IORING_ENTER_GETEVENTS);
+        }
+    }
+
+    bool IoUring::hasBuffer(uint32_t flags) { return flags & IORING_CQE_F_BUFFER; }
+    uint16_t IoUring::bufferId(uint32_t flags) { return (uint16_t) (flags >> IORING_CQE_BUFFER_SHIFT); }
+    bool IoUring::hasMore(uint32_t flags) { return flags & IORING_CQE_F_MORE; }
+
+    void IoUring::recycleBuffer(uint16_t bid) {
+        // index the entries by hand: in C++ the header's flex array member doesn't sit at offset 0
+        io_uring_buf* buf = reinterpret_cast<io_uring_buf*>(bufRing) + (bufTail & (bufCount - 1));
+        buf->addr = (uint64_t) (uintptr_t) (bufs.data() + (size_t) bid * bufSize);
+        buf->len = bufSize;
+        buf->bid = bid;
+        bufTail++;
+        __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+    }
+
+}
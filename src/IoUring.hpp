@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <sys/socket.h>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+
+namespace Retchat {
+
+    // minimal io_uring wrapper straight on top of the kernel ABI (no liburing).
+    // one instance per event loop, only ever touched from that loop's thread.
+    // receives land in a kernel-registered provided-buffer ring via multishot recv,
+    // so a socket is armed once and then reports data without any further syscalls.
+    class IoUring {
+    public:
+        struct Completion {
+            uint64_t userData;
+            int32_t res;
+            uint32_t flags;
+        };
+
+        IoUring() = default;
+        ~IoUring();
+
+        bool init(unsigned int entries, unsigned int bufCount, unsigned int bufSize);
+        int getFd() const { return ringFd; }
+
+        bool prepRecvMultishot(int fd, uint64_t userData);
+        bool prepSendmsg(int fd, const msghdr* msg, uint64_t userData, bool pollFirst = false);
+        bool prepCancelFd(int fd, uint64_t userData);
+        // just the request that was submitted with target as its user data
+        bool prepCancel(uint64_t target, uint64_t userData);
+
+        // hands every queued sqe to the kernel in a single io_uring_enter
+        int submit();
+        void reap(const std::function<void(const Completion&)>& fn);
+
+        // provided buffers: the cqe flags say which one a recv landed in
+        static bool hasBuffer(uint32_t flags);
+        static uint16_t bufferId(uint32_t flags);
+        static bool hasMore(uint32_t flags);
+        const uint8_t* buffer(uint16_t bid) const { return bufs.data() + (size_t) bid * bufSize; }
+        void recycleBuffer(uint16_t bid);
+
+    private:
+        io_uring_sqe* getSqe();
+
+        int ringFd = -1;
+
+        void* sqRing = nullptr;
+        void* cqRing = nullptr;
+        size_t sqRingSize = 0, cqRingSize = 0;
+        io_uring_sqe* sqes = nullptr;
+        size_t sqesSize = 0;
+
+        unsigned* sqHead = nullptr;
+        unsigned* sqTail = nullptr;
+        unsigned* sqMask = nullptr;
+        unsigned* sqEntries = nullptr;
+        unsigned* sqFlags = nullptr;
+        unsigned* sqArray = nullptr;
+        unsigned sqeTail = 0, submittedTail = 0;
+
+        unsigned* cqHead = nullptr;
+        unsigned* cqTail = nullptr;
+        unsigned* cqMask = nullptr;
+        io_uring_cqe* cqes = nullptr;
+
+        io_uring_buf_ring* bufRing = nullptr;
+        size_t bufRingSize = 0;
+        unsigned int bufCount = 0, bufSize = 0;
+        uint16_t bufTail = 0;
+        std::vector<uint8_t> bufs;
+    };
+
+}
@@ -0,0 +1,91 @@
+#include "MemoryGovernor.hpp"
+
+#include <cstdio>
+
+
+// how far one thread's share of a pool may drift from the shared count before it's added in
+constexpr int64_t FLUSH_BYTES = 64 * 1024;
+
+
+namespace Retchat {
+
+    // the changes this thread made that the shared counts don't have yet
+    struct PendingDeltas {
+        const MemoryGovernor* owner = nullptr;
+        int64_t bytes[3] = {};
+    };
+    static thread_local PendingDeltas pending;
+
+    static std::string formatMb(size_t bytes) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.1fMB", bytes / (1024.0 * 1024.0));
+        return buf;
+    }
+
+    MemoryGovernor::MemoryGovernor(const MemoryLimit& limit) : soft(limit.soft), hard(limit.hard) {}
+
+    void MemoryGovernor::track(Pool pool, size_t before, size_t after) {
+        if (before == after) return;
+        if (pending.owner != this) {
+            pending = PendingDeltas();
+            pending.owner = this;
+        }
+        int64_t& delta = pending.bytes[(int) pool];
+        delta += (int64_t) after - (int64_t) before;
+        if (delta > -FLUSH_BYTES && delta < FLUSH_BYTES) return;
+        pools[(int) pool].fetch_add(delta, std::memory_order_relaxed);
+        bool grew = delta > 0;
+        delta = 0;
+        if (!grew) return;
+        size_t used = getUsed();
+        size_t high = peak.load(std::memory_order_relaxed);
+        while (used > high && !peak.compare_exchange_weak(high, used, std::memory_order_relaxed)) {}
+    }
+
+    size_t MemoryGovernor::getPool(Pool pool) const {
+        // one thread's frees can land before another's allocations, so this can dip below 0
+        int64_t bytes = pools[(int) pool].load(std::memory_order_relaxed);
+        return bytes > 0 ? (size_t) bytes : 0;
+    }
+
+    size_t MemoryGovernor::getUsed() const {
+        return getPool(Pool::Receive) + getPool(Pool::Queued) + getPool(Pool::Images);
+    }
+
+    MemoryGovernor::Level MemoryGovernor::getLevel() const {
+        size_t used = getUsed();
+        size_t h = hard.load(std::memory_order_relaxed);
+        size_t s = soft.load(std::memory_order_relaxed);
+        if (h && used >= h) return Level::Hard;
+        if (s && used >= s) return Level::Soft;
+        return Level::Normal;
+    }
+
+    void MemoryGovernor::setLimit(const MemoryLimit& limit) {
+        soft = limit.soft;
+        hard = limit.hard;
+    }
+
+    const char* MemoryGovernor::describe(Level level) {
+        switch (level) {
+            case Level::Normal: return "normal";
+            case Level::Soft:   return "over soft watermark, heavy senders paused";
+            case Level::Hard:   return "over hard watermark, large frames refused";
+        }
+        return "?";
+    }
+
+    std::string MemoryGovernor::getSummary() const {
+        size_t s = soft.load(std::memory_order_relaxed);
+        size_t h = hard.load(std::memory_order_relaxed);
+        return "memory: " + formatMb(getUsed()) + " in use (" + describe(getLevel()) + "), soft " +
+               (s ? formatMb(s) : std::string("off")) + ", hard " + (h ? formatMb(h) : std::string("off")) +
+               " | receive buffers " + formatMb(getPool(Pool::Receive)) +
+               ", outbound queues " + formatMb(getPool(Pool::Queued)) +
+               ", cached images " + formatMb(getPool(Pool::Images)) +
+               " | peak " + formatMb(peak.load(std::memory_order_relaxed)) + " | " + std::to_string(paused.load()) +
+               " client(s) paused now, " + std::to_string(pauses.load()) + " pauses, " + std::to_string(refused.load()) +
+               " large frames refused";
+    }
+
+}
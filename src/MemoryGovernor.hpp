@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+namespace Retchat {
+
+    // where the governor starts pushing back, in bytes. 0 = no watermark
+    struct MemoryLimit {
+        size_t soft = 0;  // past it, the heaviest senders stop being read from
+        size_t hard = 0;  // past it, large frames are refused as well
+    };
+
+    // server-wide account of the memory clients make the server hold: receive buffers,
+    // outbound queues and cached images. nothing is refused here, the clients ask for the
+    // current level and back off on their own. counts are exact, but each thread sums its own
+    // changes and adds them to the shared counters only every 64 KB or so, so a queue going up
+    // and down by a chat line at a time doesn't touch them at all. the shared count is off by
+    // at most that much per thread and pool, however many clients there are
+    class MemoryGovernor {
+    public:
+        enum class Pool { Receive, Queued, Images };
+        enum class Level { Normal, Soft, Hard };
+
+        explicit MemoryGovernor(const MemoryLimit& limit);
+
+        // one client's (or the cache's) share of a pool went from before to after bytes
+        void track(Pool pool, size_t before, size_t after);
+        Level getLevel() const;
+        size_t getUsed() const;
+        size_t getPool(Pool pool) const;
+
+        void setLimit(const MemoryLimit& limit);
+
+        void countPause() { pauses++; paused++; }
+        void countResume() { paused--; }
+        void countRefused() { refused++; }
+
+        static const char* describe(Level level);
+        std::string getSummary() const;
+
+    private:
+        std::atomic<int64_t> pools[3] = {};
+        std::atomic<size_t> peak{0};
+        std::atomic<size_t> soft, hard;
+
+        std::atomic<uint64_t> pauses{0};
+        std::atomic<size_t> paused{0};  // clients not being read from right now
+        std::atomic<uint64_t> refused{0};
+    };
+
+}
@@ -0,0 +1,36 @@
+#include "NickIndex.hpp"
+
+#include "Client.hpp"
+
+#include <algorithm>
+
+
+namespace Retchat {
+
+    void NickIndex::add(const std::string& nick, Client* client) {
+        Shard& shard = shardOf(nick);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::vector<Client*>& holders = shard.clients[nick];
+        auto pos = std::find_if(holders.begin(), holders.end(),
+                                [&](Client* c) { return c->getSockfd() > client->getSockfd(); });
+        holders.insert(pos, client);
+    }
+
+    void NickIndex::remove(const std::string& nick, Client* client) {
+        Shard& shard = shardOf(nick);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.clients.find(nick);
+        if (it == shard.clients.end()) return;
+        std::vector<Client*>& holders = it->second;
+        holders.erase(std::remove(holders.begin(), holders.end(), client), holders.end());
+        if (holders.empty()) shard.clients.erase(it);
+    }
+
+    void NickIndex::rename(const std::string& from, const std::string& to, Client* client) {
+        // two steps, so no two shard locks are ever held at once. a DM racing the rename may
+        // find neither nick, which is what it'd get a moment later from the old one anyway
+        remove(from, client);
+        add(to, client);
+    }
+
+}
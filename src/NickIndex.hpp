@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+namespace Retchat {
+
+    class Client;
+
+    // every client past its handshake by nick, so DMs and admin commands find their target without
+    // walking all clients under the server lock. split into shards each with its own lock, so
+    // lookups for different nicks don't wait on each other. nicks are only unique within a
+    // room, so a nick can map to several clients, kept in fd order
+    class NickIndex {
+    public:
+        void add(const std::string& nick, Client* client);
+        void remove(const std::string& nick, Client* client);
+        void rename(const std::string& from, const std::string& to, Client* client);
+
+        // calls fn with the client holding nick (the lowest fd if there are several) while its
+        // shard is locked, so it can't be removed and deleted meanwhile. false if nobody has it
+        template <typename Fn>
+        bool with(std::string_view nick, Fn&& fn) {
+            std::string key(nick);
+            Shard& shard = shardOf(key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.clients.find(key);
+            if (it == shard.clients.end()) return false;
+            fn(it->second.front());
+            return true;
+        }
+
+        // the same for every client holding nick, returns how many there were
+        template <typename Fn>
+        size_t withAll(std::string_view nick, Fn&& fn) {
+            std::string key(nick);
+            Shard& shard = shardOf(key);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.clients.find(key);
+            if (it == shard.clients.end()) return 0;
+            for (Client* c : it->second) fn(c);
+            return it->second.size();
+        }
+
+    private:
+        static constexpr size_t SHARDS = 64;
+
+        struct alignas(64) Shard {
+            std::mutex mutex;
+            std::unordered_map<std::string, std::vector<Client*>> clients;
+        };
+
+        Shard& shardOf(const std::string& nick) { return shards[std::hash<std::string>()(nick) % SHARDS]; }
+
+        Shard shards[SHARDS];
+    };
+
+}
@@ -1,195 +1,452 @@
 #pragma once
 
+#include "BufferPool.hpp"
 #include "Protocol.hpp"
+#include "SharedBuffer.hpp"
 
+#include <array>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <cstring>
+#include <type_traits>
+#include <utility>
+#include <variant>
 #include <vector>
 
 
 namespace Retchat {
 
-    class Packet {
-    public:
-        PacketType type;
-        std::vector<uint8_t> payload;
+    constexpr size_t MAX_IMAGE_DATA_SIZE = 1 * 1024 * 1024;  // 1 MB
+    constexpr size_t IMAGE_CHUNK_SIZE = 16 * 1024;  // image bytes per PKT_IMAGE_CHUNK, the last one may be shorter
+    constexpr uint8_t MAX_SYSTEM_PARAMS = 16;
 
-        virtual ~Packet() = default;
-        virtual void serialize(std::vector<uint8_t>& out) const;
-        virtual bool deserialize(const uint8_t* data, size_t len);
-        static Packet* create(PacketType type);
-    };
-
-    std::vector<uint8_t> serializeString(const std::string& str);
+    // appends str and its null terminator
+    void serializeString(std::string_view str, std::vector<uint8_t>& out);
     // Returns false if no null terminator is found within the remaining buffer.
     bool deserializeString(const uint8_t* data, size_t len, size_t& offset, std::string& out);
+    // same, but out points into data instead of owning a copy
+    bool deserializeString(const uint8_t* data, size_t len, size_t& offset, std::string_view& out);
 
-    
-    class HandshakePacket : public Packet {
-    public:
-        uint16_t version = 0;
-        HandshakePacket() { type = PKT_HANDSHAKE; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
+    // raw bytes borrowed from a frame, the view counterpart of a std::vector<uint8_t>
+    struct ByteView {
+        const uint8_t* data = nullptr;
+        size_t size = 0;
     };
 
-    class KeepAlivePacket : public Packet {
-    public:
-        KeepAlivePacket() { type = PKT_KEEPALIVE; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
+
+    // --- schema ---
+    //
+    // every packet lists its fields once, in wire order, with a Schema specialization below
+    // it. that generates the exact-size serializer and the parser, nothing is hand-coded per
+    // packet. how a field goes on the wire follows from its member type:
+    //   std::string, std::string_view   null-terminated
+    //   bool, uint8_t                   one byte
+    //   uint16_t, uint32_t              big-endian
+    //   uint8_t[N]                      N raw bytes
+    //   vector<uint8_t>, ByteView       the rest of the frame
+    //   vector<string>                  null-terminated strings up to the end of the frame
+    // plus Counted (a one-byte count, then that many strings) and Rest (the rest of the frame,
+    // with a size limit). a frame only parses if every field does and nothing is left over
+
+    template <typename P> struct Schema;
+
+    template <typename T, typename = void> struct Codec;
+
+    template <typename S>
+    struct Codec<S, std::enable_if_t<std::is_same_v<S, std::string> || std::is_same_v<S, std::string_view>>> {
+        static size_t size(const S& v) { return v.size() + 1; }
+        static void write(const S& v, std::vector<uint8_t>& out) { serializeString(v, out); }
+        static bool read(const uint8_t* data, size_t len, size_t& off, S& v) { return deserializeString(data, len, off, v); }
     };
 
-    class KeepAliveAckPacket : public Packet {
-    public:
-        KeepAliveAckPacket() { type = PKT_KEEPALIVE_ACK; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
+    template <typename I>
+    struct Codec<I, std::enable_if_t<std::is_integral_v<I>>> {
+        static size_t size(const I&) { return sizeof(I); }
+        static void write(const I& v, std::vector<uint8_t>& out) {
+            for (int shift = (sizeof(I) - 1) * 8; shift >= 0; shift -= 8) out.push_back((uint8_t) (v >> shift));
+        }
+        static bool read(const uint8_t* data, size_t len, size_t& off, I& v) {
+            if (len - off < sizeof(I)) return false;
+            uint32_t value = 0;
+            for (size_t i = 0; i < sizeof(I); i++) value = (value << 8) | data[off + i];
+            v = (I) value;
+            off += sizeof(I);
+            return true;
+        }
     };
 
-    class NickRequestPacket : public Packet {
-    public:
-        std::string newNick;
-        NickRequestPacket() { type = PKT_NICK_REQUEST; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
+    template <size_t N>
+    struct Codec<uint8_t[N]> {
+        static size_t size(const uint8_t (&)[N]) { return N; }
+        static void write(const uint8_t (&v)[N], std::vector<uint8_t>& out) { out.insert(out.end(), v, v + N); }
+        static bool read(const uint8_t* data, size_t len, size_t& off, uint8_t (&v)[N]) {
+            if (len - off < N) return false;
+            memcpy(v, data + off, N);
+            off += N;
+            return true;
+        }
+    };
+
+    template <>
+    struct Codec<std::vector<uint8_t>> {
+        static size_t size(const std::vector<uint8_t>& v) { return v.size(); }
+        static void write(const std::vector<uint8_t>& v, std::vector<uint8_t>& out) { out.insert(out.end(), v.begin(), v.end()); }
+        static bool read(const uint8_t* data, size_t len, size_t& off, std::vector<uint8_t>& v) {
+            v.assign(data + off, data + len);
+            off = len;
+            return true;
+        }
+    };
+
+    template <>
+    struct Codec<ByteView> {
+        static size_t size(const ByteView& v) { return v.size; }
+        static void write(const ByteView& v, std::vector<uint8_t>& out) { out.insert(out.end(), v.data, v.data + v.size); }
+        static bool read(const uint8_t* data, size_t len, size_t& off, ByteView& v) {
+            v.data = data + off;
+            v.size = len - off;
+            off = len;
+            return true;
+        }
+    };
+
+    template <>
+    struct Codec<std::vector<std::string>> {
+        static size_t size(const std::vector<std::string>& v) {
+            size_t n = 0;
+            for (const auto& s : v) n += s.size() + 1;
+            return n;
+        }
+        static void write(const std::vector<std::string>& v, std::vector<uint8_t>& out) {
+            for (const auto& s : v) serializeString(s, out);
+        }
+        static bool read(const uint8_t* data, size_t len, size_t& off, std::vector<std::string>& v) {
+            while (off < len) {
+                std::string s;
+                if (!deserializeString(data, len, off, s)) return false;
+                v.push_back(std::move(s));
+            }
+            return true;
+        }
+    };
+
+    template <typename M> struct MemberOf;
+    template <typename C, typename V> struct MemberOf<V C::*> {
+        using Class = C;
+        using Type = V;
+    };
+
+    // a member, encoded by its type
+    template <auto M>
+    struct Field {
+        using Class = typename MemberOf<decltype(M)>::Class;
+        using C = Codec<typename MemberOf<decltype(M)>::Type>;
+        static size_t size(const Class& p) { return C::size(p.*M); }
+        static void write(const Class& p, std::vector<uint8_t>& out) { C::write(p.*M, out); }
+        static bool read(const uint8_t* data, size_t len, size_t& off, Class& p) { return C::read(data, len, off, p.*M); }
+    };
+
+    // a vector<string> member as a one-byte count followed by the strings
+    template <auto M, uint8_t Max>
+    struct Counted {
+        using Class = typename MemberOf<decltype(M)>::Class;
+        using C = Codec<std::vector<std::string>>;
+        static size_t size(const Class& p) { return 1 + C::size(p.*M); }
+        static void write(const Class& p, std::vector<uint8_t>& out) {
+            out.push_back((uint8_t) (p.*M).size());
+            C::write(p.*M, out);
+        }
+        static bool read(const uint8_t* data, size_t len, size_t& off, Class& p) {
+            if (off >= len) return false;
+            uint8_t count = data[off++];
+            if (count > Max) return false;
+            (p.*M).clear();
+            for (uint8_t i = 0; i < count; i++) {
+                std::string s;
+                if (!deserializeString(data, len, off, s)) return false;
+                (p.*M).push_back(std::move(s));
+            }
+            return true;
+        }
+    };
+
+    // the rest of the frame, at most Max bytes of it
+    template <auto M, size_t Max>
+    struct Rest : Field<M> {
+        using typename Field<M>::Class;
+        static bool read(const uint8_t* data, size_t len, size_t& off, Class& p) {
+            return len - off <= Max && Field<M>::read(data, len, off, p);
+        }
+    };
+
+    template <typename... F>
+    struct Fields {
+        template <typename P>
+        static size_t size(const P& p) { return (F::size(p) + ... + 0); }
+        template <typename P>
+        static void write(const P& p, std::vector<uint8_t>& out) { (F::write(p, out), ...); }
+        template <typename P>
+        static bool read(const uint8_t* data, size_t len, P& p) {
+            (void) data;  // unused by packets without fields
+            size_t off = 0;
+            return (F::read(data, len, off, p) && ...) && off == len;
+        }
+    };
+
+    // what every packet gets from its schema. no virtuals, the type is known at compile time
+    template <typename Self, PacketType T>
+    struct PacketBase {
+        static constexpr PacketType TYPE = T;
+
+        size_t serializedSize() const { return Schema<Self>::size(self()); }
+        void serialize(std::vector<uint8_t>& out) const { Schema<Self>::write(self(), out); }
+        bool deserialize(const uint8_t* data, size_t len) { return Schema<Self>::read(data, len, static_cast<Self&>(*this)); }
+        // type byte + payload in one exactly sized buffer, serialized once and shared by every recipient
+        SharedBuffer serializeShared() const {
+            auto out = BufferPool::acquire(1 + serializedSize());
+            out->push_back(TYPE);
+            serialize(*out);
+            return out;
+        }
+
+    private:
+        const Self& self() const { return static_cast<const Self&>(*this); }
+    };
+
+    // packets the server reads come as views too: the same schema over string_view and
+    // ByteView fields, borrowing from the frame they were read from. they're only good until
+    // the next frame is read, anything that has to outlive it gets copied out explicitly
+    template <bool View> using StringField = std::conditional_t<View, std::string_view, std::string>;
+    template <bool View> using BytesField = std::conditional_t<View, ByteView, std::vector<uint8_t>>;
+
+
+    // --- packets ---
+
+    struct HandshakePacket : PacketBase<HandshakePacket, PKT_HANDSHAKE> {
+        uint16_t version = 0;
+        uint32_t features = 0;  // version 2 and up only
+    };
+    // the one packet whose layout depends on a field
+    template <> struct Schema<HandshakePacket> {
+        static size_t size(const HandshakePacket& p);
+        static void write(const HandshakePacket& p, std::vector<uint8_t>& out);
+        static bool read(const uint8_t* data, size_t len, HandshakePacket& p);
+    };
+
+    struct KeepAlivePacket : PacketBase<KeepAlivePacket, PKT_KEEPALIVE> {};
+    template <> struct Schema<KeepAlivePacket> : Fields<> {};
+
+    struct KeepAliveAckPacket : PacketBase<KeepAliveAckPacket, PKT_KEEPALIVE_ACK> {};
+    template <> struct Schema<KeepAliveAckPacket> : Fields<> {};
+
+    template <bool View>
+    struct BasicNickRequest : PacketBase<BasicNickRequest<View>, PKT_NICK_REQUEST> {
+        StringField<View> newNick;
     };
+    template <bool View> struct Schema<BasicNickRequest<View>> : Fields<Field<&BasicNickRequest<View>::newNick>> {};
+    using NickRequestPacket = BasicNickRequest<false>;
+    using NickRequestView = BasicNickRequest<true>;
 
-    class NickAckPacket : public Packet {
-    public:
+    struct NickAckPacket : PacketBase<NickAckPacket, PKT_NICK_ACK> {
         std::string newNick;
-        NickAckPacket() { type = PKT_NICK_ACK; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
     };
+    template <> struct Schema<NickAckPacket> : Fields<Field<&NickAckPacket::newNick>> {};
 
-    class NickNotifyPacket : public Packet {
-    public:
+    struct NickNotifyPacket : PacketBase<NickNotifyPacket, PKT_NICK_NOTIFY> {
         std::string oldNick, newNick;
-        NickNotifyPacket() { type = PKT_NICK_NOTIFY; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
     };
+    template <> struct Schema<NickNotifyPacket> : Fields<Field<&NickNotifyPacket::oldNick>, Field<&NickNotifyPacket::newNick>> {};
 
-    class JoinRequestPacket : public Packet {
-    public:
-        std::string roomName;
-        JoinRequestPacket() { type = PKT_JOIN_REQUEST; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
+    template <bool View>
+    struct BasicJoinRequest : PacketBase<BasicJoinRequest<View>, PKT_JOIN_REQUEST> {
+        StringField<View> roomName;
     };
+    template <bool View> struct Schema<BasicJoinRequest<View>> : Fields<Field<&BasicJoinRequest<View>::roomName>> {};
+    using JoinRequestPacket = BasicJoinRequest<false>;
+    using JoinRequestView = BasicJoinRequest<true>;
 
-    class JoinAckPacket : public Packet {
-    public:
+    struct JoinAckPacket : PacketBase<JoinAckPacket, PKT_JOIN_ACK> {
         std::string roomName;
-        JoinAckPacket() { type = PKT_JOIN_ACK; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
     };
+    template <> struct Schema<JoinAckPacket> : Fields<Field<&JoinAckPacket::roomName>> {};
 
-    class JoinNotifyPacket : public Packet {
-    public:
+    struct JoinNotifyPacket : PacketBase<JoinNotifyPacket, PKT_JOIN_NOTIFY> {
         std::string nick;
-        JoinNotifyPacket() { type = PKT_JOIN_NOTIFY; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
     };
+    template <> struct Schema<JoinNotifyPacket> : Fields<Field<&JoinNotifyPacket::nick>> {};
 
-    class LeaveNotifyPacket : public Packet {
-    public:
+    struct LeaveNotifyPacket : PacketBase<LeaveNotifyPacket, PKT_LEAVE_NOTIFY> {
         std::string nick;
-        LeaveNotifyPacket() { type = PKT_LEAVE_NOTIFY; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
     };
+    template <> struct Schema<LeaveNotifyPacket> : Fields<Field<&LeaveNotifyPacket::nick>> {};
 
-    class RoomListPacket : public Packet {
-    public:
+    struct RoomListPacket : PacketBase<RoomListPacket, PKT_ROOM_LIST> {
         std::vector<std::string> rooms;
-        RoomListPacket() { type = PKT_ROOM_LIST; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
     };
+    template <> struct Schema<RoomListPacket> : Fields<Field<&RoomListPacket::rooms>> {};
 
-    class UserListPacket : public Packet {
-    public:
+    struct UserListPacket : PacketBase<UserListPacket, PKT_USER_LIST> {
         std::vector<std::string> users;
-        UserListPacket() { type = PKT_USER_LIST; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
     };
+    template <> struct Schema<UserListPacket> : Fields<Field<&UserListPacket::users>> {};
+
+    // what a client sends, the server relays it as a chat packet with the sender filled in
+    template <bool View>
+    struct BasicChatRequest : PacketBase<BasicChatRequest<View>, PKT_CHAT_MSG> {
+        StringField<View> text;
+    };
+    template <bool View> struct Schema<BasicChatRequest<View>> : Fields<Field<&BasicChatRequest<View>::text>> {};
+    using ChatRequestPacket = BasicChatRequest<false>;
+    using ChatRequestView = BasicChatRequest<true>;
 
-    class ChatPacket : public Packet {
-    public:
-        std::string sender, text;
-        ChatPacket() { type = PKT_CHAT_MSG; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
+    template <bool View>
+    struct BasicChat : PacketBase<BasicChat<View>, PKT_CHAT_MSG> {
+        StringField<View> sender, text;
     };
+    template <bool View> struct Schema<BasicChat<View>> : Fields<Field<&BasicChat<View>::sender>, Field<&BasicChat<View>::text>> {};
+    using ChatPacket = BasicChat<false>;
+    using ChatView = BasicChat<true>;
 
-    class SystemPacket : public Packet {
-    public:
+    struct SystemPacket : PacketBase<SystemPacket, PKT_SYSTEM_MSG> {
         bool isError = false;
         uint16_t code = 0;
         std::vector<std::string> params;
-
-        SystemPacket() { type = PKT_SYSTEM_MSG; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
     };
+    template <> struct Schema<SystemPacket>
+        : Fields<Field<&SystemPacket::isError>, Field<&SystemPacket::code>, Counted<&SystemPacket::params, MAX_SYSTEM_PARAMS>> {};
 
-    class DisconnectPacket : public Packet {
-    public:
-        DisconnectPacket() { type = PKT_DISCONNECT; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
-    };
+    struct DisconnectPacket : PacketBase<DisconnectPacket, PKT_DISCONNECT> {};
+    template <> struct Schema<DisconnectPacket> : Fields<> {};
 
-    class KickPacket : public Packet {
-    public:
+    struct KickPacket : PacketBase<KickPacket, PKT_KICK> {
         std::string reason;
-        KickPacket() { type = PKT_KICK; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
     };
+    template <> struct Schema<KickPacket> : Fields<Field<&KickPacket::reason>> {};
 
-    class BanPacket : public Packet {
-    public:
+    struct BanPacket : PacketBase<BanPacket, PKT_BAN> {
         std::string reason;
-        BanPacket() { type = PKT_BAN; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
     };
+    template <> struct Schema<BanPacket> : Fields<Field<&BanPacket::reason>> {};
 
-    class DmRequestPacket : public Packet {
-    public:
-        std::string targetNick;
-        std::string text;
-        DmRequestPacket() { type = PKT_DM_REQUEST; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
+    template <bool View>
+    struct BasicDmRequest : PacketBase<BasicDmRequest<View>, PKT_DM_REQUEST> {
+        StringField<View> targetNick;
+        StringField<View> text;
     };
+    template <bool View> struct Schema<BasicDmRequest<View>> : Fields<Field<&BasicDmRequest<View>::targetNick>, Field<&BasicDmRequest<View>::text>> {};
+    using DmRequestPacket = BasicDmRequest<false>;
+    using DmRequestView = BasicDmRequest<true>;
 
-    class DmMsgPacket : public Packet {
-    public:
-        std::string senderNick;
-        std::string text;
-        DmMsgPacket() { type = PKT_DM_MSG; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
+    template <bool View>
+    struct BasicDmMsg : PacketBase<BasicDmMsg<View>, PKT_DM_MSG> {
+        StringField<View> senderNick;
+        StringField<View> text;
     };
+    template <bool View> struct Schema<BasicDmMsg<View>> : Fields<Field<&BasicDmMsg<View>::senderNick>, Field<&BasicDmMsg<View>::text>> {};
+    using DmMsgPacket = BasicDmMsg<false>;
+    using DmMsgView = BasicDmMsg<true>;
 
-    class ImagePacket : public Packet {
-    public:
-        std::string sender;
-        std::string target;  // empty for room, otherwise recipient name (for dms)
-        std::string mimeType;  // e.g. "image/png"
-        std::string fileName;  // may be empty
-        std::vector<uint8_t> imageData;
+    struct RoomKeyPacket : PacketBase<RoomKeyPacket, PKT_ROOM_KEY> {
+        std::string roomName;
+        uint32_t keyId = 0;
+        uint8_t key[32];
+    };
+    template <> struct Schema<RoomKeyPacket>
+        : Fields<Field<&RoomKeyPacket::roomName>, Field<&RoomKeyPacket::keyId>, Field<&RoomKeyPacket::key>> {};
 
-        ImagePacket() { type = PKT_IMAGE_MSG; }
-        void serialize(std::vector<uint8_t>& out) const override;
-        bool deserialize(const uint8_t* data, size_t len) override;
+    template <bool View>
+    struct BasicImage : PacketBase<BasicImage<View>, PKT_IMAGE_MSG> {
+        StringField<View> sender;
+        StringField<View> target;  // empty for room, otherwise recipient name (for dms)
+        StringField<View> mimeType;  // e.g. "image/png"
+        StringField<View> fileName;  // may be empty
+        BytesField<View> imageData;
     };
+    template <bool View> struct Schema<BasicImage<View>>
+        : Fields<Field<&BasicImage<View>::sender>, Field<&BasicImage<View>::target>, Field<&BasicImage<View>::mimeType>,
+                 Field<&BasicImage<View>::fileName>, Rest<&BasicImage<View>::imageData, MAX_IMAGE_DATA_SIZE>> {};
+    using ImagePacket = BasicImage<false>;
+    using ImageView = BasicImage<true>;
+
+    // a streamed image: the header first, then its bytes in chunks as they come. the sender
+    // picks the stream id, the server forwards everything under one of its own
+    template <bool View>
+    struct BasicImageBegin : PacketBase<BasicImageBegin<View>, PKT_IMAGE_BEGIN> {
+        StringField<View> sender;
+        StringField<View> target;  // empty for room, otherwise recipient name (for dms)
+        StringField<View> mimeType;
+        StringField<View> fileName;
+        uint32_t streamId = 0;
+        uint32_t size = 0;  // of the whole image
+    };
+    template <bool View> struct Schema<BasicImageBegin<View>>
+        : Fields<Field<&BasicImageBegin<View>::sender>, Field<&BasicImageBegin<View>::target>,
+                 Field<&BasicImageBegin<View>::mimeType>, Field<&BasicImageBegin<View>::fileName>,
+                 Field<&BasicImageBegin<View>::streamId>, Field<&BasicImageBegin<View>::size>> {};
+    using ImageBeginPacket = BasicImageBegin<false>;
+    using ImageBeginView = BasicImageBegin<true>;
+
+    template <bool View>
+    struct BasicImageChunk : PacketBase<BasicImageChunk<View>, PKT_IMAGE_CHUNK> {
+        uint32_t streamId = 0;
+        uint32_t offset = 0;  // of data within the image
+        BytesField<View> data;
+    };
+    template <bool View> struct Schema<BasicImageChunk<View>>
+        : Fields<Field<&BasicImageChunk<View>::streamId>, Field<&BasicImageChunk<View>::offset>,
+                 Rest<&BasicImageChunk<View>::data, IMAGE_CHUNK_SIZE>> {};
+    using ImageChunkPacket = BasicImageChunk<false>;
+    using ImageChunkView = BasicImageChunk<true>;
+
+    struct ImageAbortPacket : PacketBase<ImageAbortPacket, PKT_IMAGE_ABORT> {
+        uint32_t streamId = 0;
+    };
+    template <> struct Schema<ImageAbortPacket> : Fields<Field<&ImageAbortPacket::streamId>> {};
+
+    // an image the server has cached, sent by hash to clients that take image refs
+    template <bool View>
+    struct BasicImageRef : PacketBase<BasicImageRef<View>, PKT_IMAGE_REF> {
+        StringField<View> sender;
+        StringField<View> target;
+        StringField<View> mimeType;
+        StringField<View> fileName;
+        uint8_t hash[32];  // sha-256 of the image bytes
+        uint32_t size = 0;
+    };
+    template <bool View> struct Schema<BasicImageRef<View>>
+        : Fields<Field<&BasicImageRef<View>::sender>, Field<&BasicImageRef<View>::target>,
+                 Field<&BasicImageRef<View>::mimeType>, Field<&BasicImageRef<View>::fileName>,
+                 Field<&BasicImageRef<View>::hash>, Field<&BasicImageRef<View>::size>> {};
+    using ImageRefPacket = BasicImageRef<false>;
+    using ImageRefView = BasicImageRef<true>;
+
+    struct ImageFetchPacket : PacketBase<ImageFetchPacket, PKT_IMAGE_FETCH> {
+        uint8_t hash[32];
+    };
+    template <> struct Schema<ImageFetchPacket> : Fields<Field<&ImageFetchPacket::hash>> {};
+
+    template <bool View>
+    struct BasicImageBlob : PacketBase<BasicImageBlob<View>, PKT_IMAGE_BLOB> {
+        uint8_t hash[32];
+        BytesField<View> data;  // empty when the image is gone
+    };
+    template <bool View> struct Schema<BasicImageBlob<View>>
+        : Fields<Field<&BasicImageBlob<View>::hash>, Rest<&BasicImageBlob<View>::data, MAX_IMAGE_DATA_SIZE>> {};
+    using ImageBlobPacket = BasicImageBlob<false>;
+    using ImageBlobView = BasicImageBlob<true>;
+
+
+    // --- dispatch ---
+
+    // everything a client may send once it's past the handshake, parsed on the stack. the
+    // monostate is what's left when a frame doesn't parse
+    using ClientMessage = std::variant<std::monostate, KeepAlivePacket, KeepAliveAckPacket, NickRequestView,
+                                       JoinRequestView, ChatRequestView, DmRequestView, ImageView,
+                                       ImageBeginView, ImageChunkView, ImageAbortPacket, ImageFetchPacket>;
+
+    // parses the frame into the alternative for its type through a jump table built at compile
+    // time. false for malformed frames and for types clients don't send
+    bool parseClientMessage(PacketType type, const uint8_t* data, size_t len, ClientMessage& out);
 
-}
\ No newline at end of file
+}
@@ -1,17 +1,81 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 
 namespace Retchat {
 
-    constexpr uint16_t PROTOCOL_VERSION = 1;
+    constexpr uint16_t PROTOCOL_VERSION = 1;     // 2048-bit DH
+    constexpr uint16_t PROTOCOL_VERSION_2 = 2;   // X25519
+
+    // a version 2 client answers the server's DH key with its X25519 key instead, with this
+    // bit set in the length. the server replies with its own X25519 key the same way, and the
+    // encrypted version exchange then carries 2. version 1 clients never see any of it
+    constexpr uint32_t KEY_X25519_FLAG = 0x80000000;
+    constexpr size_t X25519_KEY_SIZE = 32;
+
+    // version 2 handshake packets carry a feature bitmask after the version. the server offers
+    // everything it supports and the client echoes back the subset it wants, at most one cipher.
+    // a chosen cipher replaces the HMAC/XOR frames right after the echo, in both directions:
+    // tag(16) + length(4 big-endian) + ciphertext, with the length as associated data and a
+    // nonce of 4 zero bytes + the big-endian frame counter, which starts over at 0
+    constexpr uint32_t FEAT_AES_256_GCM        = 1 << 0;
+    constexpr uint32_t FEAT_CHACHA20_POLY1305  = 1 << 1;
+    constexpr uint32_t FEAT_CIPHERS = FEAT_AES_256_GCM | FEAT_CHACHA20_POLY1305;
+
+    // room keys (needs a cipher): every room member gets the room's key in a PKT_ROOM_KEY over
+    // its own channel, and room broadcasts are sealed once with it and sent to everyone as is:
+    // tag(16) + length(4 big-endian, top bit set) + key id(4) + counter(8) + ciphertext, using
+    // the member's cipher, keyed with SHA256(room key || "retchat room aes") or
+    // SHA256(room key || "retchat room chacha"). bytes 16..32 are the associated data, the
+    // nonce is the cipher bit (4 big-endian) + the counter, and counters only ever go up for a
+    // key. these frames don't count towards the member's own frame counter. the key changes
+    // whenever someone joins or leaves, the new one always arrives before the first frame
+    // sealed with it
+    constexpr uint32_t FEAT_ROOM_KEYS = 1 << 2;
+    constexpr uint32_t ROOM_FRAME_FLAG = 0x80000000;
+
+    // batch frames: the server may pack several packets for the client into one frame, so a
+    // burst of small ones pays for a single header and MAC. the frame holds a PKT_BATCH, then
+    // length(2 big-endian) + packet (type byte + payload) repeated up to its end. server to
+    // client only, batches never nest and room frames are never part of one
+    constexpr uint32_t FEAT_BATCH = 1 << 3;
+
+    // compression, both ways: a frame may carry a PKT_COMPRESSED followed by the next piece
+    // of the sender's raw deflate stream (window of at most 4 KB), which inflates to one
+    // packet, or to a batch. each direction is a single stream for the whole connection and
+    // every piece ends in a sync flush with its trailing 00 00 ff ff left off, so the
+    // receiver appends those 4 bytes before inflating and keeps its context between frames.
+    // it's up to the sender what to compress: the server leaves small packets, images in
+    // compressed formats, room frames, room keys and dms as they are, never batches two
+    // senders' packets together, and may start its deflate stream over between frames
+    constexpr uint32_t FEAT_COMPRESS = 1 << 4;
+
+    // image streams: instead of one PKT_IMAGE_MSG holding the whole image, a client sends a
+    // PKT_IMAGE_BEGIN with the size, then the bytes in PKT_IMAGE_CHUNKs of IMAGE_CHUNK_SIZE
+    // (the last one may be shorter), all under a stream id it picked. the server forwards
+    // each chunk as soon as it arrives, under a stream id of its own. a stream that would reach
+    // anyone who didn't take this feature is refused up front with MSG_IMAGE_STREAM_REFUSED,
+    // and the client sends that image whole in a PKT_IMAGE_MSG instead; members joining
+    // midway don't see the stream if they can't take it either. the stream ends after its last
+    // byte, or with a PKT_IMAGE_ABORT either way. chunks carry their offset, so a recipient
+    // that joined late or had one dropped can tell and throw the stream away
+    constexpr uint32_t FEAT_IMAGE_STREAMS = 1 << 5;
+
+    // image refs: the server keeps the images clients send by their SHA-256, and sends members
+    // that took this feature a PKT_IMAGE_REF with the hash and size instead of the image. a
+    // client that doesn't have those bytes yet asks for them with a PKT_IMAGE_FETCH and gets
+    // a PKT_IMAGE_BLOB back, with no data if the server no longer has the image either
+    constexpr uint32_t FEAT_IMAGE_REFS = 1 << 6;
 
     // packet types
     enum PacketType : uint8_t {
         PKT_HANDSHAKE      = 0x01,  // DH public key + protocol version
         PKT_KEEPALIVE      = 0x02,  // c2s: keep connection alive
         PKT_KEEPALIVE_ACK  = 0x03,  // s2c: keep alive ack
+        PKT_BATCH          = 0x04,  // s2c: several packets in one frame (FEAT_BATCH)
+        PKT_COMPRESSED     = 0x05,  // deflated packet or batch (FEAT_COMPRESS)
         PKT_NICK_REQUEST   = 0x10,  // c2s: new nickname
         PKT_NICK_ACK       = 0x11,  // s2c: nickname changed
         PKT_NICK_NOTIFY    = 0x12,  // s2c: someone changed nickname
@@ -21,11 +85,18 @@ namespace Retchat {
         PKT_LEAVE_NOTIFY   = 0x16,  // s2c: someone left
         PKT_ROOM_LIST      = 0x17,  // s2c: list of rooms
         PKT_USER_LIST      = 0x18,  // s2c: list of users in current room
+        PKT_ROOM_KEY       = 0x19,  // s2c: key for the current room's broadcasts
         PKT_CHAT_MSG       = 0x20,  // s2c: chat message
         PKT_SYSTEM_MSG     = 0x21,  // s2c: system message
         PKT_DM_REQUEST     = 0x22,  // c2s: direct message
         PKT_DM_MSG         = 0x23,  // s2c: direct message received
         PKT_IMAGE_MSG      = 0x24,  // image payload
+        PKT_IMAGE_BEGIN    = 0x25,  // a streamed image's header (FEAT_IMAGE_STREAMS)
+        PKT_IMAGE_CHUNK    = 0x26,  // next part of a streamed image
+        PKT_IMAGE_ABORT    = 0x27,  // a streamed image won't be finished
+        PKT_IMAGE_REF      = 0x28,  // s2c: an image by hash (FEAT_IMAGE_REFS)
+        PKT_IMAGE_FETCH    = 0x29,  // c2s: send me the image with this hash
+        PKT_IMAGE_BLOB     = 0x2A,  // s2c: the image bytes for a hash
         PKT_DISCONNECT     = 0x30,  // s2c: disconnected
         PKT_KICK           = 0x31,  // s2c: kicked
         PKT_BAN            = 0x32   // s2c: banned
@@ -52,6 +123,9 @@ namespace Retchat {
         MSG_DM_TARGET_NOT_FOUND  = 10,
         MSG_IMAGE_UNSUPPORTED    = 11,
         MSG_VERSION_MISMATCH     = 12,
+        MSG_IMAGE_STREAM_FAILED  = 13,
+        MSG_SERVER_BUSY          = 14,  // a large frame was refused while the server is short on memory
+        MSG_IMAGE_STREAM_REFUSED = 15,  // a recipient can't take image streams, send the image whole
     };
 
 }
\ No newline at end of file
@@ -0,0 +1,38 @@
+#include "RecvBuffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace Retchat {
+
+    void RecvBuffer::consume(size_t n) {
+        head += n;
+        if (head == tail) head = tail = 0;
+    }
+
+    size_t RecvBuffer::prepare(size_t n) {
+        if (buf.size() - tail >= n) return buf.size() - tail;
+        // slide the partial frame to the front before growing
+        if (head > 0) {
+            memmove(buf.data(), buf.data() + head, tail - head);
+            tail -= head;
+            head = 0;
+        }
+        if (buf.size() - tail < n) buf.resize(std::max(tail + n, buf.size() * 2));
+        return buf.size() - tail;
+    }
+
+    void RecvBuffer::append(const uint8_t* bytes, size_t len) {
+        prepare(len);
+        memcpy(buf.data() + tail, bytes, len);
+        tail += len;
+    }
+
+    void RecvBuffer::release(size_t keep) {
+        if (!empty() || buf.size() <= keep) return;
+        std::vector<uint8_t>().swap(buf);
+        head = tail = 0;
+    }
+
+}
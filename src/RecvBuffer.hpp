@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace Retchat {
+
+    // per-connection receive buffer. the socket is read straight into the free space after
+    // the buffered bytes and complete frames are decoded in place from the front, so the only
+    // bytes that ever get moved are a trailing partial frame, and only when space runs out.
+    // frames have to be contiguous to be verified and decrypted in place, which is why this
+    // compacts instead of wrapping around
+    class RecvBuffer {
+    public:
+        uint8_t* data() { return buf.data() + head; }
+        size_t size() const { return tail - head; }
+        bool empty() const { return head == tail; }
+        void consume(size_t n);
+
+        // make at least n bytes writable after the buffered ones, returns how many there are
+        size_t prepare(size_t n);
+        uint8_t* writePtr() { return buf.data() + tail; }
+        void commit(size_t n) { tail += n; }
+        void append(const uint8_t* bytes, size_t len);
+
+        size_t capacity() const { return buf.size(); }
+        // give the memory back once nothing is buffered
+        void release(size_t keep);
+
+    private:
+        std::vector<uint8_t> buf;
+        size_t head = 0, tail = 0;
+    };
+
+}
@@ -1,41 +1,182 @@
 #include "Room.hpp"
 
+#include "BufferPool.hpp"
 #include "Client.hpp"
 #include "Logger.hpp"
+#include "Protocol.hpp"
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
 
 #include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstring>
 #include <string>
 
 
 namespace Retchat {
 
+    // unique across rooms, so a client never mixes up an old room's key with the new one's
+    static std::atomic<uint32_t> nextKeyId{1};
+
     Room::Room(const std::string& n) : name(n) {}
 
     void Room::addClient(Client* client) {
         std::lock_guard<std::mutex> lock(mutex);
         if (std::find(clients.begin(), clients.end(), client) == clients.end()) {
             clients.push_back(client);
+            if (client->takesImageRefs()) refMembers++;
+            if (client->takesImageStreams()) streamMembers++;
+            keyStale = true;
             Logger::info(client->getName() + "(" + std::to_string(client->getSockfd()) + ") joined room " + getName());
         }
     }
 
     void Room::removeClient(Client* client) {
         std::lock_guard<std::mutex> lock(mutex);
-        clients.erase(std::remove(clients.begin(), clients.end(), client), clients.end());
+        auto it = std::remove(clients.begin(), clients.end(), client);
+        if (it != clients.end() && client->takesImageRefs()) refMembers--;
+        if (it != clients.end() && client->takesImageStreams()) streamMembers--;
+        clients.erase(it, clients.end());
+        keyStale = true;
         Logger::info(client->getName() + "(" + std::to_string(client->getSockfd()) + ") left room " + getName());
     }
 
-    void Room::broadcast(const Packet& pkt, Client* exclude) {
+    size_t Room::broadcast(const SharedBuffer& payload, Client* exclude, const SharedBuffer& ref) {
+        // each member gets one of these, the ref if it takes image refs
+        const SharedBuffer* variants[2] = { &payload, &ref };
+        // whoever gets the ref may fetch the image it stands for
+        ImageRefView refView;
+        bool hasRef = ref && refView.deserialize(ref->data() + 1, ref->size() - 1);
+        auto pick = [&](Client* c) {
+            if (!hasRef || !c->takesImageRefs()) return 0;
+            c->allowFetch(refView.hash);
+            return 1;
+        };
+        size_t refs = 0;
+        // the excluded client is the one whose words these are
+        uint64_t origin = exclude ? exclude->getId() : Client::SERVER_ORIGIN;
+
         std::lock_guard<std::mutex> lock(mutex);
+        keyed.clear();
+        uint32_t ciphers = 0;
         for (Client* c : clients) {
-            if (c != exclude) c->sendPacket(pkt);
+            uint32_t cipher = c->getRoomCipher();
+            if (cipher) {
+                keyed.push_back(c);
+                if (c != exclude) ciphers |= cipher;
+            } else if (c != exclude) {
+                int v = pick(c);
+                refs += v;
+                c->sendShared(*variants[v], origin);
+            }
         }
+        if (!ciphers) return refs;
+
+        // everyone holding room keys gets the new one, the excluded sender included
+        if (keyStale || !groupKey) rotateKey(keyed);
+        if (!groupKey) {
+            for (Client* c : keyed) {
+                if (c == exclude) continue;
+                int v = pick(c);
+                refs += v;
+                c->sendShared(*variants[v], origin);
+            }
+            return refs;
+        }
+
+        for (uint32_t cipher : { FEAT_AES_256_GCM, FEAT_CHACHA20_POLY1305 }) {
+            if (!(ciphers & cipher)) continue;
+            // each variant is sealed the first time a member needs it
+            SharedBuffer sealed[2];
+            bool tried[2] = { false, false };
+            for (Client* c : keyed) {
+                if (c == exclude || c->getRoomCipher() != cipher) continue;
+                int v = pick(c);
+                refs += v;
+                const SharedBuffer& p = *variants[v];
+                if (!tried[v]) sealed[v] = sealFrame(cipher, *p);
+                tried[v] = true;
+                if (!sealed[v]) c->sendShared(p, origin);
+                else c->sendSealed((PacketType) (*p)[0], sealed[v]);
+            }
+        }
+        return refs;
+    }
+
+    void Room::rotateKey(const std::vector<Client*>& members) {
+        // mutex held. the key packets are queued ahead of anything sealed with the new key
+        std::unique_ptr<GroupKey> next(new GroupKey());
+        next->id = nextKeyId++;
+        if (RAND_bytes(next->key, sizeof(next->key)) != 1 ||
+            !next->aes.initRoom(FEAT_AES_256_GCM, next->key) ||
+            !next->chacha.initRoom(FEAT_CHACHA20_POLY1305, next->key)) {
+            // nobody may keep using the old one, members fall back to their own channels
+            Logger::error("could not create a key for room " + name);
+            groupKey.reset();
+            return;
+        }
+        // serialized once for everyone, and wiped once the last member's copy is sealed
+        RoomKeyPacket pkt;
+        pkt.roomName = name;
+        pkt.keyId = next->id;
+        memcpy(pkt.key, next->key, sizeof(pkt.key));
+        auto bytes = BufferPool::acquireSecret(1 + pkt.serializedSize());
+        bytes->push_back(pkt.TYPE);
+        pkt.serialize(*bytes);
+        OPENSSL_cleanse(pkt.key, sizeof(pkt.key));
+        SharedBuffer shared = std::move(bytes);
+        for (Client* c : members) c->sendShared(shared, Client::PRIVATE_ORIGIN);
+        groupKey = std::move(next);
+        keyStale = false;
+    }
+
+    SharedBuffer Room::sealFrame(uint32_t cipher, const std::vector<uint8_t>& payload) {
+        // mutex held, so counters go up in the order frames are queued
+        if (!groupKey) return nullptr;
+        size_t len = payload.size();
+        auto sealed = BufferPool::acquire(ROOM_FRAME_HEADER_SIZE + len);
+        sealed->resize(ROOM_FRAME_HEADER_SIZE + len);
+        std::vector<uint8_t>& frame = *sealed;
+        uint64_t counter = groupKey->counter++;
+        uint32_t netLen = htonl(len | ROOM_FRAME_FLAG);
+        uint32_t netId = htonl(groupKey->id);
+        memcpy(frame.data() + AEAD_TAG_SIZE, &netLen, 4);
+        memcpy(frame.data() + AEAD_TAG_SIZE + 4, &netId, 4);
+        for (int i = 0; i < 8; i++) frame[AEAD_TAG_SIZE + 8 + i] = (counter >> (56 - i * 8)) & 0xFF;
+
+        Aead& aead = cipher == FEAT_AES_256_GCM ? groupKey->aes : groupKey->chacha;
+        if (!aead.seal(counter, frame.data() + AEAD_TAG_SIZE, ROOM_FRAME_HEADER_SIZE - AEAD_TAG_SIZE,
+                       payload.data(), frame.data() + ROOM_FRAME_HEADER_SIZE, len, frame.data())) {
+            Logger::error("could not seal a broadcast in room " + name);
+            return nullptr;
+        }
+        return sealed;
     }
 
     std::vector<Client*> Room::getUsers() const {
         return clients;
     }
 
+    bool Room::hasImageRefMembers(Client* exclude) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t others = refMembers;
+        if (exclude && exclude->takesImageRefs() && std::find(clients.begin(), clients.end(), exclude) != clients.end()) others--;
+        return others > 0;
+    }
+
+    bool Room::allTakeImageStreams(Client* exclude) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t others = clients.size();
+        size_t taking = streamMembers;
+        if (exclude && std::find(clients.begin(), clients.end(), exclude) != clients.end()) {
+            others--;
+            if (exclude->takesImageStreams()) taking--;
+        }
+        return taking == others;
+    }
+
     std::vector<std::string> Room::getUserNames() const {
         std::lock_guard<std::mutex> lock(mutex);
         std::vector<std::string> names;
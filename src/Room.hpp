@@ -1,7 +1,9 @@
 #pragma once
 
+#include "Aead.hpp"
 #include "Packet.hpp"
 
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -16,16 +18,44 @@ namespace Retchat {
         Room(const std::string& name);
         void addClient(Client* client);
         void removeClient(Client* client);
-        void broadcast(const Packet& pkt, Client* exclude);
+        // a packet already serialized, type byte first. ref, if there is one, goes instead to
+        // the members that take image refs, and the return value is how many did
+        size_t broadcast(const SharedBuffer& payload, Client* exclude, const SharedBuffer& ref = nullptr);
         std::vector<Client*> getUsers() const;
+        // whether anyone but exclude takes image refs
+        bool hasImageRefMembers(Client* exclude) const;
+        // whether everyone but exclude takes image streams
+        bool allTakeImageStreams(Client* exclude) const;
         std::vector<std::string> getUserNames() const;
         const std::string& getName() const { return name; }
         bool hasClient(Client* client) const;
 
     private:
+        // members that negotiated room keys share one key, so a broadcast is sealed once per
+        // cipher in use instead of once per member. replaced lazily after anyone joins or leaves
+        struct GroupKey {
+            uint32_t id;
+            uint8_t key[32];
+            uint64_t counter = 0;
+            Aead aes;
+            Aead chacha;
+        };
+
+        void rotateKey(const std::vector<Client*>& members);
+        // seals type byte + payload into a frame every member on that cipher can share
+        SharedBuffer sealFrame(uint32_t cipher, const std::vector<uint8_t>& payload);
+
         std::string name;
         std::vector<Client*> clients;
+        size_t refMembers = 0;  // of them, the ones taking image refs
+        size_t streamMembers = 0;  // and the ones taking image streams
         mutable std::mutex mutex;
+        std::unique_ptr<GroupKey> groupKey;
+        bool keyStale = true;
+
+        // scratch for the broadcast being put together, mutex held. emptied after each one
+        // without giving back its capacity, so broadcasts to the same room don't allocate
+        std::vector<Client*> keyed;
     };
 
 }
\ No newline at end of file
@@ -1,7 +1,9 @@
 #include "Server.hpp"
 
+#include "BufferPool.hpp"
 #include "Client.hpp"
 #include "Commands.h"
+#include "CryptoContext.hpp"
 #include "DiffieHellman.hpp"
 #include "Logger.hpp"
 #include "Room.hpp"
@@ -20,79 +22,118 @@
 #include <unistd.h>
 
 
+constexpr size_t KEYPAIR_POOL_SIZE = 256;
+constexpr size_t MAX_PENDING_HANDSHAKES = 4096;
+
 namespace Retchat {
 
-    Server::Server(int p, const std::string& bansFile) : port(p), bansFilePath(bansFile) {
+    Server::Server(const ServerConfig& cfg) : config(cfg), admission(cfg.ipLimit, cfg.subnetLimit), memory(cfg.memoryLimit) {
+        if (config.imageCacheBytes) {
+            images.reset(new ImageCache(config.imageCacheBytes, config.imageSpillDir, config.imageSpillBytes, &memory));
+        }
         rooms.emplace("lobby", "lobby");
-        if (!bansFilePath.empty()) loadBans(bansFilePath);
+        if (!config.bansFile.empty()) loadBans(config.bansFile);
     }
 
     Server::~Server() {
         stop();
         if (consoleThread.joinable()) consoleThread.join();
-        close(listenFd);
     }
 
     void Server::stop() {
-        running = false;
-        // close listening socket to unblock accept
-        if (listenFd != -1) {
-            shutdown(listenFd, SHUT_RD);
-            close(listenFd);
-            listenFd = -1;
-        }
-        // disconnect all clients
-        std::lock_guard<std::mutex> lock(mutex);
-        for (auto& pair : clients) {
-            disconnectClient(pair.second, true);
+        // run() tears everything down once it wakes up
+        {
+            std::lock_guard<std::mutex> lock(stopMutex);
+            running = false;
         }
-        clients.clear();
-        rooms.clear();
+        stopCv.notify_all();
     }
 
     void Server::run() {
-        listenFd = socket(AF_INET, SOCK_STREAM, 0);
-        if (listenFd < 0) { perror("socket"); exit(1); }
-        int opt = 1;
-        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        struct sockaddr_in addr;
-        addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = INADDR_ANY;
-        addr.sin_port = htons(port);
-        if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); exit(1); }
-        if (listen(listenFd, 10) < 0) { perror("listen"); exit(1); }
-        Logger::info("server listening on port " + std::to_string(port));
+        unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+        unsigned int workers = config.workers ? config.workers : cores;
+
+        // timed before any other thread competes for the cpu, and not on some client's first flush
+        unsigned int sealLanes = CryptoContext::preferredLanes();
+
+        // handshakes get their own threads, filling the key pair pool before the first connection
+        unsigned int handshakeThreads = config.handshakeThreads ? config.handshakeThreads : std::max(1u, cores / 2);
+        handshakes.reset(new HandshakePool(handshakeThreads, KEYPAIR_POOL_SIZE, MAX_PENDING_HANDSHAKES));
+        handshakes->start();
+
+        for (unsigned int i = 0; i < workers; i++) {
+            loops.emplace_back(new EventLoop(i));
+            EventLoop* loop = loops.back().get();
+            if (config.pinCpus) loop->pinToCpu(i % cores);
+
+            acceptors.emplace_back(new Acceptor(this, loop, config.port));
+            Acceptor* acceptor = acceptors.back().get();
+            if (!acceptor->open()) exit(1);
+
+            loop->start();
+            loop->post([acceptor]() { acceptor->listen(); });
+        }
+        Logger::info("server listening on port " + std::to_string(config.port) +
+                     " with " + std::to_string(workers) + " worker(s)" + (config.pinCpus ? " pinned to cpus" : "") +
+                     ", " + std::to_string(handshakeThreads) + " handshake thread(s), sealing version 1 batches " +
+                     (sealLanes > 1 ? std::to_string(sealLanes) + " lanes wide" : "one frame at a time"));
 
         // start console thread
         consoleThread = std::thread(&Server::consoleLoop, this);
 
-        while (running) {
-            struct sockaddr_in clientAddr;
-            socklen_t addrLen = sizeof(clientAddr);
-            int clientFd = accept(listenFd, (sockaddr*)&clientAddr, &addrLen);
-            if (clientFd < 0) {
-                if (!running) break;
-                continue;
-            }
-            std::string ip = inet_ntoa(clientAddr.sin_addr);
-            if (isIpBanned(ip)) {
-                Logger::warn("blocked banned IP: " + ip);
-                close(clientFd);
-                continue;
-            }
-            Client* client = new Client(clientFd, this, ip);
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                clients[clientFd] = client;
+        {
+            std::unique_lock<std::mutex> lock(stopMutex);
+            stopCv.wait(lock, [this]() { return !running; });
+        }
+
+        // stop accepting, disconnect all clients, then join the loops before the remaining clients go away
+        for (size_t i = 0; i < loops.size(); i++) {
+            Acceptor* acceptor = acceptors[i].get();
+            loops[i]->post([acceptor]() { acceptor->close(); });
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& pair : clients) {
+                disconnectClient(pair.second, true);
             }
-            client->start();
-            Logger::info("new connection (fd=" + std::to_string(clientFd) + ", ip=" + ip + "): " + client->getName() + " joined " + client->getRoom());
         }
+        for (auto& loop : loops) loop->stop();
+        handshakes->stop();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& pair : clients) delete pair.second;
+        clients.clear();
+        rooms.clear();
+    }
+
+    void Server::acceptClient(int clientFd, const sockaddr_in& addr, EventLoop* loop) {
+        // before anything else, a refused connection should cost as little as possible
+        if (admission.admit(addr.sin_addr.s_addr) != AdmissionControl::Verdict::Admit) {
+            close(clientFd);
+            return;
+        }
+        std::string ip = inet_ntoa(addr.sin_addr);
+        if (isIpBanned(ip)) {
+            Logger::warn("blocked banned IP: " + ip);
+            admission.release(addr.sin_addr.s_addr);
+            close(clientFd);
+            return;
+        }
+        Client* client = new Client(clientFd, this, loop, ip);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            clients[clientFd] = client;
+        }
+        client->start();
+        Logger::info("new connection (fd=" + std::to_string(clientFd) + ", ip=" + ip + ", worker=" + std::to_string(loop->getId()) + "): " + client->getName() + " joined " + client->getRoom());
     }
 
     void Server::removeClient(Client* client) {
         int cfd = client->getSockfd();
         std::string cname = client->getName();
+        struct in_addr caddr;
+        if (inet_pton(AF_INET, client->getIp().c_str(), &caddr) == 1) admission.release(caddr.s_addr);
+        // out of the index first (if it got that far), so no lookup can still be holding it by the time it's deleted
+        nicks.remove(cname, client);
         std::lock_guard<std::mutex> lock(mutex);
         auto it = clients.find(cfd);
         if (it != clients.end()) {
@@ -103,23 +144,31 @@ namespace Retchat {
         Logger::info(cname + "(" + std::to_string(cfd) + ") left.");
     }
 
-    void Server::broadcastToRoom(const std::string& roomName, Client* exclude, const Packet& pkt) {
-        getRoom(roomName).broadcast(pkt, exclude);
+    size_t Server::broadcastToRoom(const std::string& roomName, Client* exclude, const SharedBuffer& payload,
+                                   const SharedBuffer& ref) {
+        return getRoom(roomName).broadcast(payload, exclude, ref);
     }
 
-    void Server::sendImageDm(Client* from, const std::string& targetNick, const ImagePacket& imgPkt) {
-        std::lock_guard<std::mutex> lock(mutex);
-        for (auto& pair : clients) {
-            if (pair.second->getName() == targetNick) {
-                pair.second->sendPacket(imgPkt);
-                return;
-            }
-        }
+    size_t Server::sendImageDm(Client* from, std::string_view targetNick, const ImageView& img, const SharedBuffer& ref) {
+        ImageRefView refView;
+        bool hasRef = ref && refView.deserialize(ref->data() + 1, ref->size() - 1);
+        bool byRef = false;
+        bool found = nicks.with(targetNick, [&](Client* c) {
+            byRef = hasRef && c->takesImageRefs();
+            if (byRef) c->allowFetch(refView.hash);
+            c->sendShared(byRef ? ref : img.serializeShared(), Client::PRIVATE_ORIGIN);
+        });
+        if (found) return byRef;
         SystemPacket err;
         err.isError = true;
         err.code = MSG_DM_TARGET_NOT_FOUND;
-        err.params = { targetNick };
+        err.params = { std::string(targetNick) };
         from->sendPacket(err);
+        return 0;
+    }
+
+    bool Server::sendToNick(std::string_view nick, const SharedBuffer& payload) {
+        return nicks.with(nick, [&](Client* c) { c->sendShared(payload, Client::PRIVATE_ORIGIN); });
     }
 
     bool Server::isNicknameTaken(const std::string& nick, const std::string& roomName, Client* exclude) {
@@ -177,18 +226,12 @@ namespace Retchat {
                 if (isNum) {
                     kickClient(std::stoi(arg));
                 } else {
-                    std::lock_guard<std::mutex> lock(mutex);
-                    bool found = false;
-                    for (auto& pair : clients) {
-                        if (pair.second->getName() == arg) {
-                            Logger::info("kicking " + arg);
-                            KickPacket kp; kp.reason = "pa tu casa";
-                            pair.second->sendPacket(kp);
-                            disconnectClient(pair.second, false);
-                            found = true;
-                            break;
-                        }
-                    }
+                    bool found = nicks.with(arg, [&](Client* c) {
+                        Logger::info("kicking " + arg);
+                        KickPacket kp; kp.reason = "pa tu casa";
+                        c->sendPacket(kp);
+                        disconnectClient(c, false);
+                    });
                     if (!found) Logger::warn("user \"" + arg + "\" not found.");
                 }
 
@@ -222,8 +265,40 @@ namespace Retchat {
                     int fd; iss >> fd;
                     if (!iss.fail()) Logger::info(queryClient(fd));
                     else printUsage(cmd);
+                } else if (sub == "buffers") {
+                    Logger::info(BufferPool::getSummary());
+                } else if (sub == "images") {
+                    Logger::info(images ? images->getSummary() : "images: cache turned off");
+                } else if (sub == "memory") {
+                    Logger::info(memory.getSummary());
+                } else if (sub == "ip") {
+                    std::string ip; iss >> ip;
+                    struct in_addr addr;
+                    if (inet_pton(AF_INET, ip.c_str(), &addr) == 1) Logger::info(admission.queryAddress(addr.s_addr));
+                    else printUsage(cmd);
                 } else { printUsage(cmd); }
 
+            } else if (cmd == CMD_LIMIT) {
+                std::string scope, value; iss >> scope >> value;
+                AdmissionLimit limit;
+                MemoryLimit memoryLimit;
+                if (scope.empty()) {
+                    Logger::info(admission.getSummary());
+                } else if (scope == "memory") {
+                    if (!parseMemoryLimit(value, memoryLimit)) {
+                        printUsage(cmd);
+                        continue;
+                    }
+                    memory.setLimit(memoryLimit);
+                    Logger::info("updated memory limit: " + value);
+                } else if ((scope != "ip" && scope != "subnet") || !parseAdmissionLimit(value, limit)) {
+                    printUsage(cmd);
+                } else {
+                    if (scope == "ip") admission.setIpLimit(limit);
+                    else admission.setSubnetLimit(limit);
+                    Logger::info("updated " + scope + " limit: " + value);
+                }
+
             } else if (cmd == CMD_LIST) {
                 std::string sub; iss >> sub;
                 if (sub == "rooms")   Logger::info(listRooms());
@@ -246,21 +321,20 @@ namespace Retchat {
             DisconnectPacket dp;
             client->sendPacket(dp);
         }
-        shutdown(client->getSockfd(), SHUT_RDWR);
-        close(client->getSockfd());
+        client->disconnect();
     }
 
     void Server::kickClient(int fd, const std::string& reason) {
         std::lock_guard<std::mutex> lock(mutex);
-        for (auto& pair : clients) {
-            if (pair.second->getSockfd() == fd) {
-                Logger::info("kicking " + pair.second->getName() + " (fd=" + std::to_string(fd) + "): " + reason);
-                KickPacket kp;
-                kp.reason = reason;
-                pair.second->sendPacket(kp);
-                disconnectClient(pair.second, false);
-                return;
-            }
+        auto it = clients.find(fd);
+        if (it != clients.end()) {
+            Client* c = it->second;
+            Logger::info("kicking " + c->getName() + " (fd=" + std::to_string(fd) + "): " + reason);
+            KickPacket kp;
+            kp.reason = reason;
+            c->sendPacket(kp);
+            disconnectClient(c, false);
+            return;
         }
         Logger::warn("client with fd=" + std::to_string(fd) + " not found.");
     }
@@ -269,51 +343,51 @@ namespace Retchat {
         {
             std::lock_guard<std::mutex> lock(mutex);
             bannedNicks.insert(nickname);
-            // kick any currently connected client with that nick
-            for (auto& pair : clients) {
-                if (pair.second->getName() == nickname) {
-                    Logger::info("banning and kicking " + nickname);
-                    BanPacket bp;
-                    bp.reason = reason;
-                    pair.second->sendPacket(bp);
-                    disconnectClient(pair.second, false);
-                }
-            }
         }
+        // kick any currently connected client with that nick
+        BanPacket bp;
+        bp.reason = reason;
+        SharedBuffer ban = bp.serializeShared();
+        nicks.withAll(nickname, [&](Client* c) {
+            Logger::info("banning and kicking " + nickname);
+            c->sendShared(ban);
+            disconnectClient(c, false);
+        });
         Logger::info("banned nickname: " + nickname);
-        if (!bansFilePath.empty()) saveBans(bansFilePath);
+        if (!config.bansFile.empty()) saveBans(config.bansFile);
     }
 
     void Server::banIp(const std::string& ip, const std::string& reason) {
         {
             std::lock_guard<std::mutex> lock(mutex);
             bannedIps.insert(ip);
+            BanPacket bp;
+            bp.reason = reason;
+            SharedBuffer ban = bp.serializeShared();
             for (auto& pair : clients) {
                 if (pair.second->getIp() == ip) {
                     Logger::info("banning and kicking IP " + ip);
-                    BanPacket bp;
-                    bp.reason = reason;
-                    pair.second->sendPacket(bp);
+                    pair.second->sendShared(ban);
                     disconnectClient(pair.second, false);
                 }
             }
         }
         Logger::info("banned IP: " + ip);
-        if (!bansFilePath.empty()) saveBans(bansFilePath);
+        if (!config.bansFile.empty()) saveBans(config.bansFile);
     }
 
     void Server::unbanNickname(const std::string& nick) {
         std::lock_guard<std::mutex> lock(mutex);
         bannedNicks.erase(nick);
         Logger::info("unbanned nickname: " + nick);
-        if (!bansFilePath.empty()) saveBans(bansFilePath);
+        if (!config.bansFile.empty()) saveBans(config.bansFile);
     }
 
     void Server::unbanIp(const std::string& ip) {
         std::lock_guard<std::mutex> lock(mutex);
         bannedIps.erase(ip);
         Logger::info("unbanned IP: " + ip);
-        if (!bansFilePath.empty()) saveBans(bansFilePath);
+        if (!config.bansFile.empty()) saveBans(config.bansFile);
     }
 
     bool Server::isIpBanned(const std::string& ip) const {
@@ -335,22 +409,17 @@ namespace Retchat {
         return result;
     }
 
-    void Server::sendDm(Client* from, const std::string& targetNick, const std::string& text) {
-        std::lock_guard<std::mutex> lock(mutex);
-        for (auto& pair : clients) {
-            if (pair.second->getName() == targetNick) {
-                DmMsgPacket dm;
-                dm.senderNick = from->getName();
-                dm.text = text;
-                pair.second->sendPacket(dm);
-                return;
-            }
-        }
+    void Server::sendDm(Client* from, std::string_view targetNick, std::string_view text) {
+        std::string senderNick = from->getName();
+        DmMsgView msg;
+        msg.senderNick = senderNick;
+        msg.text = text;
+        if (sendToNick(targetNick, msg.serializeShared())) return;
         // target not found
         SystemPacket err;
         err.isError = true;
         err.code = MSG_DM_TARGET_NOT_FOUND;
-        err.params = { targetNick };
+        err.params = { std::string(targetNick) };
         from->sendPacket(err);
     }
 
@@ -417,20 +486,94 @@ namespace Retchat {
             return "client with fd " + std::to_string(fd) + " not found.";
         }
         Client* c = it->second;
-        return "fd=" + std::to_string(fd) + " | name=" + c->getName() + " | room=" + c->getRoom() + " | ip=" + c->getIp();
+        return "fd=" + std::to_string(fd) + " | name=" + c->getName() + " | room=" + c->getRoom() + " | ip=" + c->getIp() +
+               " | queued=" + std::to_string(c->getQueuedBytes()) + "B | dropped=" + std::to_string(c->getDroppedPackets()) +
+               " | compression: " + c->getCompressionSummary();
     }
 }
 
 
 // -------- MAIN ENTRYPOINT --------
 
+// "<rate>/<burst>/<max open>", or "off" for no limit at all
+bool Retchat::parseAdmissionLimit(const std::string& value, AdmissionLimit& out) {
+    if (value == "off") { out = AdmissionLimit(); return true; }
+    double rate, burst;
+    unsigned int max;
+    char extra;
+    if (sscanf(value.c_str(), "%lf/%lf/%u%c", &rate, &burst, &max, &extra) != 3 || rate < 0 || burst < 0) return false;
+    out.rate = rate;
+    out.burst = burst;
+    out.maxConnections = max;
+    return true;
+}
+
+// "<soft>/<hard>" in bytes, or "off" to never push back
+bool Retchat::parseMemoryLimit(const std::string& value, MemoryLimit& out) {
+    if (value == "off") { out = MemoryLimit(); return true; }
+    unsigned long long soft, hard;
+    char extra;
+    if (sscanf(value.c_str(), "%llu/%llu%c", &soft, &hard, &extra) != 2 || soft > hard) return false;
+    out.soft = soft;
+    out.hard = hard;
+    return true;
+}
+
 int main(int argc, char** argv) {
-    int port = (argc > 1) ? atoi(argv[1]) : Retchat::DEFAULT_PORT;
-    std::string bansFile = (argc > 2) ? argv[2] : Retchat::DEFAULT_BANS_FILE;
+    // first thing, OpenSSL only takes a new allocator before it has allocated anything
+    Retchat::BufferPool::countCryptoAllocations();
+    Retchat::ServerConfig config;
+    int positional = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc) {
+            config.workers = (unsigned int) atoi(argv[++i]);
+        } else if (arg == "--pin-cpus") {
+            config.pinCpus = true;
+        } else if (arg == "--handshake-threads" && i + 1 < argc) {
+            config.handshakeThreads = (unsigned int) atoi(argv[++i]);
+        } else if (arg == "--batch-window" && i + 1 < argc) {
+            config.batchWindowUs = (unsigned int) atoi(argv[++i]);
+        } else if (arg == "--compress-min" && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (value == "off") config.compress = false;
+            else config.compressMinBytes = (size_t) strtoull(value.c_str(), nullptr, 10);
+        } else if (arg == "--image-cache" && i + 1 < argc) {
+            config.imageCacheBytes = (size_t) strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--image-spill" && i + 1 < argc) {
+            config.imageSpillDir = argv[++i];
+        } else if (arg == "--image-spill-bytes" && i + 1 < argc) {
+            config.imageSpillBytes = (size_t) strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--memory-limit" && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (!Retchat::parseMemoryLimit(value, config.memoryLimit)) {
+                Logger::warn("invalid " + arg + " \"" + value + "\", expected <soft>/<hard> in bytes or off");
+            }
+        } else if (arg == "--queue-bytes" && i + 1 < argc) {
+            config.outQueueBytes = (size_t) strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--overflow" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            if (policy == "drop") config.overflowPolicy = Retchat::OverflowPolicy::Drop;
+            else if (policy == "coalesce") config.overflowPolicy = Retchat::OverflowPolicy::Coalesce;
+            else if (policy == "disconnect") config.overflowPolicy = Retchat::OverflowPolicy::Disconnect;
+            else Logger::warn("unknown overflow policy: " + policy + ", using drop");
+        } else if ((arg == "--ip-limit" || arg == "--subnet-limit") && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (!Retchat::parseAdmissionLimit(value, arg == "--ip-limit" ? config.ipLimit : config.subnetLimit)) {
+                Logger::warn("invalid " + arg + " \"" + value + "\", expected <rate>/<burst>/<max> or off");
+            }
+        } else if (positional == 0) {
+            config.port = atoi(argv[i]); positional++;
+        } else if (positional == 1) {
+            config.bansFile = arg; positional++;
+        } else {
+            Logger::warn("ignoring unknown argument: " + arg);
+        }
+    }
     std::signal(SIGPIPE, SIG_IGN);
     Retchat::DH::init();
-    Retchat::Server server(port, bansFile);
+    Retchat::Server server(config);
     server.run();
     Retchat::DH::free();
     return 0;
-}
\ No newline at end of file
+}
@@ -1,31 +1,106 @@
 #pragma once
 
+#include "Acceptor.hpp"
+#include "Admission.hpp"
+#include "EventLoop.hpp"
+#include "HandshakePool.hpp"
+#include "ImageCache.hpp"
+#include "MemoryGovernor.hpp"
+#include "NickIndex.hpp"
 #include "Room.hpp"
 
+#include <atomic>
+#include <condition_variable>
 #include <map>
+#include <memory>
 #include <string>
 #include <mutex>
+#include <netinet/in.h>
 #include <thread>
 #include <unordered_set>
+#include <vector>
 
 
 namespace Retchat {
 
     constexpr int DEFAULT_PORT = 6677;
     const std::string DEFAULT_BANS_FILE = "bans.txt";
+    constexpr size_t DEFAULT_OUT_QUEUE_BYTES = 8 * 1024 * 1024;  // 8 MB
+    // how long a client that takes batch frames has its outbound packets held back, so they
+    // can go out together instead of one frame each
+    constexpr unsigned int DEFAULT_BATCH_WINDOW_US = 1000;
+    // frames smaller than this go out uncompressed to clients that take compression
+    constexpr size_t DEFAULT_COMPRESS_MIN_BYTES = 64;
+    // images kept in memory for clients that take image refs, and on disk once pushed out of it
+    constexpr size_t DEFAULT_IMAGE_CACHE_BYTES = 64 * 1024 * 1024;  // 64 MB
+    constexpr size_t DEFAULT_IMAGE_SPILL_BYTES = 1024 * 1024 * 1024;  // 1 GB
+    // receive buffers, outbound queues and cached images, all clients together
+    constexpr MemoryLimit DEFAULT_MEMORY_LIMIT = { 512 * 1024 * 1024, 1024 * 1024 * 1024 };  // 512 MB / 1 GB
+
+    // new connections per second, burst, and open connections, per address and per /24
+    constexpr AdmissionLimit DEFAULT_IP_LIMIT = { 20, 40, 64 };
+    constexpr AdmissionLimit DEFAULT_SUBNET_LIMIT = { 100, 200, 512 };
+
+    // what a client's outbound queue does when a message would push it over its budget
+    enum class OverflowPolicy {
+        Drop,       // drop the new message
+        Coalesce,   // drop the oldest queued messages to make room for it
+        Disconnect  // evict the slow consumer
+    };
+
+    struct ServerConfig {
+        int port = DEFAULT_PORT;
+        std::string bansFile = DEFAULT_BANS_FILE;
+        unsigned int workers = 0;  // 0 = one per core
+        bool pinCpus = false;
+        unsigned int handshakeThreads = 0;  // 0 = half the cores
+        unsigned int batchWindowUs = DEFAULT_BATCH_WINDOW_US;  // 0 = only batch what's already queued
+        bool compress = true;  // offer compression to version 2 clients
+        size_t compressMinBytes = DEFAULT_COMPRESS_MIN_BYTES;
+        size_t imageCacheBytes = DEFAULT_IMAGE_CACHE_BYTES;  // 0 = no cache, image refs aren't offered
+        std::string imageSpillDir;  // empty = memory only
+        size_t imageSpillBytes = DEFAULT_IMAGE_SPILL_BYTES;
+        size_t outQueueBytes = DEFAULT_OUT_QUEUE_BYTES;
+        OverflowPolicy overflowPolicy = OverflowPolicy::Drop;
+        AdmissionLimit ipLimit = DEFAULT_IP_LIMIT;
+        AdmissionLimit subnetLimit = DEFAULT_SUBNET_LIMIT;
+        MemoryLimit memoryLimit = DEFAULT_MEMORY_LIMIT;
+    };
+
+    // "<rate>/<burst>/<max>" or "off", as taken by --ip-limit, --subnet-limit and the limit command
+    bool parseAdmissionLimit(const std::string& value, AdmissionLimit& out);
+    // "<soft>/<hard>" in bytes or "off", as taken by --memory-limit and the limit command
+    bool parseMemoryLimit(const std::string& value, MemoryLimit& out);
 
     class Client;
 
     class Server {
     public:
-        Server(int port, const std::string& bansFile = "bans.txt");
+        Server(const ServerConfig& config);
         ~Server();
         void run();
         void stop();
-
+        const ServerConfig& getConfig() const { return config; }
+        HandshakePool& getHandshakePool() { return *handshakes; }
+        AdmissionControl& getAdmission() { return admission; }
+        ImageCache* getImageCache() { return images.get(); }  // null when turned off
+        MemoryGovernor& getMemory() { return memory; }
+        NickIndex& getNicks() { return nicks; }
+
+        void acceptClient(int fd, const sockaddr_in& addr, EventLoop* loop);
         void removeClient(Client* client);
-        void broadcastToRoom(const std::string& roomName, Client* exclude, const Packet& pkt);
-        void sendImageDm(Client* from, const std::string& targetNick, const ImagePacket& imgPkt);
+        // serialized once, every member's queue shares the same bytes
+        template <typename P>
+        void broadcastToRoom(const std::string& roomName, Client* exclude, const P& pkt) {
+            broadcastToRoom(roomName, exclude, pkt.serializeShared());
+        }
+        // ref, if there is one, goes instead to the members taking image refs. returns how many did
+        size_t broadcastToRoom(const std::string& roomName, Client* exclude, const SharedBuffer& payload,
+                               const SharedBuffer& ref = nullptr);
+        // the same for one recipient
+        size_t sendImageDm(Client* from, std::string_view targetNick, const ImageView& img, const SharedBuffer& ref = nullptr);
+        // false if nobody has that nick. never compressed, whatever it carries is private
+        bool sendToNick(std::string_view nick, const SharedBuffer& payload);
         bool isNicknameTaken(const std::string& nick, const std::string& roomName, Client* exclude);
         
         Room& getRoom(const std::string& name);
@@ -42,7 +117,7 @@ namespace Retchat {
         bool isNicknameBanned(const std::string& nick) const;
         bool isIpBanned(const std::string& ip) const;
 
-        void sendDm(Client* from, const std::string& targetNick, const std::string& text);
+        void sendDm(Client* from, std::string_view targetNick, std::string_view text);
 
         std::string listClients() const;
         std::string listRooms() const;
@@ -54,16 +129,28 @@ namespace Retchat {
         void saveBans(const std::string& path) const;
 
     private:
-        int port;
-        int listenFd = -1;
+        ServerConfig config;
         std::map<int, Client*> clients;
+        // the same clients by nick, with locks of its own
+        NickIndex nicks;
         std::map<std::string, Room> rooms;
         mutable std::mutex mutex;
-        bool running = true;
+        std::atomic<bool> running{true};
+        std::mutex stopMutex;
+        std::condition_variable stopCv;
+
+        // one worker per core: its own listener and its own event loop owning every socket it accepted
+        std::vector<std::unique_ptr<EventLoop>> loops;
+        std::vector<std::unique_ptr<Acceptor>> acceptors;
+        // declared after the loops so it's gone before them, workers post into the loops
+        std::unique_ptr<HandshakePool> handshakes;
 
         std::unordered_set<std::string> bannedNicks;
         std::unordered_set<std::string> bannedIps;
-        std::string bansFilePath;
+
+        AdmissionControl admission;
+        MemoryGovernor memory;
+        std::unique_ptr<ImageCache> images;
 
         std::thread consoleThread;
         void consoleLoop();
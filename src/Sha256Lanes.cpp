@@ -0,0 +1,229 @@
+#include "Sha256Lanes.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+namespace Retchat {
+
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    typedef uint32_t V8 __attribute__((vector_size(32)));
+    typedef uint32_t V16 __attribute__((vector_size(64)));
+
+    // a macro, vector values crossing a function boundary would change the ABI
+    #define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+    // written once over GCC vector types, each kernel below instantiates it for its own width
+    template <typename V>
+    static inline __attribute__((always_inline)) void compress(uint32_t* state, const uint32_t* block) {
+        V s[8], w[16];
+        memcpy(s, state, sizeof(s));
+        memcpy(w, block, sizeof(w));
+        V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int i = 0; i < 64; i++) {
+            if (i >= 16) {
+                V w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                V s0 = ROTR(w15, 7) ^ ROTR(w15, 18) ^ (w15 >> 3);
+                V s1 = ROTR(w2, 17) ^ ROTR(w2, 19) ^ (w2 >> 10);
+                w[i & 15] += s0 + w[(i - 7) & 15] + s1;
+            }
+            V t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i & 15];
+            V t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+        s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+        memcpy(state, s, sizeof(s));
+    }
+
+    static inline uint32_t load32(const uint8_t* p) {
+        return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+    }
+
+    // a 32-byte message after a 64-byte block, in bits
+    constexpr uint32_t HMAC_BLOCK_BITS = (64 + 32) * 8;
+
+    static void hmacBlockPlain(const uint32_t inner[8], const uint32_t outer[8], const uint8_t message[32], uint8_t out[32]) {
+        uint32_t w[16] = {}, h[8];
+        for (int i = 0; i < 8; i++) w[i] = load32(message + i * 4);
+        w[8] = 0x80000000;
+        w[15] = HMAC_BLOCK_BITS;
+        memcpy(h, inner, sizeof(h));
+        compress<uint32_t>(h, w);
+        memcpy(w, h, sizeof(h));
+        memcpy(h, outer, sizeof(h));
+        compress<uint32_t>(h, w);
+        for (int i = 0; i < 8; i++) {
+            out[i * 4] = h[i] >> 24;
+            out[i * 4 + 1] = h[i] >> 16;
+            out[i * 4 + 2] = h[i] >> 8;
+            out[i * 4 + 3] = h[i];
+        }
+    }
+
+    static void blocksPlain(uint32_t state[8], const uint8_t* data, size_t blocks) {
+        uint32_t w[16];
+        for (; blocks > 0; blocks--, data += 64) {
+            for (int i = 0; i < 16; i++) w[i] = load32(data + i * 4);
+            compress<uint32_t>(state, w);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("avx2")))
+    void sha256Compress8(uint32_t state[8 * 8], const uint32_t block[16 * 8]) {
+        compress<V8>(state, block);
+    }
+
+    __attribute__((target("avx512f")))
+    void sha256Compress16(uint32_t state[8 * 16], const uint32_t block[16 * 16]) {
+        compress<V16>(state, block);
+    }
+
+    unsigned int sha256LaneCount() {
+        static const unsigned int lanes = __builtin_cpu_supports("avx512f") ? 16 :
+                                          __builtin_cpu_supports("avx2") ? 8 : 1;
+        return lanes;
+    }
+
+    static bool hasShaExtensions() {
+        static const bool sha = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+        return sha;
+    }
+
+    // the SHA extensions keep the state as ABEF and CDGH, two rounds per sha256rnds2
+    __attribute__((target("sha,sse4.1"), always_inline))
+    static inline void loadSha(const uint32_t state[8], __m128i& s0, __m128i& s1) {
+        __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xB1);  // CDAB
+        s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1B);           // EFGH
+        s0 = _mm_alignr_epi8(tmp, s1, 8);      // ABEF
+        s1 = _mm_blend_epi16(s1, tmp, 0xF0);   // CDGH
+    }
+
+    // back to words 0-3 and 4-7 in host order, which is also how they go into a message block
+    __attribute__((target("sha,sse4.1"), always_inline))
+    static inline void unloadSha(__m128i s0, __m128i s1, __m128i& lo, __m128i& hi) {
+        __m128i tmp = _mm_shuffle_epi32(s0, 0x1B);   // FEBA
+        s1 = _mm_shuffle_epi32(s1, 0xB1);            // DCHG
+        lo = _mm_blend_epi16(tmp, s1, 0xF0);         // DCBA
+        hi = _mm_alignr_epi8(s1, tmp, 8);            // HGFE
+    }
+
+    // one compression of the block whose first 16 words are in w
+    __attribute__((target("sha,sse4.1"), always_inline))
+    static inline void roundsSha(__m128i& s0, __m128i& s1, __m128i w[4]) {
+        __m128i abef = s0, cdgh = s1;
+        #pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            if (i >= 4) {
+                __m128i w7 = _mm_alignr_epi8(w[(i - 1) & 3], w[(i - 2) & 3], 4);
+                w[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i - 3) & 3]), w7),
+                                                w[(i - 1) & 3]);
+            }
+            __m128i msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i*) &K[i * 4]));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+        s0 = _mm_add_epi32(s0, abef);
+        s1 = _mm_add_epi32(s1, cdgh);
+    }
+
+    // data is either big-endian bytes or words already in host order
+    template <bool bytes>
+    __attribute__((target("sha,sse4.1")))
+    static void blocksSha(uint32_t state[8], const uint8_t* data, size_t blocks) {
+        const __m128i order = bytes ? _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL)
+                                    : _mm_set_epi64x(0x0f0e0d0c0b0a0908ULL, 0x0706050403020100ULL);
+        __m128i s0, s1, w[4];
+        loadSha(state, s0, s1);
+        for (; blocks > 0; blocks--, data += 64) {
+            for (int i = 0; i < 4; i++) w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + i * 16)), order);
+            roundsSha(s0, s1, w);
+        }
+        unloadSha(s0, s1, w[0], w[1]);
+        _mm_storeu_si128((__m128i*) &state[0], w[0]);
+        _mm_storeu_si128((__m128i*) &state[4], w[1]);
+    }
+
+    // the inner digest never leaves the registers on its way into the outer block
+    __attribute__((target("sha,sse4.1")))
+    static void hmacBlockSha(const uint32_t inner[8], const uint32_t outer[8], const uint8_t message[32], uint8_t out[32]) {
+        const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+        const __m128i pad0 = _mm_set_epi32(0, 0, 0, 0x80000000);
+        const __m128i pad1 = _mm_set_epi32(HMAC_BLOCK_BITS, 0, 0, 0);
+        __m128i s0, s1, w[4];
+        loadSha(inner, s0, s1);
+        w[0] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) &message[0]), byteSwap);
+        w[1] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) &message[16]), byteSwap);
+        w[2] = pad0;
+        w[3] = pad1;
+        roundsSha(s0, s1, w);
+        __m128i lo, hi;
+        unloadSha(s0, s1, lo, hi);
+        loadSha(outer, s0, s1);
+        w[0] = lo;
+        w[1] = hi;
+        w[2] = pad0;
+        w[3] = pad1;
+        roundsSha(s0, s1, w);
+        unloadSha(s0, s1, lo, hi);
+        _mm_storeu_si128((__m128i*) &out[0], _mm_shuffle_epi8(lo, byteSwap));
+        _mm_storeu_si128((__m128i*) &out[16], _mm_shuffle_epi8(hi, byteSwap));
+    }
+
+    void sha256Blocks(uint32_t state[8], const uint8_t* data, size_t blocks) {
+        if (hasShaExtensions()) blocksSha<true>(state, data, blocks);
+        else blocksPlain(state, data, blocks);
+    }
+
+    void sha256Compress1(uint32_t state[8], const uint32_t block[16]) {
+        if (hasShaExtensions()) blocksSha<false>(state, (const uint8_t*) block, 1);
+        else compress<uint32_t>(state, block);
+    }
+
+    void sha256HmacBlock(const uint32_t inner[8], const uint32_t outer[8], const uint8_t message[32], uint8_t out[32]) {
+        if (hasShaExtensions()) hmacBlockSha(inner, outer, message, out);
+        else hmacBlockPlain(inner, outer, message, out);
+    }
+#else
+    // GCC lowers the vector types to whatever the target has, they just never get picked
+    void sha256Compress8(uint32_t state[8 * 8], const uint32_t block[16 * 8]) {
+        compress<V8>(state, block);
+    }
+
+    void sha256Compress16(uint32_t state[8 * 16], const uint32_t block[16 * 16]) {
+        compress<V16>(state, block);
+    }
+
+    unsigned int sha256LaneCount() {
+        return 1;
+    }
+
+    void sha256Blocks(uint32_t state[8], const uint8_t* data, size_t blocks) {
+        blocksPlain(state, data, blocks);
+    }
+
+    void sha256Compress1(uint32_t state[8], const uint32_t block[16]) {
+        compress<uint32_t>(state, block);
+    }
+
+    void sha256HmacBlock(const uint32_t inner[8], const uint32_t outer[8], const uint8_t message[32], uint8_t out[32]) {
+        hmacBlockPlain(inner, outer, message, out);
+    }
+#endif
+
+}
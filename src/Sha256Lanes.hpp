@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace Retchat {
+
+    // SHA-256 compressions of independent blocks side by side, one message per SIMD lane.
+    // words are stored lane-minor, word i of lane l at [i * lanes + l], and the state is
+    // updated in place exactly like one compression per lane would. only call a kernel the
+    // cpu supports
+    void sha256Compress8(uint32_t state[8 * 8], const uint32_t block[16 * 8]);     // AVX2
+    void sha256Compress16(uint32_t state[8 * 16], const uint32_t block[16 * 16]);  // AVX-512
+    // whole 64-byte blocks of one message into state, big-endian as they come. with the SHA
+    // extensions where the cpu has them, in plain C otherwise
+    void sha256Blocks(uint32_t state[8], const uint8_t* data, size_t blocks);
+    // the same for one block already split into words
+    void sha256Compress1(uint32_t state[8], const uint32_t block[16]);
+    // HMAC-SHA256 of a 32-byte message, from the chaining values the key's inner and outer pad
+    // blocks left. out may be message
+    void sha256HmacBlock(const uint32_t inner[8], const uint32_t outer[8], const uint8_t message[32], uint8_t out[32]);
+
+    // the widest kernel this cpu can run: 16, 8, or 1 for plain one-at-a-time hashing. whether
+    // it actually beats one-at-a-time hashing depends on the cpu, see CryptoContext::preferredLanes
+    unsigned int sha256LaneCount();
+
+}
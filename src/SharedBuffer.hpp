@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+namespace Retchat {
+
+    // bytes that are never modified once built, so any number of connections can queue and
+    // send the same ones, e.g. a broadcast serialized once or a frame sealed with a room key
+    using SharedBuffer = std::shared_ptr<const std::vector<uint8_t>>;
+
+}
@@ -0,0 +1,177 @@
+#include "TimerWheel.hpp"
+
+#include <algorithm>
+
+
+constexpr int TICK_MS = 10;
+
+namespace Retchat {
+
+    Timer::~Timer() {
+        if (isScheduled()) wheel->cancel(*this);
+    }
+
+    TimerWheel::TimerWheel() : start(Clock::now()) {}
+
+    TimerWheel::~TimerWheel() {
+        // leave any timer that outlives the wheel unscheduled rather than dangling
+        for (Timer*& head : slots) {
+            while (head) {
+                Timer* t = head;
+                head = t->next;
+                t->next = nullptr;
+                t->pprev = nullptr;
+                t->wheel = nullptr;
+            }
+        }
+    }
+
+    int TimerWheel::levelShift(int level) const {
+        return level == 0 ? 0 : LEVEL0_BITS + (level - 1) * LEVELN_BITS;
+    }
+
+    int TimerWheel::levelSlots(int level) const {
+        return level == 0 ? LEVEL0_SLOTS : LEVELN_SLOTS;
+    }
+
+    Timer*& TimerWheel::slotHead(int level, int slot) {
+        int base = level == 0 ? 0 : LEVEL0_SLOTS + (level - 1) * LEVELN_SLOTS;
+        return slots[base + slot];
+    }
+
+    uint64_t TimerWheel::toTicks(Clock::time_point t) const {
+        return (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>(t - start).count() / TICK_MS;
+    }
+
+    void TimerWheel::schedule(Timer& timer, std::chrono::milliseconds delay) {
+        if (timer.isScheduled()) unlink(timer);
+        else count++;
+
+        // the longest delay the top level can represent
+        constexpr uint64_t MAX_TICKS = ((uint64_t) 1 << (LEVEL0_BITS + (LEVELS - 1) * LEVELN_BITS)) - 1;
+        uint64_t ticks = std::max<int64_t>(1, (delay.count() + TICK_MS - 1) / TICK_MS);
+        uint64_t base = std::max(currentTick, toTicks(Clock::now()));
+        timer.wheel = this;
+        timer.expiry = base + std::min(ticks, MAX_TICKS - (base - currentTick));
+        insert(timer);
+    }
+
+    void TimerWheel::cancel(Timer& timer) {
+        if (!timer.isScheduled()) return;
+        unlink(timer);
+        count--;
+    }
+
+    void TimerWheel::insert(Timer& timer) {
+        uint64_t delta = timer.expiry > currentTick ? timer.expiry - currentTick : 0;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= ((uint64_t) 1 << levelShift(level + 1))) level++;
+        int slot = (int) ((std::max(timer.expiry, currentTick) >> levelShift(level)) & (levelSlots(level) - 1));
+
+        Timer*& head = slotHead(level, slot);
+        timer.next = head;
+        if (head) head->pprev = &timer.next;
+        head = &timer;
+        timer.pprev = &head;
+        timer.level = (int8_t) level;
+        timer.slot = (uint8_t) slot;
+        int bit = (int) (&head - slots);
+        occupied[bit >> 6] |= (uint64_t) 1 << (bit & 63);
+    }
+
+    void TimerWheel::unlink(Timer& timer) {
+        *timer.pprev = timer.next;
+        if (timer.next) timer.next->pprev = timer.pprev;
+        if (timer.level >= 0) {
+            Timer*& head = slotHead(timer.level, timer.slot);
+            if (!head) {
+                int bit = (int) (&head - slots);
+                occupied[bit >> 6] &= ~((uint64_t) 1 << (bit & 63));
+            }
+        }
+        timer.next = nullptr;
+        timer.pprev = nullptr;
+    }
+
+    void TimerWheel::cascade(int level) {
+        int slot = (int) ((currentTick >> levelShift(level)) & (levelSlots(level) - 1));
+        Timer*& head = slotHead(level, slot);
+        Timer* list = head;
+        head = nullptr;
+        int bit = (int) (&head - slots);
+        occupied[bit >> 6] &= ~((uint64_t) 1 << (bit & 63));
+        while (list) {
+            Timer* t = list;
+            list = t->next;
+            insert(*t);
+        }
+    }
+
+    void TimerWheel::advance(Clock::time_point now) {
+        uint64_t target = toTicks(now);
+        if (count == 0) {
+            currentTick = std::max(currentTick, target);
+            return;
+        }
+        while (currentTick < target) {
+            currentTick++;
+
+            // a level is cascaded every time the one below it comes round to slot 0
+            for (int level = 1; level < LEVELS; level++) {
+                if (currentTick & ((1 << levelShift(level)) - 1)) break;
+                cascade(level);
+            }
+
+            // detach the due slot first, callbacks may schedule or cancel anything
+            Timer*& head = slotHead(0, (int) (currentTick & (LEVEL0_SLOTS - 1)));
+            if (!head) continue;
+            Timer* due = head;
+            head = nullptr;
+            occupied[(currentTick & (LEVEL0_SLOTS - 1)) >> 6] &= ~((uint64_t) 1 << (currentTick & 63));
+            due->pprev = &due;
+            for (Timer* t = due; t; t = t->next) t->level = -1;
+
+            while (due) {
+                Timer* t = due;
+                unlink(*t);
+                count--;
+                t->callback();
+            }
+            if (count == 0) {
+                currentTick = target;
+                return;
+            }
+        }
+    }
+
+    int TimerWheel::msUntilNext(Clock::time_point now) const {
+        if (count == 0) return -1;
+
+        uint64_t next = UINT64_MAX;
+        for (int level = 0; level < LEVELS; level++) {
+            int shift = levelShift(level);
+            int n = levelSlots(level);
+            int base = level == 0 ? 0 : LEVEL0_SLOTS + (level - 1) * LEVELN_SLOTS;
+            uint64_t pos = (currentTick >> shift) + 1;
+
+            // first occupied slot going round once from the next one
+            for (int d = 0; d < n;) {
+                int bit = base + (int) ((pos + d) & (n - 1));
+                uint64_t word = occupied[bit >> 6] >> (bit & 63);
+                if (word) {
+                    int dist = d + __builtin_ctzll(word);
+                    // level 0 slots fire at their tick, higher ones are due when they cascade
+                    if (dist < n) next = std::min(next, (pos + dist) << shift);
+                    break;
+                }
+                d += 64 - (bit & 63);
+            }
+        }
+        if (next == UINT64_MAX) return -1;
+
+        auto at = start + std::chrono::milliseconds(next * TICK_MS);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(at - now).count();
+        return ms > 0 ? (int) std::min<int64_t>(ms + 1, INT32_MAX) : 0;
+    }
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+
+namespace Retchat {
+
+    class TimerWheel;
+
+    // a deadline owned by whoever embeds it. scheduling and cancelling are O(1) and never
+    // allocate; destroying a scheduled timer cancels it
+    class Timer {
+    public:
+        explicit Timer(std::function<void()> fn) : callback(std::move(fn)) {}
+        ~Timer();
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        bool isScheduled() const { return pprev != nullptr; }
+
+    private:
+        friend class TimerWheel;
+        std::function<void()> callback;
+        TimerWheel* wheel = nullptr;
+        uint64_t expiry = 0;  // in ticks
+        Timer* next = nullptr;
+        Timer** pprev = nullptr;
+        int8_t level = -1;
+        uint8_t slot = 0;
+    };
+
+    // hierarchical timing wheel, one per event loop and only touched from its thread.
+    // the first level has one slot per tick, every level above covers a whole rotation of
+    // the one below per slot and is cascaded down as time reaches it, so a timer is touched
+    // at most once per level no matter how far out it is
+    class TimerWheel {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        TimerWheel();
+        ~TimerWheel();
+
+        void schedule(Timer& timer, std::chrono::milliseconds delay);
+        void cancel(Timer& timer);
+
+        // fires everything that's due
+        void advance(Clock::time_point now);
+        // how long the loop may sleep before something has to happen, -1 when nothing is scheduled
+        int msUntilNext(Clock::time_point now) const;
+
+        size_t size() const { return count; }
+
+    private:
+        static constexpr int LEVELS = 4;
+        static constexpr int LEVEL0_BITS = 8;
+        static constexpr int LEVELN_BITS = 6;
+        static constexpr int LEVEL0_SLOTS = 1 << LEVEL0_BITS;
+        static constexpr int LEVELN_SLOTS = 1 << LEVELN_BITS;
+        static constexpr int SLOTS = LEVEL0_SLOTS + (LEVELS - 1) * LEVELN_SLOTS;
+
+        uint64_t toTicks(Clock::time_point t) const;
+        void insert(Timer& timer);
+        void unlink(Timer& timer);
+        void cascade(int level);
+        int levelShift(int level) const;
+        int levelSlots(int level) const;
+        Timer*& slotHead(int level, int slot);
+
+        Clock::time_point start;
+        uint64_t currentTick = 0;
+        size_t count = 0;
+
+        Timer* slots[SLOTS] = {};
+        uint64_t occupied[SLOTS / 64] = {};  // one bit per slot, for finding the next deadline quickly
+    };
+
+}